@@ -0,0 +1,779 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aot.h"
+#include "codeProtection.h"
+#include "decode.h"
+#include "engine.h"
+#include "startup.h"
+#include "virtualMachine.h"
+
+/*
+ * Ahead-of-time translation. The loaded image is translated into a C source
+ * file with one label per basic block: statically known BR/JSR targets and
+ * fall-throughs become direct gotos, and JMP/JSRR/RET/TRAP/RTI go through a
+ * switch on the PC.
+ *
+ * With --aot-return-stack, returns are predicted with a shadow stack: JSR/JSRR
+ * push the return address and the number of the call site, and a RET whose
+ * R7 matches the top entry goes through a switch over the call sites only,
+ * which the compiler turns into a few compares and direct jumps. A guest
+ * that changes R7 itself just mispredicts, which empties the stack and takes
+ * the switch on the PC. It is off by default: the switch on the PC is a dense
+ * jump table for any normal image, and the pushes cost more than they save
+ * (fib(20) x600 ran about 20% slower with it). The guest registers live in locals and are written back
+ * to reg[] only around calls into the VM (traps, device registers,
+ * interrupts). The file is compiled with the host compiler at -O2 into a
+ * shared object, cached by a hash of the translated code, and loaded with
+ * dlopen().
+ *
+ * Code is discovered by following control flow from the entry point and from
+ * the interrupt vector table. Anything else (code only reached through a
+ * register, or an RTI into the middle of a block) is interpreted with the
+ * reference handlers up to the next control-flow instruction and then
+ * translated code is entered again. A store into translated code drops back
+ * to the interpreter for the rest of the run, so self-modifying guests still
+ * behave exactly as they do in the switch engine. Translated code checks its
+ * own stores; the translated addresses are also registered with protectCode()
+ * so that stores made while interpreting are caught by invalidateCode.
+ */
+
+#define AOT_RETURN_STACK 64  // Shadow return stack entries (power of two)
+
+const char *aotCacheDir = NULL;  // --aot-cache
+int aotReturnStack = 0;          // --aot-return-stack
+
+static uint8_t isCode[MAX_MEMORY];    // Address holds a translated instruction
+static uint8_t isLeader[MAX_MEMORY];  // Address starts a basic block
+static uint8_t isQueued[MAX_MEMORY];
+static uint16_t callSite[MAX_MEMORY];  // Number of the JSR/JSRR at each address
+static uint16_t worklist[MAX_MEMORY];
+static int worklistSize = 0;
+static uint16_t codeAddresses[MAX_MEMORY];  // Every address in isCode[], for protectCode()
+static int codeAddressCount = 0;
+static int codeModified = 0;  // A store outside translated code hit it
+
+// Run statistics reported with --bench
+static int translatedInstructions = 0;
+static int translatedBlocks = 0;
+static double compileSeconds = 0;
+static int loadedFromCache = 0;
+static uint64_t dispatchExits = 0;
+static uint64_t smcExits = 0;
+
+/*
+ * Mark an address as the start of a block and queue it for discovery.
+ *
+ * address: Address of the block
+ * return: void
+ */
+static void addLeader(uint16_t address)
+{
+    if (address >= MR_KBSR) {
+        return;
+    }
+    isLeader[address] = 1;
+    if (!isQueued[address]) {
+        isQueued[address] = 1;
+        worklist[worklistSize++] = address;
+    }
+}
+
+/*
+ * Follow straight-line code from an address, marking every instruction as
+ * code and queueing the targets of branches and subroutine calls.
+ *
+ * address: Where to start walking
+ * return: void
+ */
+static void walk(uint16_t address)
+{
+    while (address < MR_KBSR && !isCode[address]) {
+        uint16_t instruction = memory[address];
+        uint16_t next = address + 1;
+        isCode[address] = 1;
+
+        switch (instruction >> 12) {
+            case OP_BR: {
+                uint16_t mask = (instruction >> 9) & 0x7;
+                if (mask) {
+                    addLeader(next + signExtend(instruction & 0x1FF, 9));
+                }
+                if (mask == 0x7) {
+                    return;  // Unconditional: no fall-through
+                }
+                addLeader(next);
+                break;
+            }
+            case OP_JSR:
+                if (instruction & 0x800) {
+                    addLeader(next + signExtend(instruction & 0x7FF, 11));
+                }
+                addLeader(next);  // Return address
+                break;
+            case OP_TRAP:
+                if ((instruction & 0xFF) == TRAP_HALT) {
+                    return;
+                }
+                addLeader(next);
+                break;
+            case OP_JMP:
+            case OP_RTI:
+            case OP_RES:
+                return;
+            default:
+                break;
+        }
+        address = next;
+    }
+
+    if (address < MR_KBSR) {
+        isLeader[address] = 1;  // Ran into code that was walked before
+    }
+}
+
+/*
+ * Find the code to translate, starting from the PC and every installed
+ * interrupt/exception handler.
+ *
+ * return: void
+ */
+static void discoverCode()
+{
+    addLeader(reg[R_PC]);
+    for (int vector = 0; vector < 0x100; vector++) {
+        if (memory[INT_VECTOR_TABLE + vector]) {
+            addLeader(memory[INT_VECTOR_TABLE + vector]);
+        }
+    }
+    while (worklistSize > 0) {
+        walk(worklist[--worklistSize]);
+    }
+}
+
+/*
+ * Hash everything the generated code depends on (FNV-1a), so a cached
+ * translation is only reused for the same code.
+ *
+ * return: 64-bit hash
+ */
+static uint64_t hashCode()
+{
+    uint64_t hash = aotHashWord(AOT_HASH_SEED, AOT_VERSION);
+    hash = aotHashWord(hash, aotReturnStack);
+    hash = aotHashWord(hash, reg[R_PC]);
+    for (int vector = 0; vector < 0x100; vector++) {
+        hash = aotHashWord(hash, memory[INT_VECTOR_TABLE + vector]);
+    }
+    for (uint32_t address = 0; address < MR_KBSR; address++) {
+        if (isCode[address]) {
+            hash = aotHashWord(hash, address);
+            hash = aotHashWord(hash, memory[address]);
+        }
+    }
+    return hash;
+}
+
+/*
+ * Emit a jump to a statically known address: a direct goto when the target
+ * is translated, otherwise a return to the host dispatcher.
+ *
+ * out: Generated source
+ * target: Address to continue at
+ * return: void
+ */
+static void emitGoto(FILE *out, uint16_t target)
+{
+    if (target < MR_KBSR && isCode[target] && isLeader[target]) {
+        fprintf(out, "    goto L%04X;\n", target);
+    } else {
+        fprintf(out, "    EXIT(0x%04X, %d);\n", target, AOT_EXIT_DISPATCH);
+    }
+}
+
+/*
+ * Emit code that takes back the retired-instruction counts of the rest of a
+ * block when it is left early (a halting or self-modifying store).
+ *
+ * out: Generated source
+ * from: First instruction that will not run
+ * end: End of the block (exclusive)
+ * return: void
+ */
+static void emitUncount(FILE *out, uint16_t from, uint16_t end)
+{
+    for (uint16_t address = from; address != end; address++) {
+        fprintf(out, "n[%d]--; ", memory[address] >> 12);
+    }
+}
+
+/*
+ * Emit a store of register src to the address held in the local "a".
+ *
+ * out: Generated source
+ * address: Address of the store instruction
+ * end: End of the block (exclusive)
+ * return: void
+ */
+static void emitStore(FILE *out, uint16_t address, uint16_t end)
+{
+    uint16_t next = address + 1;
+    uint16_t srcReg = (memory[address] >> 9) & 0x7;
+    fprintf(out, "    if (a < 0x%04X) { mem[a] = r%d; if (code[a]) { ", MR_KBSR, srcReg);
+    emitUncount(out, next, end);
+    fprintf(out, "host->smcAddress = a; EXIT(0x%04X, %d); } }\n", next, AOT_EXIT_SMC);
+    fprintf(out, "    else { SYNC(0x%04X); host->memWrite(a, r%d); RELOAD(); if (!*host->running) { ", next, srcReg);
+    emitUncount(out, next, end);
+    fprintf(out, "return %d; } }\n", AOT_EXIT_HALT);
+}
+
+/*
+ * Emit the C code for an instruction that only computes or loads: ADD, AND,
+ * NOT, LEA, LD, LDR and LDI. These never leave translated code.
+ *
+ * out: Generated source
+ * address: Address of the instruction
+ * instruction: The instruction word
+ * return: 1 if code was emitted, 0 for any other instruction
+ */
+int aotEmitDataOperation(FILE *out, uint16_t address, uint16_t instruction)
+{
+    uint16_t next = address + 1;
+    uint16_t destReg = (instruction >> 9) & 0x7;
+    uint16_t srcReg1 = (instruction >> 6) & 0x7;
+    uint16_t pcOffset9 = signExtend(instruction & 0x1FF, 9);
+
+    switch (instruction >> 12) {
+        case OP_ADD:
+        case OP_AND: {
+            const char *op = (instruction >> 12) == OP_ADD ? "+" : "&";
+            if (instruction & 0x20) {
+                fprintf(out, "    r%d = r%d %s 0x%04X;", destReg, srcReg1, op, signExtend(instruction & 0x1F, 5));
+            } else {
+                fprintf(out, "    r%d = r%d %s r%d;", destReg, srcReg1, op, instruction & 0x7);
+            }
+            fprintf(out, " cond = COND(r%d);\n", destReg);
+            return 1;
+        }
+        case OP_NOT:
+            fprintf(out, "    r%d = ~r%d; cond = COND(r%d);\n", destReg, srcReg1, destReg);
+            return 1;
+        case OP_LEA:
+            fprintf(out, "    r%d = 0x%04X; cond = COND(r%d);\n", destReg, (uint16_t)(next + pcOffset9), destReg);
+            return 1;
+        case OP_LD:
+            fprintf(out, "    r%d = RD(0x%04X); cond = COND(r%d);\n", destReg, (uint16_t)(next + pcOffset9), destReg);
+            return 1;
+        case OP_LDR:
+            fprintf(out, "    { uint16_t a = r%d + 0x%04X; r%d = RD(a); cond = COND(r%d); }\n", srcReg1,
+                    signExtend(instruction & 0x3F, 6), destReg, destReg);
+            return 1;
+        case OP_LDI:
+            fprintf(out, "    { uint16_t a = RD(0x%04X); r%d = RD(a); cond = COND(r%d); }\n",
+                    (uint16_t)(next + pcOffset9), destReg, destReg);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Emit the C code for one instruction.
+ *
+ * out: Generated source
+ * address: Address of the instruction
+ * end: End of its block (exclusive)
+ * return: void
+ */
+static void emitInstruction(FILE *out, uint16_t address, uint16_t end)
+{
+    uint16_t instruction = memory[address];
+    uint16_t next = address + 1;
+    uint16_t destReg = (instruction >> 9) & 0x7;
+    uint16_t srcReg1 = (instruction >> 6) & 0x7;
+    uint16_t pcOffset9 = signExtend(instruction & 0x1FF, 9);
+
+    fprintf(out, "    /* %04X: %04X */\n", address, instruction);
+    if (aotEmitDataOperation(out, address, instruction)) {
+        return;
+    }
+    switch (instruction >> 12) {
+        case OP_BR: {
+            uint16_t mask = destReg;
+            uint16_t target = next + pcOffset9;
+            if (mask) {
+                fprintf(out, "    if (cond & %d) {\n", mask);
+                if ((uint16_t)(address - target) < SPIN_MAX_BODY) {
+                    fprintf(out, "    SYNC(0x%04X); host->detectSpinLoop(0x%04X);\n", target, address);
+                }
+                fprintf(out, "    BOUNDARY(0x%04X);\n", target);
+                emitGoto(out, target);
+                fprintf(out, "    }\n");
+            }
+            if (mask != 0x7) {
+                fprintf(out, "    BOUNDARY(0x%04X);\n", next);
+                emitGoto(out, next);
+            }
+            break;
+        }
+        case OP_ST:
+            fprintf(out, "    { uint16_t a = 0x%04X;\n", (uint16_t)(next + pcOffset9));
+            emitStore(out, address, end);
+            fprintf(out, "    }\n");
+            break;
+        case OP_STR:
+            fprintf(out, "    { uint16_t a = r%d + 0x%04X;\n", srcReg1, signExtend(instruction & 0x3F, 6));
+            emitStore(out, address, end);
+            fprintf(out, "    }\n");
+            break;
+        case OP_STI:
+            fprintf(out, "    { uint16_t a = RD(0x%04X);\n", (uint16_t)(next + pcOffset9));
+            emitStore(out, address, end);
+            fprintf(out, "    }\n");
+            break;
+        case OP_JSR:
+            if (aotReturnStack) {
+                fprintf(out, "    PUSH_RETURN(0x%04X, %d);\n", next, callSite[address]);
+            }
+            if (instruction & 0x800) {
+                uint16_t target = next + signExtend(instruction & 0x7FF, 11);
+                fprintf(out, "    r7 = 0x%04X;\n    BOUNDARY(0x%04X);\n", next, target);
+                emitGoto(out, target);
+            } else {
+                fprintf(out, "    pc = r%d; r7 = 0x%04X;\n    BOUNDARY(pc);\n    goto dispatch;\n", srcReg1, next);
+            }
+            break;
+        case OP_JMP:
+            fprintf(out, "    pc = r%d;\n    BOUNDARY(pc);\n", srcReg1);
+            if (aotReturnStack && srcReg1 == R_R7) {
+                fprintf(out, "    RETURN();\n");
+            }
+            fprintf(out, "    goto dispatch;\n");
+            break;
+        case OP_TRAP:
+            fprintf(out, "    SYNC(0x%04X); host->executeTrapCode(0x%04X); RELOAD();\n", next, instruction);
+            fprintf(out, "    if (!*host->running) return %d;\n", AOT_EXIT_HALT);
+            fprintf(out, "    BOUNDARY(0x%04X);\n", next);
+            emitGoto(out, next);
+            break;
+        case OP_RTI:
+            fprintf(out, "    SYNC(0x%04X); host->returnFromInterrupt(); RELOAD();\n", next);
+            fprintf(out, "    if (!*host->running) return %d;\n", AOT_EXIT_HALT);
+            fprintf(out, "    BOUNDARY(pc);\n    goto dispatch;\n");
+            break;
+        default:  // OP_RES
+            fprintf(out, "    SYNC(0x%04X); host->raiseException(0x%02X); RELOAD();\n    goto dispatch;\n", next,
+                    INT_ILLEGAL_OP);
+            break;
+    }
+}
+
+/*
+ * Find where the block starting at an address ends: at a control-flow
+ * instruction, the next leader, or the end of the discovered code.
+ *
+ * start: First instruction of the block
+ * return: Address after the block's last instruction
+ */
+static uint32_t blockEnd(uint32_t start)
+{
+    uint32_t end = start;
+    while (end < MR_KBSR && isCode[end] && (end == start || !isLeader[end])) {
+        end++;
+        if (isControlFlow(memory[end - 1] >> 12)) {
+            break;
+        }
+    }
+    return end;
+}
+
+/*
+ * Write the translation of every discovered block as a C translation unit.
+ *
+ * out: Where to write the source
+ * context: Unused
+ * return: void
+ */
+static void generateSource(FILE *out, const void *context)
+{
+    (void)context;
+    aotEmitPrelude(out);
+    int callSites = 0;
+    if (aotReturnStack) {
+        for (uint32_t address = 0; address < MR_KBSR; address++) {
+            if (isCode[address] && (memory[address] >> 12) == OP_JSR) {
+                callSite[address] = callSites++;
+            }
+        }
+        fprintf(out, "    uint16_t returnAddress[%d];\n    uint16_t returnSite[%d];\n    unsigned returnTop = 0;\n",
+                AOT_RETURN_STACK, AOT_RETURN_STACK);
+        fprintf(out, "#define PUSH_RETURN(address, site) do { returnAddress[returnTop & %d] = (address); "
+                     "returnSite[returnTop++ & %d] = (site); } while (0)\n", AOT_RETURN_STACK - 1,
+                AOT_RETURN_STACK - 1);
+        fprintf(out, "#define RETURN() do { if (returnTop && returnAddress[(returnTop - 1) & %d] == pc) "
+                     "goto returnPredicted; host->returnMisses++; returnTop = 0; } while (0)\n",
+                AOT_RETURN_STACK - 1);
+    }
+    fprintf(out, "    goto dispatch;\n\n");
+
+    for (uint32_t start = 0; start < MR_KBSR; start++) {
+        if (!isCode[start]) {
+            continue;
+        }
+
+        uint32_t end = blockEnd(start);
+        fprintf(out, "L%04X:\n", start);
+        int opCounts[OP_COUNT] = {0};
+        for (uint32_t address = start; address < end; address++) {
+            opCounts[memory[address] >> 12]++;
+        }
+        for (int op = 0; op < OP_COUNT; op++) {
+            if (opCounts[op]) {
+                fprintf(out, "    n[%d] += %d;\n", op, opCounts[op]);
+            }
+        }
+        for (uint32_t address = start; address < end; address++) {
+            emitInstruction(out, (uint16_t)address, (uint16_t)end);
+        }
+        if (!isControlFlow(memory[end - 1] >> 12)) {
+            emitGoto(out, (uint16_t)end);
+        }
+        start = end - 1;
+    }
+
+    if (aotReturnStack) {
+        fprintf(out, "\nreturnPredicted:\n    switch (returnSite[--returnTop & %d]) {\n", AOT_RETURN_STACK - 1);
+        for (uint32_t address = 0; address < MR_KBSR; address++) {
+            uint16_t next = address + 1;
+            if (isCode[address] && (memory[address] >> 12) == OP_JSR && isCode[next] && isLeader[next]) {
+                fprintf(out, "        case %d: goto L%04X;\n", callSite[address], next);
+            }
+        }
+        fprintf(out, "    }\n");
+    }
+
+    fprintf(out, "\ndispatch:\n");
+    fprintf(out, "    switch (pc) {\n");
+    for (uint32_t address = 0; address < MR_KBSR; address++) {
+        if (isCode[address] && isLeader[address]) {
+            fprintf(out, "        case 0x%04X: goto L%04X;\n", address, address);
+        }
+    }
+    fprintf(out, "    }\n    EXIT(pc, %d);\n}\n", AOT_EXIT_DISPATCH);
+}
+
+/*
+ * Write the prelude every generated translation unit starts with: the host
+ * interface and the macros the generated code is written in.
+ *
+ * out: Generated source
+ * return: void
+ */
+void aotEmitPrelude(FILE *out)
+{
+    fprintf(out, "/* Generated by the LC-3 VM translator, version %d. */\n", AOT_VERSION);
+    fprintf(out, "#include <signal.h>\n#include <stdint.h>\n\n%s\n\n", AOT_HOST_SOURCE);
+    fprintf(out, "#define COND(v) ((v) >> 15 ? %d : (v) ? %d : %d)\n", FL_NEG, FL_POS, FL_ZRO);
+    fprintf(out, "#define SYNC(p) do { reg[0] = r0; reg[1] = r1; reg[2] = r2; reg[3] = r3; reg[4] = r4; "
+                 "reg[5] = r5; reg[6] = r6; reg[7] = r7; reg[%d] = cond; reg[%d] = (p); } while (0)\n",
+            R_COND, R_PC);
+    fprintf(out, "#define RELOAD() do { r0 = reg[0]; r1 = reg[1]; r2 = reg[2]; r3 = reg[3]; r4 = reg[4]; "
+                 "r5 = reg[5]; r6 = reg[6]; r7 = reg[7]; cond = reg[%d]; pc = reg[%d]; } while (0)\n",
+            R_COND, R_PC);
+    fprintf(out, "#define EXIT(p, status) do { SYNC(p); return status; } while (0)\n");
+    fprintf(out, "#define RD(a) ((uint16_t)(a) < 0x%04X ? mem[(uint16_t)(a)] : (reg[%d] = cond, "
+                 "host->memRead(a)))\n", MR_KBSR, R_COND);
+    // The --lockstep candidate goes to the host at every boundary, not only with interrupts enabled
+    char due[32] = "1";
+    if (!boundaryChecks) {
+        snprintf(due, sizeof(due), "mem[0x%04X] & 0x%04X", MR_KBSR, KB_IE);
+    }
+    fprintf(out, "#define BOUNDARY(p) do { uint16_t target = (p); if (%s) { SYNC(target); "
+                 "host->checkInterrupts(); RELOAD(); if (!*host->running) return %d; "
+                 "if (pc != target || host->abandoned) goto dispatch; } } while (0)\n\n", due, AOT_EXIT_HALT);
+
+    fprintf(out, "int lc3Run(struct aotHost *host)\n{\n");
+    fprintf(out, "    uint16_t *reg = host->reg;\n    uint16_t *mem = host->memory;\n");
+    fprintf(out, "    uint64_t *n = host->opcodeCounts;\n    const uint8_t *code = host->codeMap;\n");
+    fprintf(out, "    uint16_t r0, r1, r2, r3, r4, r5, r6, r7, cond, pc;\n");
+    fprintf(out, "    RELOAD();\n");
+}
+
+/*
+ * Make sure the default cache directory is one only this user can write to.
+ * Objects are loaded from it by a predictable name, so a directory another
+ * user created first (or a symlink they planted) must not be trusted.
+ *
+ * dir: Directory to check, created if it does not exist
+ * return: 0 if it is safe to use, -1 otherwise
+ */
+static int checkPrivateDir(const char *dir)
+{
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "aot: cannot create cache directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    struct stat info;
+    if (lstat(dir, &info) != 0) {
+        fprintf(stderr, "aot: cannot use cache directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    if (!S_ISDIR(info.st_mode) || info.st_uid != getuid() || (info.st_mode & 077)) {
+        fprintf(stderr, "aot: cache directory %s is not a private directory owned by this user\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Compile a translation unit into a shared object and move it into place.
+ * The compiler runs in a grandchild and the rename in the child, so neither
+ * goes through a shell, and a compile outlives a VM that exits first. The
+ * rename is atomic, so concurrent VMs never load a partial object.
+ *
+ * sourcePath: Translation unit to compile
+ * tempObject: Where the compiler writes the object
+ * objectPath: Where the object is moved once it is complete
+ * return: 0 on success, -1 if the compile failed
+ */
+static int compileObject(const char *sourcePath, const char *tempObject, const char *objectPath)
+{
+    // $CC may name a compiler with options ("ccache gcc"): split it on spaces
+    char compiler[256];
+    char *argv[32];
+    int argc = 0;
+    snprintf(compiler, sizeof(compiler), "%s", getenv("CC") ? getenv("CC") : "cc");
+    for (char *word = strtok(compiler, " \t"); word && argc < 24; word = strtok(NULL, " \t")) {
+        argv[argc++] = word;
+    }
+    if (argc == 0) {
+        argv[argc++] = "cc";
+    }
+    const char *options[] = {"-O2", "-w", "-shared", "-fPIC", "-o", tempObject, sourcePath};
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+        argv[argc++] = (char *)options[i];
+    }
+    argv[argc] = NULL;
+
+    pid_t child = fork();
+    if (child < 0) {
+        return -1;
+    }
+    if (child == 0) {
+        pid_t compilerPid = fork();
+        if (compilerPid == 0) {
+            execvp(argv[0], argv);
+            _exit(127);
+        }
+        int status;
+        if (compilerPid < 0 || waitpid(compilerPid, &status, 0) < 0 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0 || rename(tempObject, objectPath) != 0) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    int status;
+    while (waitpid(child, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/*
+ * Generate, compile and load a translation, or load the cached object when
+ * one with the same hash exists. Safe to call from any thread.
+ *
+ * hash: Hash of everything the generated code depends on
+ * generate: Writes the translation unit (starting with aotEmitPrelude())
+ * context: Passed to generate
+ * object: Receives the loaded entry point and how it was obtained
+ * return: 0 on success, -1 if no translation could be loaded
+ */
+int aotBuild(uint64_t hash, void (*generate)(FILE *out, const void *context), const void *context,
+             struct aotObject *object)
+{
+    char defaultDir[64];
+    const char *dir = aotCacheDir;
+    if (!dir) {
+        snprintf(defaultDir, sizeof(defaultDir), "/tmp/lc3-aot-%d", (int)getuid());
+        dir = defaultDir;
+        if (checkPrivateDir(dir) != 0) {
+            return -1;
+        }
+    } else if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "aot: cannot create cache directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    hash = aotHashWord(hash, boundaryChecks);  // Changes the prelude's BOUNDARY
+    char sourcePath[4000];
+    char objectPath[4000];
+    char tempSource[4096];
+    char tempObject[4096];
+    snprintf(sourcePath, sizeof(sourcePath), "%s/lc3-%016llx.c", dir, (unsigned long long)hash);
+    snprintf(objectPath, sizeof(objectPath), "%s/lc3-%016llx.so", dir, (unsigned long long)hash);
+
+    object->cached = access(objectPath, R_OK) == 0;
+    object->compileSeconds = 0;
+    if (!object->cached) {
+        snprintf(tempSource, sizeof(tempSource), "%s.%d.%lx", sourcePath, (int)getpid(),
+                 (unsigned long)pthread_self());
+        FILE *out = fopen(tempSource, "w");
+        if (!out) {
+            fprintf(stderr, "aot: cannot write %s: %s\n", tempSource, strerror(errno));
+            return -1;
+        }
+        generate(out, context);
+        fclose(out);
+        rename(tempSource, sourcePath);
+
+        snprintf(tempObject, sizeof(tempObject), "%s.%d.%lx", objectPath, (int)getpid(),
+                 (unsigned long)pthread_self());
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int status = compileObject(sourcePath, tempObject, objectPath);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        object->compileSeconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        if (status != 0) {
+            fprintf(stderr, "aot: compiling %s failed\n", sourcePath);
+            remove(tempObject);
+            return -1;
+        }
+    }
+
+    object->library = dlopen(objectPath, RTLD_NOW | RTLD_LOCAL);
+    if (!object->library) {
+        fprintf(stderr, "aot: %s\n", dlerror());
+        return -1;
+    }
+    struct stat info;
+    object->size = stat(objectPath, &info) == 0 ? (size_t)info.st_size : 0;
+    *(void **)&object->entry = dlsym(object->library, "lc3Run");  // POSIX way to get a function pointer from dlsym
+    if (!object->entry) {
+        dlclose(object->library);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Translate the loaded image (or reuse a cached translation of the same
+ * code), compile it and load it.
+ *
+ * return: Entry point of the translated code, or NULL if it is unavailable
+ */
+static aotEntry *loadTranslation()
+{
+    discoverCode();
+    for (uint32_t start = 0; start < MR_KBSR; start++) {
+        if (isCode[start]) {
+            uint32_t end = blockEnd(start);
+            translatedBlocks++;
+            translatedInstructions += end - start;
+            start = end - 1;
+        }
+    }
+
+    struct aotObject object;
+    if (aotBuild(hashCode(), generateSource, NULL, &object) != 0) {
+        return NULL;
+    }
+    loadedFromCache = object.cached;
+    compileSeconds = object.compileSeconds;
+    return object.entry;
+}
+
+/*
+ * Note a store into translated code made outside of it (while interpreting,
+ * or by an interrupt pushing onto the stack). The translation cannot be
+ * dropped while it may be running, so runAotEngine() checks the flag.
+ *
+ * address: Address that was written
+ * return: void
+ */
+static void noteCodeModified(uint16_t address)
+{
+    (void)address;
+    codeModified = 1;
+}
+
+/*
+ * Run the guest with ahead-of-time translated code, interpreting whatever
+ * was not translated. Falls back to the switch engine if no translation can
+ * be produced, or once the guest writes into its own translated code.
+ *
+ * return: void
+ */
+void runAotEngine()
+{
+    if (startCodeProtection() != 0) {
+        fprintf(stderr, "aot: cannot catch stores into code, using switch\n");
+        runSwitchEngine();
+        return;
+    }
+    aotEntry *entry = loadTranslation();
+    for (uint32_t address = 0; entry && address < MR_KBSR; address++) {
+        if (isCode[address]) {
+            codeAddresses[codeAddressCount++] = address;
+        }
+    }
+    if (!entry || protectCode(codeAddresses, codeAddressCount) != 0) {
+        fprintf(stderr, "aot: translation unavailable, using switch\n");
+        runSwitchEngine();
+        return;
+    }
+    invalidateCode = noteCodeModified;
+
+    struct aotHost host = {
+        reg, writableMemory, opcodeCounts, translatedCode, &running, memRead, memWrite, executeTrapCode,
+        returnFromInterrupt, raiseException, checkInterrupts, detectSpinLoop, 0, 0, 0, 0
+    };
+
+    startupMark(STARTUP_ENGINE_READY);
+    while (running) {
+        int status = entry(&host);
+        if (status == AOT_EXIT_HALT) {
+            break;
+        }
+
+        // Not the start of a translated block: interpret to the end of the block
+        if (status == AOT_EXIT_DISPATCH && !codeModified) {
+            dispatchExits++;
+            while (running && !codeModified && !isControlFlow(stepInstruction())) {
+            }
+        }
+        if (status == AOT_EXIT_SMC || codeModified) {
+            smcExits++;
+            unprotectCode(codeAddresses, codeAddressCount);
+            invalidateCode = NULL;
+            if (running) {
+                runSwitchEngine();
+            }
+            break;
+        }
+    }
+
+    if (benchEnabled) {
+        fprintf(stderr, "\naot: %d instructions in %d blocks, %s (%.3f s), dispatcher exits %llu, "
+                "self-modifying exits %llu\n", translatedInstructions, translatedBlocks,
+                loadedFromCache ? "cached" : "compiled", compileSeconds, (unsigned long long)dispatchExits,
+                (unsigned long long)smcExits);
+        if (aotReturnStack) {
+            fprintf(stderr, "aot: %llu subroutine calls, %llu returns mispredicted\n",
+                    (unsigned long long)opcodeCounts[OP_JSR], (unsigned long long)host.returnMisses);
+        }
+    }
+}
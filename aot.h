@@ -0,0 +1,81 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define AOT_VERSION 6  // Bump whenever the generated code changes
+#define AOT_HASH_SEED 14695981039346656037ULL
+
+// Ways translated code can return to the host
+enum {
+    AOT_EXIT_HALT,      // The machine stopped running
+    AOT_EXIT_DISPATCH,  // reg[R_PC] is not the start of a translated block
+    AOT_EXIT_SMC        // A store modified translated code
+};
+
+// Everything translated code needs from the VM. The generated source gets a
+// copy of this definition (see AOT_HOST_SOURCE) so the two cannot drift.
+#define AOT_HOST_DEFINITION                                 \
+    struct aotHost {                                        \
+        uint16_t *reg;                                      \
+        uint16_t *memory;                                   \
+        uint64_t *opcodeCounts;                             \
+        const uint8_t *codeMap;                             \
+        volatile sig_atomic_t *running;                     \
+        uint16_t (*memRead)(uint16_t address);              \
+        uint16_t (*memWrite)(uint16_t address, uint16_t value); \
+        void (*executeTrapCode)(uint16_t instruction);      \
+        void (*returnFromInterrupt)(void);                  \
+        void (*raiseException)(uint16_t vector);            \
+        void (*checkInterrupts)(void);                      \
+        void (*detectSpinLoop)(uint16_t branchAddr);        \
+        uint16_t smcAddress;  /* Set with AOT_EXIT_SMC */  \
+        uint16_t smcValue;  /* Store a trace left before */ \
+        uint64_t returnMisses;  /* Shadow return stack */   \
+        int abandoned;  /* The running code was dropped */  \
+    };
+
+AOT_HOST_DEFINITION
+
+#define AOT_STRINGIFY(x) #x
+#define AOT_EXPAND_STRINGIFY(x) AOT_STRINGIFY(x)
+#define AOT_HOST_SOURCE AOT_EXPAND_STRINGIFY(AOT_HOST_DEFINITION)
+
+typedef int aotEntry(struct aotHost *host);
+
+// A compiled and loaded translation
+struct aotObject {
+    void *library;          // dlopen() handle
+    aotEntry *entry;
+    int cached;             // Loaded from the cache without compiling
+    double compileSeconds;
+    size_t size;            // Bytes of the shared object
+};
+
+extern const char *aotCacheDir;
+extern int aotReturnStack;
+
+/*
+ * Add a word to an FNV-1a hash. Translations are cached by a hash of
+ * everything the generated code depends on.
+ *
+ * hash: Hash so far
+ * word: Word to add
+ * return: The new hash
+ */
+static inline uint64_t aotHashWord(uint64_t hash, uint16_t word)
+{
+    hash = (hash ^ (word & 0xFF)) * 1099511628211ULL;
+    return (hash ^ (word >> 8)) * 1099511628211ULL;
+}
+
+// Function prototypes
+void aotEmitPrelude(FILE *out);
+int aotEmitDataOperation(FILE *out, uint16_t address, uint16_t instruction);
+int aotBuild(uint64_t hash, void (*generate)(FILE *out, const void *context), const void *context,
+             struct aotObject *object);
+void runAotEngine();
+
+#endif
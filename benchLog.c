@@ -0,0 +1,424 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "benchLog.h"
+#include "engine.h"
+
+/*
+ * Benchmark result store. With --bench-log=FILE every --bench run appends
+ * one JSON line to FILE:
+ *
+ *     {"time":"2026-10-16T20:41:07Z","revision":"e7a1191","engine":"table",
+ *      "workload":"fib.obj","instructions":177314528,"seconds":0.912,
+ *      "mips":194.42,"nsPerInstr":5.143,"host":{"name":"box",
+ *      "cpu":"AMD EPYC 7B13","cpus":1,"kernel":"6.1.0"}}
+ *
+ * --bench-compare=BASELINE FILE reads two such files, groups the runs by
+ * engine and workload, and compares the ns/instr of each group with a
+ * Mann-Whitney U test (normal approximation with a tie correction), which
+ * needs no assumption about how the timings are distributed. A group that
+ * is significantly slower than the baseline (p < SIGNIFICANCE) by more than
+ * --bench-threshold=PERCENT makes the command exit with status 1.
+ */
+
+#ifndef GIT_REVISION
+#define GIT_REVISION ""
+#endif
+
+#define WORKLOAD_MAX 256    // Longest workload name kept
+#define FIELD_MAX 128       // Longest string field read back from a log
+#define MIN_RUNS 5          // Fewest runs in each file before a group is tested
+#define SIGNIFICANCE 0.05   // Two-sided p-value below which a change is reported
+
+struct benchRun {
+    char engine[FIELD_MAX];
+    char workload[FIELD_MAX];
+    double nsPerInstr;
+};
+
+const char *benchLogPath = NULL;       // --bench-log
+const char *benchBaselinePath = NULL;  // --bench-compare
+double benchThreshold = 2.0;           // --bench-threshold, in percent
+
+static char workload[WORKLOAD_MAX];
+
+/*
+ * Add an image to the name of the workload: the base names of the images,
+ * joined with '+'.
+ *
+ * imagePath: Path of the image
+ * return: void
+ */
+void addBenchWorkload(const char *imagePath)
+{
+    const char *name = strrchr(imagePath, '/') ? strrchr(imagePath, '/') + 1 : imagePath;
+    size_t length = strlen(workload);
+    snprintf(workload + length, sizeof(workload) - length, "%s%s", length ? "+" : "", name);
+}
+
+/*
+ * Write a string as a JSON string literal.
+ *
+ * out: Where to write it
+ * text: The string
+ * return: void
+ */
+static void writeJsonString(FILE *out, const char *text)
+{
+    fputc('"', out);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') {
+            fprintf(out, "\\%c", *text);
+        } else if ((unsigned char)*text < 0x20) {
+            fprintf(out, "\\u%04x", *text);
+        } else {
+            fputc(*text, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/*
+ * Find the CPU model in /proc/cpuinfo.
+ *
+ * model: Receives the model name, or "unknown"
+ * size: Size of model
+ * return: void
+ */
+static void cpuModel(char *model, size_t size)
+{
+    snprintf(model, size, "unknown");
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    if (!cpuinfo) {
+        return;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), cpuinfo)) {
+        char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) == 0 && colon) {
+            colon += strspn(colon + 1, " \t") + 1;
+            colon[strcspn(colon, "\n")] = '\0';
+            snprintf(model, size, "%s", colon);
+            break;
+        }
+    }
+    fclose(cpuinfo);
+}
+
+/*
+ * Append the result of this run to benchLogPath.
+ *
+ * retired: Instructions retired
+ * seconds: Time the engine ran
+ * return: void
+ */
+void appendBenchLog(uint64_t retired, double seconds)
+{
+    FILE *out = fopen(benchLogPath, "a");
+    if (!out) {
+        perror(benchLogPath);
+        return;
+    }
+
+    char now[32];
+    time_t clock = time(NULL);
+    strftime(now, sizeof(now), "%Y-%m-%dT%H:%M:%SZ", gmtime(&clock));
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host) - 1);
+    char model[FIELD_MAX];
+    cpuModel(model, sizeof(model));
+    struct utsname system;
+    if (uname(&system) != 0) {
+        snprintf(system.release, sizeof(system.release), "unknown");
+    }
+
+    fprintf(out, "{\"time\":\"%s\",\"revision\":", now);
+    writeJsonString(out, GIT_REVISION[0] ? GIT_REVISION : "unknown");
+    fprintf(out, ",\"engine\":\"%s\",\"workload\":", engineNames[engine]);
+    writeJsonString(out, workload);
+    fprintf(out, ",\"instructions\":%llu,\"seconds\":%.6f,\"mips\":%.2f,\"nsPerInstr\":%.4f,\"host\":{\"name\":",
+            (unsigned long long)retired, seconds, seconds > 0 ? retired / seconds / 1e6 : 0,
+            retired ? seconds * 1e9 / retired : 0);
+    writeJsonString(out, host);
+    fprintf(out, ",\"cpu\":");
+    writeJsonString(out, model);
+    fprintf(out, ",\"cpus\":%ld,\"kernel\":", sysconf(_SC_NPROCESSORS_ONLN));
+    writeJsonString(out, system.release);
+    fprintf(out, "}}\n");
+    if (fclose(out) != 0) {
+        perror(benchLogPath);
+    }
+}
+
+/*
+ * Find a top-level field of a log line and read it as a string.
+ *
+ * line: The JSON line
+ * key: Field name
+ * value: Receives the string, with escapes removed
+ * return: 0 on success, -1 if the field is missing
+ */
+static int readStringField(const char *line, const char *key, char *value)
+{
+    char pattern[FIELD_MAX];
+    snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+    const char *start = strstr(line, pattern);
+    if (!start) {
+        return -1;
+    }
+    start += strlen(pattern);
+    size_t length = 0;
+    for (; *start && *start != '"' && length < FIELD_MAX - 1; start++) {
+        if (*start == '\\' && start[1]) {
+            start++;
+        }
+        value[length++] = *start;
+    }
+    value[length] = '\0';
+    return 0;
+}
+
+/*
+ * Read the runs in a log.
+ *
+ * path: The log
+ * count: Receives the number of runs
+ * return: The runs (free them), or NULL if the file could not be read
+ */
+static struct benchRun *readBenchLog(const char *path, int *count)
+{
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        return NULL;
+    }
+    int capacity = 64;
+    struct benchRun *runs = malloc(capacity * sizeof(*runs));
+    char line[2048];
+    *count = 0;
+    while (runs && fgets(line, sizeof(line), in)) {
+        struct benchRun run;
+        const char *field = strstr(line, "\"nsPerInstr\":");
+        if (!field || readStringField(line, "engine", run.engine) != 0 ||
+            readStringField(line, "workload", run.workload) != 0) {
+            continue;  // Not a result line
+        }
+        run.nsPerInstr = strtod(field + 13, NULL);
+        if (*count == capacity) {
+            capacity *= 2;
+            struct benchRun *grown = realloc(runs, capacity * sizeof(*runs));
+            if (!grown) {
+                free(runs);
+                runs = NULL;
+                break;
+            }
+            runs = grown;
+        }
+        runs[(*count)++] = run;
+    }
+    fclose(in);
+    return runs;
+}
+
+/*
+ * Compare two doubles for qsort.
+ *
+ * a: First value
+ * b: Second value
+ * return: Negative, zero or positive as a is below, equal to or above b
+ */
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// A timing and which file it came from, for ranking
+struct rankedTiming {
+    double nsPerInstr;
+    int current;
+};
+
+/*
+ * Compare two timings for qsort.
+ *
+ * a: First timing
+ * b: Second timing
+ * return: Negative, zero or positive as a is below, equal to or above b
+ */
+static int compareTimings(const void *a, const void *b)
+{
+    return compareDoubles(&((const struct rankedTiming *)a)->nsPerInstr, &((const struct rankedTiming *)b)->nsPerInstr);
+}
+
+/*
+ * Two-sided Mann-Whitney U test of two samples.
+ *
+ * baseline: First sample
+ * baselineCount: Its size
+ * current: Second sample
+ * currentCount: Its size
+ * return: The p-value
+ */
+static double mannWhitney(const double *baseline, int baselineCount, const double *current, int currentCount)
+{
+    int total = baselineCount + currentCount;
+    struct rankedTiming *all = malloc(total * sizeof(*all));
+    if (!all) {
+        return 1;
+    }
+    for (int i = 0; i < baselineCount; i++) {
+        all[i] = (struct rankedTiming){baseline[i], 0};
+    }
+    for (int i = 0; i < currentCount; i++) {
+        all[baselineCount + i] = (struct rankedTiming){current[i], 1};
+    }
+    qsort(all, total, sizeof(*all), compareTimings);
+
+    // Sum the ranks of the current runs, giving tied timings their average rank
+    double rankSum = 0;
+    double tieTerm = 0;
+    for (int i = 0; i < total;) {
+        int j = i;
+        while (j < total && all[j].nsPerInstr == all[i].nsPerInstr) {
+            j++;
+        }
+        double rank = (i + 1 + j) / 2.0;
+        for (int k = i; k < j; k++) {
+            rankSum += all[k].current ? rank : 0;
+        }
+        double ties = j - i;
+        tieTerm += ties * ties * ties - ties;
+        i = j;
+    }
+    free(all);
+
+    double u = rankSum - currentCount * (currentCount + 1) / 2.0;
+    double mean = (double)baselineCount * currentCount / 2;
+    double variance = (double)baselineCount * currentCount / 12 * ((total + 1) - tieTerm / ((double)total * (total - 1)));
+    if (variance <= 0) {
+        return 1;  // Every timing is the same
+    }
+    double z = (fabs(u - mean) - 0.5) / sqrt(variance);  // With a continuity correction
+    return z > 0 ? erfc(z / sqrt(2)) : 1;
+}
+
+/*
+ * Median of a set of timings. Also used by the microbenchmarks.
+ *
+ * values: The timings (sorted in place)
+ * count: How many there are
+ * return: The median
+ */
+double median(double *values, int count)
+{
+    qsort(values, count, sizeof(values[0]), compareDoubles);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+/*
+ * Collect the timings of one engine and workload.
+ *
+ * runs: All the runs in a log
+ * count: How many there are
+ * group: A run of the group
+ * timings: Receives the timings (room for count)
+ * return: How many there were
+ */
+static int collectGroup(const struct benchRun *runs, int count, const struct benchRun *group, double *timings)
+{
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(runs[i].engine, group->engine) == 0 && strcmp(runs[i].workload, group->workload) == 0) {
+            timings[found++] = runs[i].nsPerInstr;
+        }
+    }
+    return found;
+}
+
+/*
+ * Compare the runs in resultsPath with those in benchBaselinePath, one
+ * engine and workload at a time, and print a table of the changes.
+ *
+ * resultsPath: Log of the runs to check
+ * return: 0 if nothing is significantly slower, 1 if something is, 2 if a
+ *         log could not be read
+ */
+int compareBenchLogs(const char *resultsPath)
+{
+    int baselineCount;
+    int resultCount;
+    struct benchRun *baseline = readBenchLog(benchBaselinePath, &baselineCount);
+    if (!baseline) {
+        perror(benchBaselinePath);
+        return 2;
+    }
+    struct benchRun *results = readBenchLog(resultsPath, &resultCount);
+    if (!results) {
+        perror(resultsPath);
+        free(baseline);
+        return 2;
+    }
+    double *before = malloc((baselineCount + 1) * sizeof(double));
+    double *after = malloc((resultCount + 1) * sizeof(double));
+    if (!before || !after) {
+        free(baseline);
+        free(results);
+        free(before);
+        free(after);
+        return 2;
+    }
+
+    printf("%-10s %-24s %15s %15s %9s %8s  %s\n", "engine", "workload", "baseline ns", "current ns", "change",
+           "p", "verdict");
+    int slower = 0;
+    for (int i = 0; i < resultCount; i++) {
+        int seen = 0;
+        for (int j = 0; j < i && !seen; j++) {
+            seen = strcmp(results[i].engine, results[j].engine) == 0 &&
+                   strcmp(results[i].workload, results[j].workload) == 0;
+        }
+        if (seen) {
+            continue;  // Group already compared
+        }
+
+        int afterCount = collectGroup(results, resultCount, &results[i], after);
+        int beforeCount = collectGroup(baseline, baselineCount, &results[i], before);
+        double afterMedian = median(after, afterCount);
+        printf("%-10s %-24s ", results[i].engine, results[i].workload);
+        if (!beforeCount) {
+            printf("%15s %9.4f (%3d) %9s %8s  no baseline\n", "-", afterMedian, afterCount, "", "");
+            continue;
+        }
+        double beforeMedian = median(before, beforeCount);
+        double change = (afterMedian / beforeMedian - 1) * 100;
+        printf("%9.4f (%3d) %9.4f (%3d) %+8.2f%% ", beforeMedian, beforeCount, afterMedian, afterCount, change);
+        if (beforeCount < MIN_RUNS || afterCount < MIN_RUNS) {
+            printf("%8s  too few runs (need %d of each)\n", "", MIN_RUNS);
+            continue;
+        }
+        double p = mannWhitney(before, beforeCount, after, afterCount);
+        const char *verdict = "no change";
+        if (p < SIGNIFICANCE && change > benchThreshold) {
+            verdict = "SLOWER";
+            slower = 1;
+        } else if (p < SIGNIFICANCE && change < -benchThreshold) {
+            verdict = "faster";
+        } else if (p < SIGNIFICANCE) {
+            verdict = "within threshold";
+        }
+        printf("%8.4f  %s\n", p, verdict);
+    }
+
+    free(baseline);
+    free(results);
+    free(before);
+    free(after);
+    return slower;
+}
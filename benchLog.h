@@ -0,0 +1,16 @@
+#ifndef BENCH_LOG_H
+#define BENCH_LOG_H
+
+#include <stdint.h>
+
+extern const char *benchLogPath;
+extern const char *benchBaselinePath;
+extern double benchThreshold;
+
+// Function prototypes
+void addBenchWorkload(const char *imagePath);
+void appendBenchLog(uint64_t retired, double seconds);
+int compareBenchLogs(const char *resultsPath);
+double median(double *values, int count);
+
+#endif
@@ -0,0 +1,309 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "callGraph.h"
+#include "callStack.h"
+#include "symbols.h"
+#include "virtualMachine.h"
+
+/*
+ * Call-graph profiler. Listens to the shadow call stack (JSR/JSRR are calls,
+ * JMP R7 returns) and charges every retired instruction and every
+ * nanosecond spent in trap routines to the subroutine that was innermost at
+ * the time (self), and to it and all its callers (total). At exit it prints
+ * a gprof-style report: a flat profile sorted by self instructions, then the
+ * call graph, one entry per subroutine with its callers above it and its
+ * callees below it. The code the guest started in is the root of the graph.
+ *
+ * A recursive subroutine only counts its outermost activation towards its
+ * total, so totals never exceed the instructions actually retired.
+ */
+
+#define ARC_SLOTS (1 << 16)  // Distinct caller/callee pairs that can be counted (power of two)
+
+struct functionStats {
+    uint64_t calls;
+    uint64_t self;         // Instructions retired while innermost
+    uint64_t total;        // ... or while any callee was running
+    uint64_t selfTrapNs;   // Trap routine time while innermost
+    uint64_t totalTrapNs;  // ... or while any callee was running
+    uint32_t active;       // Activations on the call stack
+    int index;             // Position in the call graph (0: never called)
+};
+
+// Calls from one subroutine to another
+struct arc {
+    uint32_t key;          // (caller << 16 | callee) + 1, 0 if the slot is free
+    uint64_t calls;
+    uint64_t self;         // Callee's self instructions on these calls
+    uint64_t children;     // Callee's callees' instructions on these calls
+};
+
+// Counters of an active call (frames[0] is the root, frames[d + 1] is callStack[d])
+struct activeFrame {
+    uint16_t entry;
+    uint64_t startRetired;
+    uint64_t childRetired;
+    uint64_t startTrapNs;
+    uint64_t childTrapNs;
+};
+
+const char *callGraphPath = NULL;  // --call-graph
+
+static struct functionStats *functions = NULL;
+static struct arc *arcs = NULL;
+static struct activeFrame frames[CALL_STACK_DEPTH + 1];
+static uint64_t trapNs = 0;       // Time spent in trap routines so far
+static uint64_t droppedArcs = 0;  // Calls between pairs that did not fit in the arc table
+
+/*
+ * Find the arc between two subroutines, adding it if it is new.
+ *
+ * caller: Entry address of the caller
+ * callee: Entry address of the callee
+ * return: The arc, or NULL if the table is full
+ */
+static struct arc *findArc(uint16_t caller, uint16_t callee)
+{
+    uint32_t key = ((uint32_t)caller << 16 | callee) + 1;
+    uint32_t hash = key * 2654435761u;
+    for (uint32_t probe = 0; probe < ARC_SLOTS; probe++) {
+        struct arc *arc = &arcs[(hash + probe) & (ARC_SLOTS - 1)];
+        if (arc->key == key) {
+            return arc;
+        }
+        if (!arc->key) {
+            arc->key = key;
+            return arc;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Open a frame.
+ *
+ * frame: The frame
+ * entry: Entry address of the subroutine
+ * return: void
+ */
+static void openFrame(struct activeFrame *frame, uint16_t entry)
+{
+    *frame = (struct activeFrame){entry, retiredInstructions(), 0, trapNs, 0};
+    functions[entry].calls++;
+    functions[entry].active++;
+}
+
+/*
+ * Close a frame, charging what ran in it to its subroutine and its parent.
+ *
+ * frame: The frame
+ * parent: Frame of the caller, or NULL for the root
+ * return: void
+ */
+static void closeFrame(const struct activeFrame *frame, struct activeFrame *parent)
+{
+    struct functionStats *function = &functions[frame->entry];
+    uint64_t total = retiredInstructions() - frame->startRetired;
+    uint64_t self = total - frame->childRetired;
+    uint64_t totalTrapNs = trapNs - frame->startTrapNs;
+    function->self += self;
+    function->selfTrapNs += totalTrapNs - frame->childTrapNs;
+
+    int outermost = !--function->active;
+    if (outermost) {
+        function->total += total;
+        function->totalTrapNs += totalTrapNs;
+    }
+    if (!parent) {
+        return;
+    }
+    parent->childRetired += total;
+    parent->childTrapNs += totalTrapNs;
+
+    struct arc *arc = findArc(parent->entry, frame->entry);
+    if (!arc) {
+        droppedArcs++;
+        return;
+    }
+    arc->calls++;
+    arc->self += self;
+    if (outermost) {
+        arc->children += total - self;
+    }
+}
+
+/*
+ * Listener: a subroutine was called.
+ *
+ * depth: Its frame in callStack[]
+ * return: void
+ */
+static void enterSubroutine(uint32_t depth)
+{
+    openFrame(&frames[depth + 1], callStack[depth].entry);
+}
+
+/*
+ * Listener: a subroutine returned.
+ *
+ * depth: Its frame in callStack[]
+ * return: void
+ */
+static void leaveSubroutine(uint32_t depth)
+{
+    closeFrame(&frames[depth + 1], &frames[depth]);
+}
+
+/*
+ * Listener: a trap routine ran.
+ *
+ * vector: Trap vector
+ * startNs: When it started
+ * endNs: When it finished
+ * return: void
+ */
+static void countTrap(uint16_t vector, uint64_t startNs, uint64_t endNs)
+{
+    (void)vector;
+    trapNs += endNs - startNs;
+}
+
+static const struct callListener callGraphListener = {enterSubroutine, leaveSubroutine, countTrap};
+
+/*
+ * Start following calls. The root frame is opened at the current PC.
+ *
+ * return: 0 on success, -1 if the tables could not be allocated
+ */
+int startCallGraph()
+{
+    functions = calloc(MAX_MEMORY, sizeof(*functions));
+    arcs = calloc(ARC_SLOTS, sizeof(*arcs));
+    if (!functions || !arcs) {
+        return -1;
+    }
+    openFrame(&frames[0], callRoot);
+    addCallListener(&callGraphListener);
+    return 0;
+}
+
+/*
+ * qsort() comparison: subroutines by self instructions, most first.
+ *
+ * a: Entry address of one subroutine
+ * b: Entry address of the other
+ * return: Negative if a sorts first, positive if b does, 0 if they tie
+ */
+static int compareSelf(const void *a, const void *b)
+{
+    uint64_t selfA = functions[*(const uint16_t *)a].self;
+    uint64_t selfB = functions[*(const uint16_t *)b].self;
+    return selfA < selfB ? 1 : selfA > selfB ? -1 : 0;
+}
+
+/*
+ * qsort() comparison: subroutines by total instructions, most first.
+ *
+ * a: Entry address of one subroutine
+ * b: Entry address of the other
+ * return: Negative if a sorts first, positive if b does, 0 if they tie
+ */
+static int compareTotal(const void *a, const void *b)
+{
+    uint64_t totalA = functions[*(const uint16_t *)a].total;
+    uint64_t totalB = functions[*(const uint16_t *)b].total;
+    return totalA < totalB ? 1 : totalA > totalB ? -1 : 0;
+}
+
+/*
+ * Print one caller or callee line of a call graph entry.
+ *
+ * out: Where to print
+ * arc: The call
+ * other: Entry address of the caller or callee
+ * calls: Calls the arc's callee received in all
+ * return: void
+ */
+static void printArc(FILE *out, const struct arc *arc, uint16_t other, uint64_t calls)
+{
+    char buffer[8];
+    char called[48];
+    snprintf(called, sizeof(called), "%llu/%llu", (unsigned long long)arc->calls, (unsigned long long)calls);
+    fprintf(out, "%15s %14llu %14llu %17s      %s [%d]\n", "", (unsigned long long)arc->self,
+            (unsigned long long)arc->children, called, addressName(other, buffer), functions[other].index);
+}
+
+/*
+ * Close every active call and print the flat profile and the call graph.
+ *
+ * out: Where to print
+ * return: void
+ */
+void callGraphReport(FILE *out)
+{
+    unwindCalls();
+    closeFrame(&frames[0], NULL);
+
+    uint16_t *order = malloc(MAX_MEMORY * sizeof(*order));
+    if (!order) {
+        return;
+    }
+    int count = 0;
+    for (uint32_t address = 0; address < MAX_MEMORY; address++) {
+        if (functions[address].calls) {
+            order[count++] = address;
+        }
+    }
+    uint64_t retired = functions[callRoot].total;
+    double percent = retired ? 100.0 / retired : 0;
+    char buffer[8];
+
+    fprintf(out, "Flat profile: %llu instructions retired, %.3f ms in trap routines\n\n",
+            (unsigned long long)retired, trapNs / 1e6);
+    fprintf(out, "%7s %14s %14s %12s %13s %13s  %s\n", "% self", "self instrs", "total instrs", "calls",
+            "self trap ms", "trap ms", "name");
+    qsort(order, count, sizeof(*order), compareSelf);
+    for (int i = 0; i < count; i++) {
+        const struct functionStats *function = &functions[order[i]];
+        fprintf(out, "%7.2f %14llu %14llu %12llu %13.3f %13.3f  %s\n", function->self * percent,
+                (unsigned long long)function->self, (unsigned long long)function->total,
+                (unsigned long long)function->calls, function->selfTrapNs / 1e6, function->totalTrapNs / 1e6,
+                addressName(order[i], buffer));
+    }
+
+    qsort(order, count, sizeof(*order), compareTotal);
+    for (int i = 0; i < count; i++) {
+        functions[order[i]].index = i + 1;
+    }
+    fprintf(out, "\nCall graph (instructions retired)\n\n");
+    fprintf(out, "%-7s %7s %14s %14s %17s      %s\n", "index", "% total", "self", "children", "called", "name");
+    for (int i = 0; i < count; i++) {
+        uint16_t entry = order[i];
+        const struct functionStats *function = &functions[entry];
+        fprintf(out, "-----------------------------------------------\n");
+        for (uint32_t slot = 0; slot < ARC_SLOTS; slot++) {
+            if (arcs[slot].key && (uint16_t)(arcs[slot].key - 1) == entry) {
+                printArc(out, &arcs[slot], (arcs[slot].key - 1) >> 16, function->calls);
+            }
+        }
+        char index[16];
+        snprintf(index, sizeof(index), "[%d]", i + 1);
+        fprintf(out, "%-7s %7.1f %14llu %14llu %17llu    %s %s\n", index, function->total * percent,
+                (unsigned long long)function->self, (unsigned long long)(function->total - function->self),
+                (unsigned long long)function->calls, addressName(entry, buffer), index);
+        for (uint32_t slot = 0; slot < ARC_SLOTS; slot++) {
+            if (arcs[slot].key && (arcs[slot].key - 1) >> 16 == entry) {
+                uint16_t callee = arcs[slot].key - 1;
+                printArc(out, &arcs[slot], callee, functions[callee].calls);
+            }
+        }
+    }
+    fprintf(out, "-----------------------------------------------\n");
+    if (droppedArcs) {
+        fprintf(out, "%llu calls between pairs of subroutines that did not fit in the table are missing\n",
+                (unsigned long long)droppedArcs);
+    }
+    free(order);
+}
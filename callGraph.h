@@ -0,0 +1,12 @@
+#ifndef CALL_GRAPH_H
+#define CALL_GRAPH_H
+
+#include <stdio.h>
+
+extern const char *callGraphPath;
+
+// Function prototypes
+int startCallGraph();
+void callGraphReport(FILE *out);
+
+#endif
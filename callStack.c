@@ -0,0 +1,123 @@
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "callStack.h"
+#include "metrics.h"
+
+/*
+ * Shadow stack of guest subroutine calls. While callTracking is set, the
+ * reference jumpToSubroutine() pushes a frame for every JSR/JSRR and jump()
+ * pops back to the frame a JMP R7 returns to. Profilers read it, including
+ * from signal handlers, so a frame is always complete before callDepth
+ * counts it. Profilers that need to see every call and return register a
+ * listener instead, which also hears about trap routines (executeTrapCode()
+ * times them only while there is a listener).
+ */
+
+#define RETURN_SEARCH 16  // Frames looked through for the one a return goes back to
+
+int callTracking = 0;                   // jumpToSubroutine() and jump() maintain the stack
+uint16_t callRoot = 0;                  // Where the guest started (the outermost frame)
+struct callFrame callStack[CALL_STACK_DEPTH];
+volatile uint32_t callDepth = 0;        // Active calls (may exceed CALL_STACK_DEPTH)
+int callListenerCount = 0;
+
+static const struct callListener *listeners[MAX_CALL_LISTENERS];
+
+/*
+ * Start following guest calls.
+ *
+ * listener: Callbacks, which must stay valid until the VM exits
+ * return: void
+ */
+void addCallListener(const struct callListener *listener)
+{
+    if (callListenerCount < MAX_CALL_LISTENERS) {
+        listeners[callListenerCount++] = listener;
+        callTracking = 1;
+    }
+}
+
+/*
+ * Tell the listeners about the frame callEnter() just pushed.
+ *
+ * depth: Index of the new frame
+ * return: void
+ */
+void callEnterListeners(uint32_t depth)
+{
+    for (int i = 0; i < callListenerCount; i++) {
+        listeners[i]->enter(depth);
+    }
+}
+
+/*
+ * Tell the listeners about the frames being popped, innermost first.
+ *
+ * depth: Frames that remain
+ * return: void
+ */
+static void leaveFrames(uint32_t depth)
+{
+    for (uint32_t frame = callDepth; frame > depth; frame--) {
+        for (int i = 0; i < callListenerCount; i++) {
+            listeners[i]->leave(frame - 1);
+        }
+    }
+    callDepth = depth;
+}
+
+/*
+ * The rest of callReturn(). Returns that match none of the top frames (a
+ * JMP R7 that is not a return, or a guest that unwinds its own stack) leave
+ * the stack alone; returning past a frame pops it as well, so a subroutine
+ * that was left without a RET does not stay on the stack.
+ *
+ * target: Address being returned to
+ * return: void
+ */
+void callReturnSearch(uint16_t target)
+{
+    uint32_t depth = callDepth;
+    if (depth > CALL_STACK_DEPTH) {
+        callDepth = depth - 1;  // Frame was never recorded: trust the return
+        return;
+    }
+    for (uint32_t frame = depth; frame > 0 && depth - frame < RETURN_SEARCH; frame--) {
+        if (callStack[frame - 1].returnAddress == target) {
+            leaveFrames(frame - 1);
+            return;
+        }
+    }
+}
+
+/*
+ * Tell the listeners that a trap routine has finished.
+ *
+ * vector: Trap vector
+ * startNs: monotonicNs() when it started
+ * return: void
+ */
+void callTrap(uint16_t vector, uint64_t startNs)
+{
+    uint64_t endNs = monotonicNs();
+    for (int i = 0; i < callListenerCount; i++) {
+        if (listeners[i]->trap) {
+            listeners[i]->trap(vector, startNs, endNs);
+        }
+    }
+}
+
+/*
+ * Pop every frame, as if all active subroutines returned. Used when the
+ * guest stops, so that listeners can close them.
+ *
+ * return: void
+ */
+void unwindCalls()
+{
+    if (callDepth > CALL_STACK_DEPTH) {
+        callDepth = CALL_STACK_DEPTH;
+    }
+    leaveFrames(0);
+}
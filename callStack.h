@@ -0,0 +1,77 @@
+#ifndef CALL_STACK_H
+#define CALL_STACK_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define CALL_STACK_DEPTH 1024  // Frames kept; deeper calls are counted but not recorded
+#define MAX_CALL_LISTENERS 4
+
+// An active guest subroutine
+struct callFrame {
+    uint16_t entry;          // Address the JSR/JSRR jumped to
+    uint16_t returnAddress;  // R7 at the call
+};
+
+// Something that follows guest calls. Frames deeper than CALL_STACK_DEPTH are
+// not reported.
+struct callListener {
+    void (*enter)(uint32_t depth);  // callStack[depth] was just pushed
+    void (*leave)(uint32_t depth);  // callStack[depth] is about to be popped
+    void (*trap)(uint16_t vector, uint64_t startNs, uint64_t endNs);  // A trap routine ran (may be NULL)
+};
+
+extern int callTracking;
+extern int callListenerCount;
+extern uint16_t callRoot;
+extern struct callFrame callStack[CALL_STACK_DEPTH];
+extern volatile uint32_t callDepth;
+
+// Function prototypes
+void callEnterListeners(uint32_t depth);
+void callReturnSearch(uint16_t target);
+void callTrap(uint16_t vector, uint64_t startNs);
+void addCallListener(const struct callListener *listener);
+void unwindCalls();
+
+/*
+ * Push a frame for a subroutine call. Inline, like callReturn(), because
+ * the reference interpreter runs it for every JSR/JSRR while a profiler is
+ * on.
+ *
+ * entry: Address being called
+ * returnAddress: Address the call returns to
+ * return: void
+ */
+static inline void callEnter(uint16_t entry, uint16_t returnAddress)
+{
+    uint32_t depth = callDepth;
+    if (depth < CALL_STACK_DEPTH) {
+        callStack[depth] = (struct callFrame){entry, returnAddress};
+        atomic_signal_fence(memory_order_release);
+    }
+    callDepth = depth + 1;
+    if (callListenerCount && depth < CALL_STACK_DEPTH) {
+        callEnterListeners(depth);
+    }
+}
+
+/*
+ * Pop back to the frame a return goes to. The usual case, a return from the
+ * innermost frame with nobody listening, is handled here; everything else
+ * goes to callReturnSearch().
+ *
+ * target: Address being returned to
+ * return: void
+ */
+static inline void callReturn(uint16_t target)
+{
+    uint32_t depth = callDepth;
+    if (depth && depth <= CALL_STACK_DEPTH && !callListenerCount && callStack[depth - 1].returnAddress == target) {
+        callDepth = depth - 1;
+        return;
+    }
+    callReturnSearch(target);
+}
+
+#endif
@@ -0,0 +1,228 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "codeCache.h"
+
+/*
+ * Code cache. Keeps track of the host memory held by translations, evicts
+ * them when a byte budget would be exceeded, and indexes them by guest page
+ * so a store into code only has to look at the translations built from that
+ * page. The cache does not own the translations: the engine passes in the
+ * function that frees one, and that function calls cacheRemove().
+ */
+
+size_t codeCacheBudget = 64 << 20;  // --code-cache
+int codeCachePolicy = CACHE_LRU;    // --code-cache-policy
+const char *cachePolicyNames[CACHE_POLICY_COUNT] = {"lru", "flush"};
+
+uint64_t cacheLookups = 0;  // Dispatcher lookups, counted by the engine
+uint64_t cacheHits = 0;
+
+static struct cacheEntry **entries = NULL;
+static int entryCount = 0;
+static int entryCapacity = 0;
+
+// Entries built from each guest page
+static struct cacheEntry **pageEntries[CACHE_PAGES];
+static int pageCount[CACHE_PAGES];
+static int pageCapacity[CACHE_PAGES];
+
+// Statistics
+static size_t bytesUsed = 0;
+static size_t bytesPeak = 0;
+static uint64_t inserted = 0;
+static uint64_t evicted = 0;
+static uint64_t flushes = 0;
+static uint64_t rejected = 0;
+static uint64_t invalidated = 0;
+
+/*
+ * Append a pointer to a growable array.
+ *
+ * array: The array
+ * count: Number of elements in use
+ * capacity: Number of elements allocated
+ * entry: Pointer to add
+ * return: 0 on success, -1 if out of memory
+ */
+static int append(struct cacheEntry ***array, int *count, int *capacity, struct cacheEntry *entry)
+{
+    if (*count == *capacity) {
+        int grown = *capacity ? *capacity * 2 : 16;
+        struct cacheEntry **larger = realloc(*array, grown * sizeof(**array));
+        if (!larger) {
+            return -1;
+        }
+        *array = larger;
+        *capacity = grown;
+    }
+    (*array)[(*count)++] = entry;
+    return 0;
+}
+
+/*
+ * Remove an entry from a guest page's list.
+ *
+ * page: The page
+ * entry: The entry
+ * return: void
+ */
+static void removeFromPage(int page, struct cacheEntry *entry)
+{
+    for (int i = 0; i < pageCount[page]; i++) {
+        if (pageEntries[page][i] == entry) {
+            pageEntries[page][i] = pageEntries[page][--pageCount[page]];
+            return;
+        }
+    }
+}
+
+/*
+ * Evict translations until a number of bytes fits in the budget.
+ *
+ * bytes: Size of the translation about to be added
+ * evict: Frees a translation (and calls cacheRemove())
+ * return: void
+ */
+static void makeRoom(size_t bytes, void (*evict)(struct cacheEntry *entry))
+{
+    if (bytesUsed + bytes <= codeCacheBudget || !entryCount) {
+        return;
+    }
+
+    if (codeCachePolicy == CACHE_FLUSH) {
+        flushes++;
+        while (entryCount) {
+            evict(entries[entryCount - 1]);
+            evicted++;
+        }
+        return;
+    }
+
+    while (entryCount && bytesUsed + bytes > codeCacheBudget) {
+        struct cacheEntry *oldest = entries[0];
+        for (int i = 1; i < entryCount; i++) {
+            if (entries[i]->lastUsed < oldest->lastUsed) {
+                oldest = entries[i];
+            }
+        }
+        evict(oldest);
+        evicted++;
+    }
+}
+
+/*
+ * Add a translation to the cache, evicting others if it would not fit.
+ *
+ * entry: The translation's cache header
+ * addresses: Guest addresses it was built from
+ * count: Number of addresses
+ * bytes: Host memory it holds
+ * evict: Frees a translation (and calls cacheRemove())
+ * return: 0 if it was added, -1 if it can never fit or memory ran out
+ */
+int cacheInsert(struct cacheEntry *entry, const uint16_t *addresses, int count, size_t bytes,
+                void (*evict)(struct cacheEntry *entry))
+{
+    if (bytes > codeCacheBudget) {
+        rejected++;
+        return -1;
+    }
+    makeRoom(bytes, evict);
+
+    entry->pages = malloc(count);
+    if (!entry->pages) {
+        return -1;
+    }
+    entry->pageCount = 0;
+    for (int i = 0; i < count; i++) {
+        uint8_t page = addresses[i] >> CACHE_PAGE_BITS;
+        int seen = 0;
+        for (int j = 0; j < entry->pageCount && !seen; j++) {
+            seen = entry->pages[j] == page;
+        }
+        if (!seen) {
+            entry->pages[entry->pageCount++] = page;
+        }
+    }
+
+    entry->bytes = bytes;
+    entry->index = entryCount;
+    if (append(&entries, &entryCount, &entryCapacity, entry) != 0) {
+        free(entry->pages);
+        return -1;
+    }
+    bytesUsed += bytes;
+    for (int i = 0; i < entry->pageCount; i++) {
+        int page = entry->pages[i];
+        if (append(&pageEntries[page], &pageCount[page], &pageCapacity[page], entry) != 0) {
+            entry->pageCount = i;
+            cacheRemove(entry);
+            return -1;
+        }
+    }
+
+    bytesPeak = bytesUsed > bytesPeak ? bytesUsed : bytesPeak;
+    inserted++;
+    return 0;
+}
+
+/*
+ * Take a translation out of the cache. Called by the engine when it frees
+ * one, whatever the reason.
+ *
+ * entry: The translation's cache header
+ * return: void
+ */
+void cacheRemove(struct cacheEntry *entry)
+{
+    for (int i = 0; i < entry->pageCount; i++) {
+        removeFromPage(entry->pages[i], entry);
+    }
+    free(entry->pages);
+    entry->pages = NULL;
+
+    entries[entry->index] = entries[--entryCount];
+    entries[entry->index]->index = entry->index;
+    bytesUsed -= entry->bytes;
+}
+
+/*
+ * Drop the translations built from an address that the guest just wrote.
+ * Only the translations indexed under the address's page are looked at.
+ *
+ * address: The address that was written
+ * covers: Whether a translation was built from the address
+ * drop: Frees a translation (and calls cacheRemove())
+ * return: void
+ */
+void cacheInvalidate(uint16_t address, int (*covers)(const struct cacheEntry *entry, uint16_t address),
+                     void (*drop)(struct cacheEntry *entry))
+{
+    int page = address >> CACHE_PAGE_BITS;
+
+    // Backwards, since dropping an entry moves the last one into its place
+    for (int i = pageCount[page] - 1; i >= 0; i--) {
+        if (i < pageCount[page] && covers(pageEntries[page][i], address)) {
+            drop(pageEntries[page][i]);
+            invalidated++;
+        }
+    }
+}
+
+/*
+ * Print code cache statistics.
+ *
+ * out: Where to print
+ * return: void
+ */
+void cacheReport(FILE *out)
+{
+    fprintf(out, "code cache: %s, budget %zu bytes, %zu in use, peak %zu; %llu inserted, %llu evicted "
+            "(%llu flushes), %llu too large, %llu invalidated; hit rate %.1f%% of %llu lookups\n",
+            cachePolicyNames[codeCachePolicy], codeCacheBudget, bytesUsed, bytesPeak, (unsigned long long)inserted,
+            (unsigned long long)evicted, (unsigned long long)flushes, (unsigned long long)rejected,
+            (unsigned long long)invalidated, cacheLookups ? 100.0 * cacheHits / cacheLookups : 0,
+            (unsigned long long)cacheLookups);
+}
@@ -0,0 +1,41 @@
+#ifndef CODE_CACHE_H
+#define CODE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CACHE_PAGE_BITS 8                         // Guest page: 256 words
+#define CACHE_PAGES (1 << (16 - CACHE_PAGE_BITS))
+
+// What happens when a translation does not fit in the budget
+enum {
+    CACHE_LRU,    // Evict the least recently used translations until it fits
+    CACHE_FLUSH,  // Drop every translation and start a new generation
+    CACHE_POLICY_COUNT
+};
+
+// Header every translation kept in the code cache starts with
+struct cacheEntry {
+    size_t bytes;       // Host memory the translation holds
+    uint64_t lastUsed;  // Set by the engine whenever it runs the translation
+    int index;          // Position in the list of entries
+    int pageCount;
+    uint8_t *pages;     // Guest pages the translation was built from
+};
+
+extern size_t codeCacheBudget;
+extern int codeCachePolicy;
+extern const char *cachePolicyNames[CACHE_POLICY_COUNT];
+extern uint64_t cacheLookups;
+extern uint64_t cacheHits;
+
+// Function prototypes
+int cacheInsert(struct cacheEntry *entry, const uint16_t *addresses, int count, size_t bytes,
+                void (*evict)(struct cacheEntry *entry));
+void cacheRemove(struct cacheEntry *entry);
+void cacheInvalidate(uint16_t address, int (*covers)(const struct cacheEntry *entry, uint16_t address),
+                     void (*drop)(struct cacheEntry *entry));
+void cacheReport(FILE *out);
+
+#endif
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE  // REG_EFL and memfd_create
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "codeProtection.h"
+#include "virtualMachine.h"
+
+/*
+ * Self-modifying code detection. Engines that run translations register the
+ * guest addresses each one was built from; translatedCode[] counts them per
+ * address, and a translation that would take an address past UINT8_MAX of
+ * them is refused rather than wrapping the count. Where SMC_PAGE_PROTECTION
+ * is available, every host page of guest memory holding translated code is
+ * also made read-only, so memWrite() does not have to look at
+ * translatedCode[] on every store: a store into such a page faults, the SIGSEGV handler drops the translations of the address
+ * (through invalidateCode) and opens the page, and the store is retried with
+ * the trap flag set. The SIGTRAP that follows it closes the page again if it
+ * still holds code. Stores to pages without code run with no check at all.
+ *
+ * Translations check their own stores, since they have to stop running when
+ * they modify themselves; a fault would only slow down their stores to data
+ * that shares a page with code. So guest memory is mapped twice: memory[] is
+ * the view that gets protected, and writableMemory is a second view of the
+ * same pages that is never protected, for translations to use.
+ *
+ * A page the interpreter keeps storing into would fault over and over, so
+ * once it takes PAGE_FAULT_LIMIT faults within PAGE_FAULT_WINDOW retired
+ * instructions its translations are dropped and no more are made from it:
+ * protectCode() refuses its addresses and it runs in the interpreter from
+ * then on.
+ *
+ * The handlers run synchronously on the store that faulted, which is always
+ * a plain store into memory[] and never inside the C library, so it is safe
+ * for invalidateCode to free translations from them.
+ */
+
+#define TRAP_FLAG 0x100        // EFLAGS.TF
+#define PAGE_FAULT_LIMIT 64          // Faults before a page is no longer translated...
+#define PAGE_FAULT_WINDOW (1 << 20)  // ... if they come within this many instructions
+#define MAX_HOST_PAGES (MAX_MEMORY * sizeof(uint16_t) / 4096)
+
+uint16_t *writableMemory = memory;  // Never write-protected
+uint64_t writeFaults = 0;
+uint64_t codeWriteFaults = 0;
+uint64_t pagesAbandoned = 0;
+
+#ifdef SMC_PAGE_PROTECTION
+static int protectionActive = 0;
+static int pageShift = 0;                         // log2 of guest words per host page
+static uint32_t pageCode[MAX_HOST_PAGES];         // Translated addresses in each host page
+static uint32_t pageFaults[MAX_HOST_PAGES];       // Write faults taken by each host page in its window
+static uint64_t pageWindow[MAX_HOST_PAGES];       // Instructions retired when the window started
+static int steppingPage = -1;                     // Page opened for the store being single-stepped
+static struct sigaction previousSegv;
+static struct sigaction previousTrap;
+
+/*
+ * Change the protection of the host page holding a guest address range.
+ *
+ * page: Host page number
+ * writable: Whether stores are allowed
+ * return: 0 on success, -1 on failure
+ */
+static int setPageWritable(int page, int writable)
+{
+    size_t bytes = sizeof(uint16_t) << pageShift;
+    return mprotect((char *)memory + page * bytes, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ);
+}
+
+/*
+ * Catch a store into a protected page: drop the translations of the
+ * address, open the page and single-step the store. Faults outside guest
+ * memory are handed back to the previous handler.
+ *
+ * signal: The signal that was received
+ * info: Faulting address
+ * context: Registers of the interrupted store
+ * return: void
+ */
+static void handleWriteFault(int signal, siginfo_t *info, void *context)
+{
+    uintptr_t offset = (uintptr_t)info->si_addr - (uintptr_t)memory;
+    if (!protectionActive || offset >= sizeof(uint16_t) * MAX_MEMORY || steppingPage >= 0) {
+        sigaction(signal, &previousSegv, NULL);  // A real crash: let it happen
+        return;
+    }
+
+    uint16_t address = offset / sizeof(uint16_t);
+    writeFaults++;
+    if (translatedCode[address]) {
+        codeWriteFaults++;
+        invalidateCode(address);  // Self-modifying code: drop stale translations
+    }
+
+    steppingPage = address >> pageShift;
+    uint64_t retired = retiredInstructions();
+    if (pageFaults[steppingPage] < PAGE_FAULT_LIMIT && retired - pageWindow[steppingPage] > PAGE_FAULT_WINDOW) {
+        pageWindow[steppingPage] = retired;
+        pageFaults[steppingPage] = 0;
+    }
+    if (++pageFaults[steppingPage] == PAGE_FAULT_LIMIT) {
+        uint16_t first = steppingPage << pageShift;
+        for (uint32_t i = 0; i < 1u << pageShift && pageCode[steppingPage]; i++) {
+            if (translatedCode[(uint16_t)(first + i)]) {
+                invalidateCode(first + i);
+            }
+        }
+        pagesAbandoned++;
+    }
+    setPageWritable(steppingPage, 1);
+    ((ucontext_t *)context)->uc_mcontext.gregs[REG_EFL] |= TRAP_FLAG;
+}
+
+/*
+ * Close the page again once the faulting store has run.
+ *
+ * signal: The signal that was received
+ * info: Why the trap was raised
+ * context: Registers after the store
+ * return: void
+ */
+static void handleStepTrap(int signal, siginfo_t *info, void *context)
+{
+    (void)info;
+    if (steppingPage < 0) {
+        sigaction(signal, &previousTrap, NULL);  // Not ours (a debugger breakpoint, say)
+        raise(signal);
+        return;
+    }
+
+    ((ucontext_t *)context)->uc_mcontext.gregs[REG_EFL] &= ~TRAP_FLAG;
+    if (pageCode[steppingPage]) {
+        setPageWritable(steppingPage, 0);
+    }
+    steppingPage = -1;
+}
+#endif
+
+/*
+ * Install the fault handlers. Must be called before protectCode().
+ *
+ * return: 0 on success, -1 if stores into code cannot be caught
+ */
+int startCodeProtection()
+{
+#ifdef SMC_PAGE_PROTECTION
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pageSize < 4096 || pageSize > MEMORY_ALIGNMENT || (pageSize & (pageSize - 1))) {
+        return -1;
+    }
+    pageShift = __builtin_ctzl(pageSize / sizeof(uint16_t));
+
+    // Move memory[] into a shared mapping and map it a second time
+    size_t bytes = sizeof(uint16_t) * MAX_MEMORY;
+    int fd = memfd_create("lc3-memory", 0);
+    if (fd < 0) {
+        return -1;
+    }
+    void *view = MAP_FAILED;
+    if (ftruncate(fd, bytes) == 0 && pwrite(fd, memory, bytes, 0) == (ssize_t)bytes) {
+        view = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (view == MAP_FAILED
+        || mmap(memory, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        if (view != MAP_FAILED) {
+            munmap(view, bytes);
+        }
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    writableMemory = view;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    action.sa_sigaction = handleWriteFault;
+    if (sigaction(SIGSEGV, &action, &previousSegv) != 0) {
+        return -1;
+    }
+    action.sa_sigaction = handleStepTrap;
+    if (sigaction(SIGTRAP, &action, &previousTrap) != 0) {
+        sigaction(SIGSEGV, &previousSegv, NULL);
+        return -1;
+    }
+    protectionActive = 1;
+#endif
+    return 0;
+}
+
+/*
+ * Register the addresses a translation was built from, write-protecting
+ * their host pages where SMC_PAGE_PROTECTION is available.
+ *
+ * addresses: Guest addresses
+ * count: Number of addresses
+ * return: 0 on success, -1 if a page could not be protected, is no longer
+ *         translated, or an address is already covered by as many
+ *         translations as translatedCode[] can count
+ */
+int protectCode(const uint16_t *addresses, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (translatedCode[addresses[i]] == UINT8_MAX) {
+            unprotectCode(addresses, i);  // One more would wrap to 0 and hide the code from memWrite()
+            return -1;
+        }
+#ifdef SMC_PAGE_PROTECTION
+        int page = addresses[i] >> pageShift;
+        if (pageFaults[page] >= PAGE_FAULT_LIMIT || (!pageCode[page] && setPageWritable(page, 0) != 0)) {
+            unprotectCode(addresses, i);
+            return -1;
+        }
+        pageCode[page]++;
+#endif
+        translatedCode[addresses[i]]++;
+    }
+    return 0;
+}
+
+/*
+ * Unregister the addresses of a translation that is being dropped, opening
+ * host pages that no longer hold any code.
+ *
+ * addresses: Guest addresses
+ * count: Number of addresses
+ * return: void
+ */
+void unprotectCode(const uint16_t *addresses, int count)
+{
+    for (int i = 0; i < count; i++) {
+        translatedCode[addresses[i]]--;
+#ifdef SMC_PAGE_PROTECTION
+        int page = addresses[i] >> pageShift;
+        if (!--pageCode[page]) {
+            setPageWritable(page, 1);
+        }
+#endif
+    }
+}
+
+/*
+ * Print write fault statistics.
+ *
+ * out: Where to print
+ * instructions: Instructions retired, to give the fault rate
+ * return: void
+ */
+void codeProtectionReport(FILE *out, uint64_t instructions)
+{
+#ifdef SMC_PAGE_PROTECTION
+    fprintf(out, "code protection: %llu write faults (%.3f per million instructions), %llu into translated code, "
+            "%llu pages no longer translated\n", (unsigned long long)writeFaults,
+            instructions ? 1e6 * writeFaults / instructions : 0, (unsigned long long)codeWriteFaults,
+            (unsigned long long)pagesAbandoned);
+#else
+    (void)instructions;
+    fprintf(out, "code protection: unavailable, memWrite() checks every store\n");
+#endif
+}
@@ -0,0 +1,27 @@
+#ifndef CODE_PROTECTION_H
+#define CODE_PROTECTION_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Stores into translated code are caught by write-protecting the host pages
+// that hold it. Finishing the faulting store relies on single-stepping it
+// with the x86 trap flag; elsewhere memWrite() checks every store instead.
+#if defined(__linux__) && defined(__x86_64__)
+#define SMC_PAGE_PROTECTION
+#endif
+
+#define MEMORY_ALIGNMENT (1 << 16)  // Largest host page size guest memory can be protected with
+
+extern uint16_t *writableMemory;  // Guest memory for code that checks its own stores
+extern uint64_t writeFaults;      // Stores that hit a protected page
+extern uint64_t codeWriteFaults;  // ... and invalidated translated code
+extern uint64_t pagesAbandoned;   // Pages that faulted too often to be translated
+
+// Function prototypes
+int startCodeProtection();
+int protectCode(const uint16_t *addresses, int count);
+void unprotectCode(const uint16_t *addresses, int count);
+void codeProtectionReport(FILE *out, uint64_t instructions);
+
+#endif
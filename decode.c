@@ -0,0 +1,181 @@
+#include <stdint.h>
+
+#include "decode.h"
+#include "engine.h"
+#include "virtualMachine.h"
+
+/*
+ * Decoding shared by the engines that work on pre-decoded instructions. Each
+ * instruction word is turned into a specialized handler (register vs
+ * immediate forms, JSR vs JSRR, branches that are never/always taken) with
+ * its register numbers and sign-extended offset already extracted.
+ */
+
+struct decodedInstruction decodeTable[MAX_MEMORY];  // Every encoding, filled by buildDecodeTable()
+static int decodeTableBuilt = 0;
+
+/*
+ * Decode one instruction word into its table entry.
+ *
+ * instruction: The instruction word
+ * return: The decoded entry
+ */
+struct decodedInstruction decodeInstruction(uint16_t instruction)
+{
+    struct decodedInstruction d = {0, 0, 0, 0, 0};
+    d.dest = (instruction >> 9) & 0x7;
+    d.src1 = (instruction >> 6) & 0x7;
+    d.src2 = instruction & 0x7;
+
+    switch (instruction >> 12) {
+        case OP_BR:
+            d.handler = d.dest == 0 ? T_BR_NEVER : d.dest == 0x7 ? T_BR_ALWAYS : T_BR;
+            d.imm = signExtend(instruction & 0x1FF, 9);
+            break;
+        case OP_ADD:
+            d.handler = (instruction & 0x20) ? T_ADD_IMM : T_ADD_REG;
+            d.imm = signExtend(instruction & 0x1F, 5);
+            break;
+        case OP_LD:
+            d.handler = T_LD;
+            d.imm = signExtend(instruction & 0x1FF, 9);
+            break;
+        case OP_ST:
+            d.handler = T_ST;
+            d.imm = signExtend(instruction & 0x1FF, 9);
+            break;
+        case OP_JSR:
+            d.handler = (instruction & 0x800) ? T_JSR : T_JSRR;
+            d.imm = signExtend(instruction & 0x7FF, 11);
+            break;
+        case OP_AND:
+            d.handler = (instruction & 0x20) ? T_AND_IMM : T_AND_REG;
+            d.imm = signExtend(instruction & 0x1F, 5);
+            break;
+        case OP_LDR:
+            d.handler = T_LDR;
+            d.imm = signExtend(instruction & 0x3F, 6);
+            break;
+        case OP_STR:
+            d.handler = T_STR;
+            d.imm = signExtend(instruction & 0x3F, 6);
+            break;
+        case OP_RTI:
+            d.handler = T_RTI;
+            break;
+        case OP_NOT:
+            d.handler = T_NOT;
+            break;
+        case OP_LDI:
+            d.handler = T_LDI;
+            d.imm = signExtend(instruction & 0x1FF, 9);
+            break;
+        case OP_STI:
+            d.handler = T_STI;
+            d.imm = signExtend(instruction & 0x1FF, 9);
+            break;
+        case OP_JMP:
+            d.handler = T_JMP;
+            break;
+        case OP_RES:
+            d.handler = T_RES;
+            break;
+        case OP_LEA:
+            d.handler = T_LEA;
+            d.imm = signExtend(instruction & 0x1FF, 9);
+            break;
+        default:
+            d.handler = T_TRAP;
+            break;
+    }
+    return d;
+}
+
+/*
+ * Check whether an op code ends a basic block.
+ *
+ * opCode: The op code to check
+ * return: 1 for control-flow instructions, 0 otherwise
+ */
+int isControlFlow(uint16_t opCode)
+{
+    switch (opCode) {
+        case OP_BR:
+        case OP_JSR:
+        case OP_JMP:
+        case OP_TRAP:
+        case OP_RTI:
+        case OP_RES:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Fill the decode table with every possible encoding, the first time it is
+ * needed.
+ *
+ * return: void
+ */
+void buildDecodeTable()
+{
+    if (decodeTableBuilt) {
+        return;
+    }
+    for (uint32_t instruction = 0; instruction < MAX_MEMORY; instruction++) {
+        decodeTable[instruction] = decodeInstruction((uint16_t)instruction);
+    }
+    decodeTableBuilt = 1;
+}
+
+/*
+ * Work out the memory accesses the instruction at the PC is about to make:
+ * its fetch, then the data accesses of LD, LDR, LDI, ST, STR and STI.
+ * Values are read straight from memory[] so that device registers are not
+ * disturbed.
+ *
+ * accesses: Receives the accesses
+ * return: Number of accesses
+ */
+int nextAccesses(struct memoryAccess *accesses)
+{
+    uint16_t pc = reg[R_PC];
+    uint16_t instruction = memory[pc];
+    uint16_t next = pc + 1;
+    uint16_t srcReg = (instruction >> 9) & 0x7;
+    uint16_t address;
+    int count = 0;
+
+    accesses[count++] = (struct memoryAccess){ACCESS_EXEC, pc, instruction};
+    switch (instruction >> 12) {
+        case OP_LD:
+            address = next + signExtend(instruction & 0x1FF, 9);
+            accesses[count++] = (struct memoryAccess){ACCESS_READ, address, memory[address]};
+            break;
+        case OP_LDR:
+            address = reg[(instruction >> 6) & 0x7] + signExtend(instruction & 0x3F, 6);
+            accesses[count++] = (struct memoryAccess){ACCESS_READ, address, memory[address]};
+            break;
+        case OP_LDI:
+            address = next + signExtend(instruction & 0x1FF, 9);
+            accesses[count++] = (struct memoryAccess){ACCESS_READ, address, memory[address]};
+            address = memory[address];
+            accesses[count++] = (struct memoryAccess){ACCESS_READ, address, memory[address]};
+            break;
+        case OP_ST:
+            address = next + signExtend(instruction & 0x1FF, 9);
+            accesses[count++] = (struct memoryAccess){ACCESS_WRITE, address, reg[srcReg]};
+            break;
+        case OP_STR:
+            address = reg[(instruction >> 6) & 0x7] + signExtend(instruction & 0x3F, 6);
+            accesses[count++] = (struct memoryAccess){ACCESS_WRITE, address, reg[srcReg]};
+            break;
+        case OP_STI:
+            address = next + signExtend(instruction & 0x1FF, 9);
+            accesses[count++] = (struct memoryAccess){ACCESS_READ, address, memory[address]};
+            accesses[count++] = (struct memoryAccess){ACCESS_WRITE, memory[address], reg[srcReg]};
+            break;
+    }
+    return count;
+}
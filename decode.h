@@ -0,0 +1,66 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stdint.h>
+
+#include "virtualMachine.h"
+
+// Specialized handlers
+enum {
+    T_BR_NEVER,  // BR with no condition bits set (NOP)
+    T_BR_ALWAYS,
+    T_BR,
+    T_ADD_REG,
+    T_ADD_IMM,
+    T_LD,
+    T_ST,
+    T_JSR,
+    T_JSRR,
+    T_AND_REG,
+    T_AND_IMM,
+    T_LDR,
+    T_STR,
+    T_RTI,
+    T_NOT,
+    T_LDI,
+    T_STI,
+    T_JMP,
+    T_RES,
+    T_LEA,
+    T_TRAP,
+    T_COUNT
+};
+
+struct decodedInstruction {
+    uint8_t handler;  // T_* value
+    uint8_t dest;     // DR or SR (the register in bits 11-9), or the BR condition mask
+    uint8_t src1;     // SR1 or BaseR
+    uint8_t src2;     // SR2
+    uint16_t imm;     // Sign-extended imm5 / offset6 / PCoffset9 / PCoffset11
+};
+
+#define MAX_ACCESSES 4  // Most memory accesses one instruction makes
+
+// Kinds of memory access
+enum {
+    ACCESS_READ = 1,
+    ACCESS_WRITE = 2,
+    ACCESS_EXEC = 4
+};
+
+// A memory access an instruction makes
+struct memoryAccess {
+    int type;  // ACCESS_* value
+    uint16_t address;
+    uint16_t value;
+};
+
+extern struct decodedInstruction decodeTable[MAX_MEMORY];
+
+// Function prototypes
+struct decodedInstruction decodeInstruction(uint16_t instruction);
+void buildDecodeTable();
+int isControlFlow(uint16_t opCode);
+int nextAccesses(struct memoryAccess *accesses);
+
+#endif
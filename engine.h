@@ -0,0 +1,119 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdint.h>
+
+#include "virtualMachine.h"
+
+// Interpreter engines selectable with --engine
+enum {
+    ENGINE_SWITCH,    // switch on the op code in a loop (reference)
+    ENGINE_TAILCALL,  // handlers tail-call the next handler through a table
+    ENGINE_GOTO,      // computed goto between handler labels
+    ENGINE_TABLE,     // computed goto through a table of every decoded encoding
+    ENGINE_AOT,       // image translated to C and compiled by the host compiler
+    ENGINE_TIERED,    // interpreter promoting hot blocks to pre-decoded blocks
+    ENGINE_LOCALS,    // table engine with the register file in locals
+    ENGINE_COUNT
+};
+
+#define TRACE_MAX_FAILURES 8  // Failed recordings before the tiered engine leaves a loop header alone
+
+extern const char *engineNames[ENGINE_COUNT];
+extern int engine;
+extern int tierThreshold;
+extern int traceThreshold;
+extern int chainingEnabled;
+
+// Function prototypes
+void runSwitchEngine();
+void runTailCallEngine();
+void runGotoEngine();
+void runTableEngine();
+void runTieredEngine();
+void runLocalsEngine();
+
+/*
+ * The helpers below are shared by the engines that do not go through the
+ * handler functions in virtualMachine.c. They are inline so that each engine
+ * can keep its machine state in host registers across them.
+ */
+
+/*
+ * Same as extendSign(), but visible to the compiler at every call site.
+ */
+static inline uint16_t signExtend(uint16_t bits, int bitCount)
+{
+    if ((bits >> (bitCount - 1)) & 1) {
+        bits |= (0xFFFF << bitCount);
+    }
+    return bits;
+}
+
+/*
+ * Condition code (FL_NEG, FL_ZRO or FL_POS) for a value written to a register.
+ */
+static inline uint16_t conditionFor(uint16_t value)
+{
+    if (value >> 15) {
+        return FL_NEG;
+    } else if (value == 0) {
+        return FL_ZRO;
+    }
+    return FL_POS;
+}
+
+/*
+ * Read memory, only calling memRead() for the device register page.
+ */
+static inline uint16_t fastRead(uint16_t *mem, uint16_t address)
+{
+    return address < MR_KBSR ? mem[address] : memRead(address);
+}
+
+/*
+ * ADD: both register and immediate forms.
+ */
+static inline void execAdd(uint16_t *r, uint16_t instruction)
+{
+    uint16_t destReg = (instruction >> 9) & 0x7;
+    uint16_t srcReg1 = (instruction >> 6) & 0x7;
+    uint16_t operand = (instruction & 0x20) ? signExtend(instruction & 0x1F, 5) : r[instruction & 0x7];
+    r[destReg] = r[srcReg1] + operand;
+    r[R_COND] = conditionFor(r[destReg]);
+}
+
+/*
+ * AND: both register and immediate forms.
+ */
+static inline void execAnd(uint16_t *r, uint16_t instruction)
+{
+    uint16_t destReg = (instruction >> 9) & 0x7;
+    uint16_t srcReg1 = (instruction >> 6) & 0x7;
+    uint16_t operand = (instruction & 0x20) ? signExtend(instruction & 0x1F, 5) : r[instruction & 0x7];
+    r[destReg] = r[srcReg1] & operand;
+    r[R_COND] = conditionFor(r[destReg]);
+}
+
+/*
+ * NOT
+ */
+static inline void execNot(uint16_t *r, uint16_t instruction)
+{
+    uint16_t destReg = (instruction >> 9) & 0x7;
+    r[destReg] = ~r[(instruction >> 6) & 0x7];
+    r[R_COND] = conditionFor(r[destReg]);
+}
+
+/*
+ * Load a value into the destination register and set the condition codes
+ * (LD, LDR, LDI, LEA).
+ */
+static inline void setRegister(uint16_t *r, uint16_t instruction, uint16_t value)
+{
+    uint16_t destReg = (instruction >> 9) & 0x7;
+    r[destReg] = value;
+    r[R_COND] = conditionFor(value);
+}
+
+#endif
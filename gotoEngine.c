@@ -0,0 +1,182 @@
+#include <stdint.h>
+
+#include "engine.h"
+#include "startup.h"
+#include "virtualMachine.h"
+
+/*
+ * Computed-goto (direct threaded) engine. Each handler ends with its own
+ * indirect jump to the next handler instead of returning to a shared switch,
+ * which gives the host branch predictor one prediction site per handler. The
+ * PC lives in a local and is only written back to reg[R_PC] before calling
+ * code outside the engine and when the machine stops.
+ *
+ * Labels as values are a GNU C extension, so -Wpedantic is silenced here.
+ */
+
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+/*
+ * Run the guest with the computed-goto engine until it stops.
+ *
+ * return: void
+ */
+void runGotoEngine()
+{
+    static void *const labels[OP_COUNT] = {
+        &&opBranch, &&opAdd, &&opLoad, &&opStore, &&opJumpToSubroutine, &&opBitwiseAnd,
+        &&opLoadBaseOffset, &&opStoreBaseOffset, &&opReturnFromInterrupt, &&opBitwiseNot,
+        &&opLoadIndirect, &&opStoreIndirect, &&opJump, &&opReserved, &&opLoadEffectiveAddr,
+        &&opExecuteTrapCode
+    };
+
+    uint16_t *r = reg;
+    uint16_t *mem = memory;
+    uint16_t pc = r[R_PC];
+    uint16_t instruction;
+    uint16_t address;
+
+// Fetch the instruction at pc and jump to its handler
+#define DISPATCH()                                  \
+    do {                                            \
+        instruction = fastRead(mem, pc++);          \
+        PROFILE_OPCODE(instruction >> 12);          \
+        opcodeCounts[instruction >> 12]++;          \
+        goto *labels[instruction >> 12];            \
+    } while (0)
+
+// Deliver a pending keyboard interrupt (and, under --lockstep, compare) at a
+// block boundary
+#define BLOCK_BOUNDARY()                                \
+    do {                                                \
+        if ((mem[MR_KBSR] & KB_IE) || boundaryChecks) { \
+            r[R_PC] = pc;                               \
+            checkInterrupts();                          \
+            pc = r[R_PC];                               \
+            if (!running) {                             \
+                return;                                 \
+            }                                           \
+        }                                               \
+    } while (0)
+
+// Store a value, only calling memWrite() for the device register page
+#define STORE(value)                    \
+    do {                                \
+        if (address < MR_KBSR) {        \
+            mem[address] = (value);     \
+        } else {                        \
+            r[R_PC] = pc;               \
+            memWrite(address, (value)); \
+            if (!running) {             \
+                return;                 \
+            }                           \
+        }                               \
+    } while (0)
+
+    startupMark(STARTUP_ENGINE_READY);
+    DISPATCH();
+
+opBranch:
+    if (((instruction >> 9) & 0x7) & r[R_COND]) {
+        uint16_t branchAddr = pc - 1;
+        pc += signExtend(instruction & 0x1FF, 9);
+        if (pc <= branchAddr) {
+            r[R_PC] = pc;
+            detectSpinLoop(branchAddr);  // Backward branch: possibly a polling loop
+        }
+    }
+    BLOCK_BOUNDARY();
+    DISPATCH();
+
+opAdd:
+    execAdd(r, instruction);
+    DISPATCH();
+
+opLoad:
+    setRegister(r, instruction, fastRead(mem, pc + signExtend(instruction & 0x1FF, 9)));
+    DISPATCH();
+
+opStore:
+    address = pc + signExtend(instruction & 0x1FF, 9);
+    STORE(r[(instruction >> 9) & 0x7]);
+    DISPATCH();
+
+opJumpToSubroutine: {
+    uint16_t r7 = pc;
+    if (instruction & 0x800) {
+        pc += signExtend(instruction & 0x7FF, 11);
+    } else {
+        pc = r[(instruction >> 6) & 0x7];
+    }
+    r[R_R7] = r7;
+    BLOCK_BOUNDARY();
+    DISPATCH();
+}
+
+opBitwiseAnd:
+    execAnd(r, instruction);
+    DISPATCH();
+
+opLoadBaseOffset:
+    address = r[(instruction >> 6) & 0x7] + signExtend(instruction & 0x3F, 6);
+    setRegister(r, instruction, fastRead(mem, address));
+    DISPATCH();
+
+opStoreBaseOffset:
+    address = r[(instruction >> 6) & 0x7] + signExtend(instruction & 0x3F, 6);
+    STORE(r[(instruction >> 9) & 0x7]);
+    DISPATCH();
+
+opReturnFromInterrupt:
+    r[R_PC] = pc;
+    returnFromInterrupt();
+    pc = r[R_PC];
+    if (!running) {
+        return;
+    }
+    BLOCK_BOUNDARY();
+    DISPATCH();
+
+opBitwiseNot:
+    execNot(r, instruction);
+    DISPATCH();
+
+opLoadIndirect:
+    address = fastRead(mem, pc + signExtend(instruction & 0x1FF, 9));
+    setRegister(r, instruction, fastRead(mem, address));
+    DISPATCH();
+
+opStoreIndirect:
+    address = fastRead(mem, pc + signExtend(instruction & 0x1FF, 9));
+    STORE(r[(instruction >> 9) & 0x7]);
+    DISPATCH();
+
+opJump:
+    pc = r[(instruction >> 6) & 0x7];
+    BLOCK_BOUNDARY();
+    DISPATCH();
+
+opReserved:
+    r[R_PC] = pc;
+    raiseException(INT_ILLEGAL_OP);
+    pc = r[R_PC];
+    DISPATCH();
+
+opLoadEffectiveAddr:
+    setRegister(r, instruction, pc + signExtend(instruction & 0x1FF, 9));
+    DISPATCH();
+
+opExecuteTrapCode:
+    r[R_PC] = pc;
+    executeTrapCode(instruction);
+    pc = r[R_PC];
+    if (!running) {
+        return;
+    }
+    BLOCK_BOUNDARY();
+    DISPATCH();
+
+#undef DISPATCH
+#undef BLOCK_BOUNDARY
+#undef STORE
+}
@@ -0,0 +1,191 @@
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "decode.h"
+#include "heatmap.h"
+#include "startup.h"
+#include "symbols.h"
+#include "virtualMachine.h"
+
+/*
+ * Memory access heatmap. Like watchpoints, it is an engine of its own:
+ * with --heatmap the VM runs the reference handlers through
+ * runHeatmapEngine(), which counts the data reads and writes of every LD,
+ * LDR, LDI, ST, STR and STI against the 256-word page they touch and the
+ * instruction that made them. Without it no engine counts anything.
+ *
+ * The counts are written at exit, and whenever the VM receives SIGUSR1: a
+ * CSV file with one row per page and per instruction, and a rendering of
+ * the pages on the terminal.
+ */
+
+#define PAGE_COUNT (MAX_MEMORY >> 8)  // 256-word pages
+#define TOP_INSTRUCTIONS 10           // Busiest instructions shown on the terminal
+
+const char *heatmapPath = NULL;  // --heatmap
+
+static uint64_t pageReads[PAGE_COUNT];
+static uint64_t pageWrites[PAGE_COUNT];
+static uint64_t pcReads[MAX_MEMORY];   // Reads made by the instruction at each address
+static uint64_t pcWrites[MAX_MEMORY];  // Writes made by the instruction at each address
+static volatile sig_atomic_t dumpRequested = 0;
+
+/*
+ * Ask for the heatmap to be written once the current instruction finishes.
+ *
+ * signal: The signal that was received
+ * return: void
+ */
+static void requestDump(int signal)
+{
+    (void)signal;
+    dumpRequested = 1;
+}
+
+/*
+ * Run the guest with the reference handlers, counting the data accesses of
+ * every instruction.
+ *
+ * return: void
+ */
+void runHeatmapEngine()
+{
+    startupMark(STARTUP_ENGINE_READY);
+    signal(SIGUSR1, requestDump);
+    while (running) {
+        struct memoryAccess accesses[MAX_ACCESSES];
+        int count = nextAccesses(accesses);
+        uint16_t pc = reg[R_PC];
+        stepInstruction();
+
+        for (int i = 1; i < count; i++) {
+            if (accesses[i].type == ACCESS_READ) {
+                pageReads[accesses[i].address >> 8]++;
+                pcReads[pc]++;
+            } else {
+                pageWrites[accesses[i].address >> 8]++;
+                pcWrites[pc]++;
+            }
+        }
+        if (dumpRequested) {
+            dumpRequested = 0;
+            if (writeHeatmap(stderr) != 0) {
+                perror(heatmapPath);
+            }
+        }
+    }
+}
+
+/*
+ * Pick the character that shows how busy a page is, on a log scale from '.'
+ * (never accessed) to '@' (as busy as the busiest page).
+ *
+ * count: Accesses to the page
+ * busiest: Accesses to the busiest page
+ * return: The character
+ */
+static char shade(uint64_t count, uint64_t busiest)
+{
+    static const char shades[] = ":-=+*#%@";
+    if (!count) {
+        return '.';
+    }
+    int bits = 64 - __builtin_clzll(count);
+    int busiestBits = 64 - __builtin_clzll(busiest);
+    return shades[(bits - 1) * (sizeof(shades) - 2) / (busiestBits > 1 ? busiestBits - 1 : 1)];
+}
+
+/*
+ * Draw the pages as two 16 x 16 grids, reads on the left and writes on the
+ * right, followed by the instructions that accessed memory the most.
+ *
+ * out: Where to draw
+ * return: void
+ */
+static void renderHeatmap(FILE *out)
+{
+    uint64_t busiestRead = 0;
+    uint64_t busiestWrite = 0;
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        busiestRead = pageReads[page] > busiestRead ? pageReads[page] : busiestRead;
+        busiestWrite = pageWrites[page] > busiestWrite ? pageWrites[page] : busiestWrite;
+        reads += pageReads[page];
+        writes += pageWrites[page];
+    }
+
+    fprintf(out, "\nMemory heatmap: %llu reads, %llu writes (one cell per 256-word page, log scale . : - = + * # %% @)\n",
+            (unsigned long long)reads, (unsigned long long)writes);
+    fprintf(out, "       %-16s   %s\n       0123456789ABCDEF   0123456789ABCDEF\n", "reads", "writes");
+    for (int row = 0; row < 16; row++) {
+        char readCells[17] = {0};
+        char writeCells[17] = {0};
+        for (int column = 0; column < 16; column++) {
+            readCells[column] = shade(pageReads[row * 16 + column], busiestRead);
+            writeCells[column] = shade(pageWrites[row * 16 + column], busiestWrite);
+        }
+        fprintf(out, "x%X000  %s   %s\n", row, readCells, writeCells);
+    }
+
+    // Busiest instructions, kept sorted by insertion since only a few are wanted
+    uint16_t top[TOP_INSTRUCTIONS];
+    int topCount = 0;
+    for (uint32_t pc = 0; pc < MAX_MEMORY; pc++) {
+        uint64_t traffic = pcReads[pc] + pcWrites[pc];
+        if (topCount < TOP_INSTRUCTIONS) {
+            top[topCount++] = pc;
+        } else if (traffic > pcReads[top[topCount - 1]] + pcWrites[top[topCount - 1]]) {
+            top[topCount - 1] = pc;
+        } else {
+            continue;
+        }
+        for (int i = topCount - 1; i > 0 && traffic > pcReads[top[i - 1]] + pcWrites[top[i - 1]]; i--) {
+            top[i] = top[i - 1];
+            top[i - 1] = pc;
+        }
+    }
+    while (topCount > 0 && !(pcReads[top[topCount - 1]] + pcWrites[top[topCount - 1]])) {
+        topCount--;  // Fewer than TOP_INSTRUCTIONS instructions accessed memory
+    }
+    if (topCount) {
+        fprintf(out, "  %-10s %14s %14s  %s\n", "pc", "reads", "writes", "symbol");
+    }
+    for (int i = 0; i < topCount; i++) {
+        const char *name = symbolName(top[i]);
+        fprintf(out, "  x%04X      %14llu %14llu  %s\n", top[i], (unsigned long long)pcReads[top[i]],
+                (unsigned long long)pcWrites[top[i]], name ? name : "");
+    }
+}
+
+/*
+ * Write the counts to heatmapPath as CSV and draw them on the terminal.
+ *
+ * terminal: Where to draw the pages
+ * return: 0 on success, -1 if the CSV file could not be written
+ */
+int writeHeatmap(FILE *terminal)
+{
+    renderHeatmap(terminal);
+
+    FILE *out = fopen(heatmapPath, "w");
+    if (!out) {
+        return -1;
+    }
+    fprintf(out, "kind,address,reads,writes\n");
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        if (pageReads[page] || pageWrites[page]) {
+            fprintf(out, "page,x%04X,%llu,%llu\n", page << 8, (unsigned long long)pageReads[page],
+                    (unsigned long long)pageWrites[page]);
+        }
+    }
+    for (uint32_t pc = 0; pc < MAX_MEMORY; pc++) {
+        if (pcReads[pc] || pcWrites[pc]) {
+            fprintf(out, "pc,x%04X,%llu,%llu\n", pc, (unsigned long long)pcReads[pc],
+                    (unsigned long long)pcWrites[pc]);
+        }
+    }
+    return fclose(out) == 0 ? 0 : -1;
+}
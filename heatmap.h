@@ -0,0 +1,12 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include <stdio.h>
+
+extern const char *heatmapPath;
+
+// Function prototypes
+void runHeatmapEngine();
+int writeHeatmap(FILE *terminal);
+
+#endif
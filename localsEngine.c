@@ -0,0 +1,289 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "decode.h"
+#include "engine.h"
+#include "startup.h"
+#include "virtualMachine.h"
+
+/*
+ * Table engine with the guest register file in locals. reg[] and memory[]
+ * are both global uint16_t arrays, so as far as the compiler knows every
+ * store into guest memory may change a register: the other engines reload
+ * reg[R_COND] and the registers they need after each store, and write every
+ * condition code update back to reg[]. Here R0-R7 live in a local array and
+ * the PC and condition codes in scalars. None of their addresses is ever
+ * taken, so the compiler can prove that no store through mem touches them
+ * and keeps the PC, condition codes, memory base and decoded entry in host
+ * registers across dispatch. The locals are written back to reg[] (SYNC)
+ * only before code outside the engine runs: traps, RTI, exceptions,
+ * interrupts, device register accesses, and spin-loop detection for the
+ * short loops it could park on.
+ *
+ * With gcc 12 -O2 on x86-64 the BR handler of the table engine loads the
+ * condition codes from reg[] and every ALU handler stores them back:
+ *
+ *     movzwl reg+R_COND(%rip),%eax        sete  %al ... add $0x1,%eax
+ *     test   %eax,%ecx                    mov   %ax,reg+R_COND(%rip)
+ *
+ * Here they stay in a register (r15) for the whole run, and R0-R7 are
+ * addressed off the stack pointer instead of through the global:
+ *
+ *     test   %r15d,%eax                   sete  %r15b ... add $0x1,%r15d
+ *
+ * Best of seven --bench runs against the table engine: a load/store loop
+ * 366 -> 458 MIPS, recursive fib 269 -> 308 MIPS, the trace test image
+ * 327 -> 332 MIPS (it spends its time in traps).
+ *
+ * Labels as values are a GNU C extension, so -Wpedantic is silenced here.
+ */
+
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+static uint64_t syncs = 0;  // Times the register file was written back
+
+/*
+ * Read a device register. Only the engine's locals have the condition codes
+ * up to date, and reading MR_PSR returns them.
+ *
+ * address: Address in the device register page
+ * cond: Current condition codes
+ * return: The value read
+ */
+static uint16_t readDevice(uint16_t address, uint16_t cond)
+{
+    reg[R_COND] = cond;
+    return memRead(address);
+}
+
+/*
+ * Run the guest through the fully decoded dispatch table with the register
+ * file in locals until it stops.
+ *
+ * return: void
+ */
+void runLocalsEngine()
+{
+    static void *const labels[T_COUNT] = {
+        &&brNever, &&brAlways, &&br, &&addReg, &&addImm, &&ld, &&st, &&jsr, &&jsrr,
+        &&andReg, &&andImm, &&ldr, &&str, &&rti, &&not, &&ldi, &&sti, &&jmp, &&res,
+        &&lea, &&trap
+    };
+
+    buildDecodeTable();
+
+    uint16_t *mem = memory;
+    uint16_t r[R_R7 + 1];
+    uint16_t pc;
+    uint16_t cond;
+    uint16_t instruction;
+    const struct decodedInstruction *d;
+    uint16_t address;
+
+// Hand the guest state to code outside the engine, and take it back
+#define SYNC()                              \
+    do {                                    \
+        memcpy(reg, r, sizeof(r));          \
+        reg[R_PC] = pc;                     \
+        reg[R_COND] = cond;                 \
+        syncs++;                            \
+    } while (0)
+
+#define RELOAD()                            \
+    do {                                    \
+        memcpy(r, reg, sizeof(r));          \
+        pc = reg[R_PC];                     \
+        cond = reg[R_COND];                 \
+    } while (0)
+
+// Stop if the code outside the engine halted the machine
+#define RELOAD_OR_STOP()                    \
+    do {                                    \
+        RELOAD();                           \
+        if (!running) {                     \
+            goto stop;                      \
+        }                                   \
+    } while (0)
+
+// Fetch the instruction at pc and jump to its specialized handler
+#define DISPATCH()                                  \
+    do {                                            \
+        instruction = READ(pc);                     \
+        pc++;                                       \
+        PROFILE_OPCODE(instruction >> 12);          \
+        opcodeCounts[instruction >> 12]++;          \
+        d = &decodeTable[instruction];              \
+        goto *labels[d->handler];                   \
+    } while (0)
+
+// Read memory; only the device register page leaves the engine (MR_PSR
+// reads the condition codes)
+#define READ(readAddress) \
+    ((uint16_t)(readAddress) < MR_KBSR ? mem[(uint16_t)(readAddress)] : readDevice((readAddress), cond))
+
+// Deliver a pending keyboard interrupt (and, under --lockstep, compare) at a
+// block boundary
+#define BLOCK_BOUNDARY()                                \
+    do {                                                \
+        if ((mem[MR_KBSR] & KB_IE) || boundaryChecks) { \
+            SYNC();                                     \
+            checkInterrupts();                          \
+            RELOAD_OR_STOP();                           \
+        }                                               \
+    } while (0)
+
+// Store a value, only calling memWrite() for the device register page
+#define STORE(value)                    \
+    do {                                \
+        if (address < MR_KBSR) {        \
+            mem[address] = (value);     \
+        } else {                        \
+            SYNC();                     \
+            memWrite(address, (value)); \
+            RELOAD_OR_STOP();           \
+        }                               \
+    } while (0)
+
+// Write a register and set the condition codes
+#define SET(destReg, value)                     \
+    do {                                        \
+        r[destReg] = (value);                   \
+        cond = conditionFor(r[destReg]);        \
+    } while (0)
+
+    RELOAD();
+    startupMark(STARTUP_ENGINE_READY);
+    DISPATCH();
+
+brNever:
+    BLOCK_BOUNDARY();
+    DISPATCH();
+
+br:
+    if (!(d->dest & cond)) {
+        BLOCK_BOUNDARY();
+        DISPATCH();
+    }
+    // Fall through: branch taken
+brAlways: {
+    uint16_t branchAddr = pc - 1;
+    pc += d->imm;
+    // Backward branch: possibly a polling loop. Only loops detectSpinLoop()
+    // has not already ruled out need the registers.
+    if (pc <= branchAddr && (uint16_t)(branchAddr - pc) < SPIN_MAX_BODY && (pc != spinHead || spinPure)) {
+        SYNC();
+        detectSpinLoop(branchAddr);
+        RELOAD_OR_STOP();
+    }
+    BLOCK_BOUNDARY();
+    DISPATCH();
+}
+
+addReg:
+    SET(d->dest, r[d->src1] + r[d->src2]);
+    DISPATCH();
+
+addImm:
+    SET(d->dest, r[d->src1] + d->imm);
+    DISPATCH();
+
+ld:
+    SET(d->dest, READ(pc + d->imm));
+    DISPATCH();
+
+st:
+    address = pc + d->imm;
+    STORE(r[d->dest]);
+    DISPATCH();
+
+jsr:
+    r[R_R7] = pc;
+    pc += d->imm;
+    BLOCK_BOUNDARY();
+    DISPATCH();
+
+jsrr: {
+    uint16_t target = r[d->src1];
+    r[R_R7] = pc;
+    pc = target;
+    BLOCK_BOUNDARY();
+    DISPATCH();
+}
+
+andReg:
+    SET(d->dest, r[d->src1] & r[d->src2]);
+    DISPATCH();
+
+andImm:
+    SET(d->dest, r[d->src1] & d->imm);
+    DISPATCH();
+
+ldr:
+    SET(d->dest, READ(r[d->src1] + d->imm));
+    DISPATCH();
+
+str:
+    address = r[d->src1] + d->imm;
+    STORE(r[d->dest]);
+    DISPATCH();
+
+rti:
+    SYNC();
+    returnFromInterrupt();
+    RELOAD_OR_STOP();
+    BLOCK_BOUNDARY();
+    DISPATCH();
+
+not:
+    SET(d->dest, ~r[d->src1]);
+    DISPATCH();
+
+ldi:
+    address = READ(pc + d->imm);
+    SET(d->dest, READ(address));
+    DISPATCH();
+
+sti:
+    address = READ(pc + d->imm);
+    STORE(r[d->dest]);
+    DISPATCH();
+
+jmp:
+    pc = r[d->src1];
+    BLOCK_BOUNDARY();
+    DISPATCH();
+
+res:
+    SYNC();
+    raiseException(INT_ILLEGAL_OP);
+    RELOAD_OR_STOP();
+    DISPATCH();
+
+lea:
+    SET(d->dest, pc + d->imm);
+    DISPATCH();
+
+trap:
+    SYNC();
+    executeTrapCode(instruction);
+    RELOAD_OR_STOP();
+    BLOCK_BOUNDARY();
+    DISPATCH();
+
+stop:
+    if (benchEnabled) {
+        uint64_t total = retiredInstructions();
+        fprintf(stderr, "\nlocals: register file written back %llu times (every %.0f instructions)\n",
+                (unsigned long long)syncs, syncs ? (double)total / syncs : 0);
+    }
+
+#undef SYNC
+#undef RELOAD
+#undef RELOAD_OR_STOP
+#undef DISPATCH
+#undef READ
+#undef BLOCK_BOUNDARY
+#undef STORE
+#undef SET
+}
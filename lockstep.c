@@ -0,0 +1,460 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "lockstep.h"
+#include "runReport.h"
+#include "startup.h"
+#include "virtualMachine.h"
+
+/*
+ * Differential testing of an engine against the reference switch engine.
+ * With --lockstep=ENGINE the VM forks once the image is loaded: the child
+ * runs ENGINE with its output discarded, the parent runs the reference
+ * handlers one instruction at a time, and the two compare their state at
+ * the candidate's block boundaries and traps. Those are the points where
+ * every engine has written the guest registers back to reg[] and counted
+ * every instruction it retired: boundaryChecks makes each engine call
+ * checkInterrupts() after every control-flow instruction, and
+ * executeTrapCode() calls lockstepCheckpoint() before every trap.
+ *
+ * At the first boundary or trap after --lockstep-interval=N instructions
+ * since the previous comparison (by default every one) the child sends the
+ * instructions it retired, reg[], R_COND, the PSR and a hash of memory[]
+ * and waits. The parent steps until it has retired as many instructions,
+ * compares, and lets the child go on. The final state is compared the same
+ * way when the engines stop. On the first difference the child sends all of
+ * memory, and the parent prints the registers of both engines side by side,
+ * the memory words that differ and the last HISTORY_LENGTH instructions the
+ * reference executed, then stops.
+ *
+ * Both engines must see the same input, so stdin is read to EOF before the
+ * fork and each process reads its own copy. Guests that poll KBSR or take
+ * keyboard interrupts depend on when input arrives, so the engines may
+ * legitimately disagree on those.
+ */
+
+#define HISTORY_LENGTH 32  // Instructions kept by the reference for the report
+
+// Where a checkpoint was taken
+enum {
+    AT_TRAP,      // Before the trap runs
+    AT_BOUNDARY,  // After a control-flow instruction and any interrupt it let in
+    AT_STOP       // The engine has stopped
+};
+
+// State compared at a block boundary or trap, or when an engine stops
+struct checkpoint {
+    uint64_t retired;
+    uint64_t memoryHash;
+    uint16_t registers[R_COUNT];
+    uint16_t psr;
+    uint16_t at;  // AT_TRAP, AT_BOUNDARY or AT_STOP
+};
+
+// An instruction the reference executed
+struct historyEntry {
+    uint16_t pc;
+    uint16_t instruction;
+    uint16_t registers[R_COUNT];  // Before it ran
+};
+
+// What the reference tells the candidate after a comparison
+enum {
+    VERDICT_CONTINUE = 'c',
+    VERDICT_DIVERGED = 'd'  // Send memory and exit
+};
+
+int lockstepEngine = -1;        // --lockstep
+uint64_t lockstepInterval = 1;  // --lockstep-interval
+int lockstepCandidate = 0;
+
+static int checkpointPipe = -1;  // Candidate -> reference
+static int verdictPipe = -1;     // Reference -> candidate
+static pid_t candidatePid = -1;
+static uint64_t lastRetired = 0;  // Instructions retired at the previous comparison
+static uint64_t comparisons = 0;
+static struct historyEntry history[HISTORY_LENGTH];
+static uint64_t stepped = 0;  // Instructions the reference executed
+static uint16_t candidateMemory[MAX_MEMORY];
+static struct checkpoint pending;  // The candidate's next checkpoint (reference)
+static int havePending = 0;
+static const char *placeNames[] = {"trap", "block", "stop"};
+
+/*
+ * Read exactly size bytes from a pipe.
+ *
+ * fd: The pipe
+ * buffer: Where to put them
+ * size: How many
+ * return: 0 on success, -1 if the other end closed it first
+ */
+static int readFully(int fd, void *buffer, size_t size)
+{
+    uint8_t *bytes = buffer;
+    while (size) {
+        ssize_t got = read(fd, bytes, size);
+        if (got <= 0) {
+            return -1;
+        }
+        bytes += got;
+        size -= got;
+    }
+    return 0;
+}
+
+/*
+ * Write exactly size bytes to a pipe.
+ *
+ * fd: The pipe
+ * buffer: The bytes
+ * size: How many
+ * return: 0 on success, -1 if the other end is gone
+ */
+static int writeFully(int fd, const void *buffer, size_t size)
+{
+    const uint8_t *bytes = buffer;
+    while (size) {
+        ssize_t put = write(fd, bytes, size);
+        if (put <= 0) {
+            return -1;
+        }
+        bytes += put;
+        size -= put;
+    }
+    return 0;
+}
+
+/*
+ * Hash all of memory, eight bytes at a time in four independent lanes so
+ * the multiplications overlap (it runs at every comparison, in both
+ * processes).
+ *
+ * return: The hash
+ */
+static uint64_t hashMemory()
+{
+    uint64_t lanes[4] = {0xCBF29CE484222325ULL, 1, 2, 3};
+    for (uint32_t address = 0; address < MAX_MEMORY; address += 16) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t words;
+            memcpy(&words, &memory[address + lane * 4], sizeof(words));
+            lanes[lane] = (lanes[lane] ^ words) * 0x100000001B3ULL;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+    }
+    uint64_t hash = lanes[0];
+    for (int lane = 1; lane < 4; lane++) {
+        hash = (hash ^ lanes[lane]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Copy stdin to a temporary file, fork, and give each process its own read
+ * position in the copy. The child becomes the candidate, running
+ * lockstepEngine with its output discarded; the parent runs the reference.
+ *
+ * return: 0 in both processes on success, -1 if the input could not be
+ *         copied or the process could not fork
+ */
+int startLockstep()
+{
+    FILE *input = tmpfile();
+    if (!input) {
+        return -1;
+    }
+    char buffer[4096];
+    ssize_t got;
+    while ((got = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0) {
+        fwrite(buffer, 1, got, input);
+    }
+    int checkpoints[2];
+    int verdicts[2];
+    if (fflush(input) != 0 || pipe(checkpoints) != 0 || pipe(verdicts) != 0) {
+        fclose(input);
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);  // A failed write is noticed; the other engine may have stopped first
+    fflush(stdout);
+    fflush(stderr);
+    candidatePid = fork();
+    if (candidatePid < 0) {
+        fclose(input);
+        return -1;
+    }
+
+    // A new open file description, so the two processes do not share an offset
+    snprintf(buffer, sizeof(buffer), "/proc/self/fd/%d", fileno(input));
+    int copy = open(buffer, O_RDONLY);
+    fclose(input);
+    if (copy < 0 || dup2(copy, STDIN_FILENO) < 0) {
+        return -1;
+    }
+    close(copy);
+
+    if (candidatePid == 0) {
+        lockstepCandidate = 1;
+        boundaryChecks = 1;
+        engine = lockstepEngine;
+        reportPath = NULL;
+        int discard = open("/dev/null", O_WRONLY);
+        dup2(discard, STDOUT_FILENO);
+        close(discard);
+        checkpointPipe = checkpoints[1];
+        verdictPipe = verdicts[0];
+        close(checkpoints[0]);
+        close(verdicts[1]);
+    } else {
+        engine = ENGINE_SWITCH;
+        checkpointPipe = checkpoints[0];
+        verdictPipe = verdicts[1];
+        close(checkpoints[1]);
+        close(verdicts[0]);
+    }
+    return 0;
+}
+
+/*
+ * Print one register row of the divergence report.
+ *
+ * name: Register name
+ * mine: Reference value
+ * theirs: Candidate value
+ * return: void
+ */
+static void printRegister(const char *name, uint16_t mine, uint16_t theirs)
+{
+    fprintf(stderr, "  %-6s x%04X   x%04X%s\n", name, mine, theirs, mine != theirs ? "   <" : "");
+}
+
+/*
+ * Print the difference between the engines, with the reference's latest
+ * instructions, and stop both.
+ *
+ * mine: Reference state
+ * theirs: Candidate state, or NULL if the candidate exited without sending it
+ * return: void
+ */
+static void reportDivergence(const struct checkpoint *mine, const struct checkpoint *theirs)
+{
+    static const char *registerNames[R_COUNT] = {"R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "COND"};
+    const char *name = engineNames[lockstepEngine];
+    char verdict = VERDICT_DIVERGED;
+    int haveMemory = theirs && writeFully(verdictPipe, &verdict, 1) == 0 &&
+                     readFully(checkpointPipe, candidateMemory, sizeof(candidateMemory)) == 0;
+
+    fprintf(stderr, "\nlockstep: the %s engine diverged from the switch engine at comparison %llu\n", name,
+            (unsigned long long)comparisons);
+    if (!theirs) {
+        int status = 0;
+        waitpid(candidatePid, &status, 0);
+        fprintf(stderr, "  %s %s %d before reaching the %s the switch engine reached after %llu instructions\n", name,
+                WIFSIGNALED(status) ? "was killed by signal" : "exited with status",
+                WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status),
+                mine->at == AT_STOP ? "end" : "point", (unsigned long long)mine->retired);
+    } else {
+        fprintf(stderr, "  %-6s %-7s %s\n", "", "switch", name);
+        fprintf(stderr, "  %-6s %-7s %s\n", "at", placeNames[mine->at], placeNames[theirs->at]);
+        fprintf(stderr, "  %-6s %-7llu %llu%s\n", "count", (unsigned long long)mine->retired,
+                (unsigned long long)theirs->retired, mine->retired != theirs->retired ? "   <" : "");
+        for (int r = 0; r < R_COUNT; r++) {
+            printRegister(registerNames[r], mine->registers[r], theirs->registers[r]);
+        }
+        printRegister("PSR", mine->psr, theirs->psr);
+    }
+    if (haveMemory) {
+        int differing = 0;
+        for (uint32_t address = 0; address < MAX_MEMORY; address++) {
+            if (memory[address] != candidateMemory[address] && differing++ < 8) {
+                fprintf(stderr, "  memory x%04X: x%04X   x%04X   <\n", address, memory[address],
+                        candidateMemory[address]);
+            }
+        }
+        fprintf(stderr, "  %d memory word%s differ%s\n", differing, differing == 1 ? "" : "s",
+                differing == 1 ? "s" : "");
+    }
+
+    uint64_t first = stepped > HISTORY_LENGTH ? stepped - HISTORY_LENGTH : 0;
+    fprintf(stderr, "  last %llu instructions on the switch engine (registers before each):\n",
+            (unsigned long long)(stepped - first));
+    for (uint64_t i = first; i < stepped; i++) {
+        const struct historyEntry *entry = &history[i % HISTORY_LENGTH];
+        fprintf(stderr, "  %10llu  x%04X  x%04X  %-18s", (unsigned long long)i + 1, entry->pc, entry->instruction,
+                opcodeNames[entry->instruction >> 12]);
+        for (int r = R_R0; r <= R_R7; r++) {
+            fprintf(stderr, " R%d=x%04X", r, entry->registers[r]);
+        }
+        fprintf(stderr, " COND=%u\n", entry->registers[R_COND]);
+    }
+
+    stopReason = STOP_DIVERGENCE;
+    running = 0;
+    waitpid(candidatePid, NULL, 0);
+}
+
+/*
+ * Read the candidate's next checkpoint unless it is already waiting
+ * (reference).
+ *
+ * return: 0 if pending holds it, -1 if the candidate exited instead
+ */
+static int readPending()
+{
+    if (!havePending && readFully(checkpointPipe, &pending, sizeof(pending)) == 0) {
+        havePending = 1;
+    }
+    return havePending ? 0 : -1;
+}
+
+/*
+ * Send a checkpoint to the reference (candidate), or compare one with the
+ * candidate's pending one (reference).
+ *
+ * at: AT_TRAP, AT_BOUNDARY or AT_STOP
+ * retired: Instructions retired
+ * return: 0 to carry on, -1 if the engines diverged
+ */
+static int exchangeCheckpoint(int at, uint64_t retired)
+{
+    struct checkpoint mine = {retired, hashMemory(), {0}, psr, at};
+    memcpy(mine.registers, reg, sizeof(mine.registers));
+
+    if (lockstepCandidate) {
+        char verdict;
+        if (writeFully(checkpointPipe, &mine, sizeof(mine)) != 0 || readFully(verdictPipe, &verdict, 1) != 0) {
+            _exit(0);  // The reference stopped
+        }
+        if (verdict != VERDICT_CONTINUE) {
+            writeFully(checkpointPipe, memory, sizeof(memory));
+            _exit(0);
+        }
+        return 0;
+    }
+
+    comparisons++;
+    if (readPending() != 0) {
+        if (stopReason == STOP_INTERRUPTED) {
+            return -1;  // Ctrl-C stopped both engines; finishLockstep() compares nothing
+        }
+        reportDivergence(&mine, NULL);
+        return -1;
+    }
+    havePending = 0;
+    if (memcmp(&mine, &pending, sizeof(mine)) != 0) {
+        reportDivergence(&mine, &pending);
+        return -1;
+    }
+    char verdict = VERDICT_CONTINUE;
+    writeFully(verdictPipe, &verdict, 1);
+    return 0;
+}
+
+/*
+ * Offer a checkpoint where the candidate is: sent once at least
+ * lockstepInterval instructions have retired since the previous one.
+ *
+ * at: AT_TRAP or AT_BOUNDARY
+ * return: void (the candidate exits here if the engines diverged)
+ */
+static void offerCheckpoint(int at)
+{
+    uint64_t retired = retiredInstructions();
+    if (retired - lastRetired >= lockstepInterval) {
+        lastRetired = retired;
+        exchangeCheckpoint(at, retired);
+    }
+}
+
+/*
+ * Called by executeTrapCode() before the trap runs, in both processes. The
+ * candidate offers a checkpoint; the reference compares if the candidate
+ * sent one at this trap, or has already been passed.
+ *
+ * return: 0 to run the trap, -1 if the engines diverged and the machine has
+ *         stopped
+ */
+int lockstepCheckpoint()
+{
+    if (lockstepCandidate) {
+        offerCheckpoint(AT_TRAP);
+        return 0;
+    }
+    uint64_t retired = retiredInstructions();
+    if (readPending() == 0 && (pending.retired > retired || (pending.retired == retired && pending.at != AT_TRAP))) {
+        return 0;  // Not there yet: a boundary at this count comes after the trap
+    }
+    return exchangeCheckpoint(AT_TRAP, retired);
+}
+
+/*
+ * Called by checkInterrupts() at every block boundary of the candidate.
+ *
+ * return: void
+ */
+void lockstepBoundary()
+{
+    offerCheckpoint(AT_BOUNDARY);
+}
+
+/*
+ * The reference side: the switch engine's handlers, one instruction at a
+ * time, keeping the latest instructions for the divergence report.
+ *
+ * return: void
+ */
+void runLockstepEngine()
+{
+    startupMark(STARTUP_ENGINE_READY);
+    while (running) {
+        // Compare once the candidate's checkpoint is reached; one that was
+        // passed without a match is reported as a divergence
+        if (readPending() != 0 || pending.retired <= retiredInstructions()) {
+            if (exchangeCheckpoint(AT_BOUNDARY, retiredInstructions()) != 0) {
+                return;
+            }
+            continue;
+        }
+        struct historyEntry *entry = &history[stepped % HISTORY_LENGTH];
+        entry->pc = reg[R_PC];
+        entry->instruction = memory[reg[R_PC]];
+        memcpy(entry->registers, reg, sizeof(entry->registers));
+        stepped++;
+        stepInstruction();
+    }
+}
+
+/*
+ * Compare the final state once the engine has stopped. The candidate exits
+ * here; the reference prints a summary if the engines agreed.
+ *
+ * return: void
+ */
+void finishLockstep()
+{
+    if (stopReason == STOP_DIVERGENCE) {
+        return;
+    }
+    if (stopReason == STOP_INTERRUPTED) {
+        if (lockstepCandidate) {
+            _exit(0);
+        }
+        return;  // The engines stopped at different points; there is nothing to compare
+    }
+    uint64_t retired = retiredInstructions();
+    if (exchangeCheckpoint(AT_STOP, retired) != 0) {
+        return;
+    }
+    if (lockstepCandidate) {
+        _exit(0);
+    }
+    waitpid(candidatePid, NULL, 0);
+    fprintf(stderr, "lockstep: the %s engine matched the switch engine at %llu comparisons over %llu instructions\n",
+            engineNames[lockstepEngine], (unsigned long long)comparisons, (unsigned long long)retired);
+}
@@ -0,0 +1,17 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdint.h>
+
+extern int lockstepEngine;         // Engine checked against the switch engine, or -1
+extern uint64_t lockstepInterval;  // Fewest instructions between two comparisons
+extern int lockstepCandidate;      // Set in the process that runs lockstepEngine
+
+// Function prototypes
+int startLockstep();
+int lockstepCheckpoint();
+void lockstepBoundary();
+void runLockstepEngine();
+void finishLockstep();
+
+#endif
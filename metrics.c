@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "virtualMachine.h"
+
+/*
+ * Live metrics. A background thread listens on a UNIX socket and answers
+ * every connection with the current counters in the Prometheus text format,
+ * so a running VM can be scraped (curl --unix-socket PATH http://vm/metrics,
+ * or socat - UNIX-CONNECT:PATH for the bare text). Nothing on the guest's
+ * path takes a lock or waits for the scraper: the per-op code counts are the
+ * engines' own opcodeCounts[], and everything else lives in the per-thread
+ * blocks of metrics[], which are only touched on traps, console output and
+ * waits for input.
+ *
+ * opcodeCounts[] is deliberately not atomic on the writer's side. Each count
+ * has a single writer (the interpreter thread), the engines and translated
+ * code bump it with a plain add on every instruction, and an atomic
+ * read-modify-write there would be a locked instruction on x86. The scraper
+ * reads with relaxed atomic loads; on the 64-bit hosts the VM runs on an
+ * aligned 64-bit store cannot be seen torn, so the worst a scrape sees is a
+ * count that is a few instructions stale, which a rate gauge cannot tell
+ * apart from scraping a moment earlier. Formally this is a data race that the
+ * VM accepts in exchange for keeping the dispatch loops free of atomics.
+ */
+
+#define REQUEST_TIMEOUT 100  // Longest wait (ms) for a client to send its request
+
+struct threadMetrics metrics[METRICS_THREADS];
+
+static const char *socketPath = NULL;
+static int listenFd = -1;
+static uint64_t startNs = 0;
+
+// Name of each trap vector the VM implements
+const char *trapNames[TRAP_VECTORS] = {
+    [TRAP_GETC] = "GETC", [TRAP_OUT] = "OUT", [TRAP_PUTS] = "PUTS",
+    [TRAP_IN] = "IN", [TRAP_PUTSP] = "PUTSP", [TRAP_HALT] = "HALT"
+};
+
+/*
+ * Read the monotonic clock.
+ *
+ * return: Nanoseconds since an arbitrary starting point
+ */
+uint64_t monotonicNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Sum a counter over every thread that owns a copy of it.
+ *
+ * offset: Offset of the counter in struct threadMetrics
+ * return: The total
+ */
+uint64_t sumMetric(size_t offset)
+{
+    uint64_t total = 0;
+    for (int thread = 0; thread < METRICS_THREADS; thread++) {
+        total += atomic_load_explicit((_Atomic uint64_t *)((char *)&metrics[thread] + offset), memory_order_relaxed);
+    }
+    return total;
+}
+
+/*
+ * Write the HELP and TYPE lines of a metric.
+ *
+ * out: Where to write
+ * name: Metric name
+ * type: counter or gauge
+ * help: Description
+ * return: void
+ */
+static void writeHeader(FILE *out, const char *name, const char *type, const char *help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * Write every metric in the Prometheus text exposition format.
+ *
+ * out: Where to write
+ * return: void
+ */
+static void writeMetrics(FILE *out)
+{
+    static uint64_t lastNs = 0;        // Previous scrape (only this thread scrapes)
+    static uint64_t lastRetired = 0;
+    static uint64_t lastBlockedNs = 0;
+
+    uint64_t now = monotonicNs();
+    uint64_t retired = 0;
+    uint64_t opcodes[OP_COUNT];
+    for (int op = 0; op < OP_COUNT; op++) {
+        opcodes[op] = __atomic_load_n(&opcodeCounts[op], __ATOMIC_RELAXED);
+        retired += opcodes[op];
+    }
+    uint64_t since = lastNs ? lastNs : startNs;
+    double rate = now > since ? (retired - lastRetired) * 1e9 / (now - since) : 0;
+    lastNs = now;
+    lastRetired = retired;
+
+    // A wait that ends between the two loads is counted in neither, so never
+    // report less than last time
+    uint64_t blockedNs = sumMetric(offsetof(struct threadMetrics, inputBlockedNs));
+    for (int thread = 0; thread < METRICS_THREADS; thread++) {
+        uint64_t waitStart = atomic_load_explicit(&metrics[thread].inputBlockedSince, memory_order_relaxed);
+        blockedNs += waitStart && now > waitStart ? now - waitStart : 0;
+    }
+    blockedNs = blockedNs > lastBlockedNs ? blockedNs : lastBlockedNs;
+    lastBlockedNs = blockedNs;
+
+    writeHeader(out, "lc3_running", "gauge", "1 while the guest is running.");
+    fprintf(out, "lc3_running %d\n", running);
+    writeHeader(out, "lc3_instructions_retired_total", "counter", "Guest instructions retired.");
+    fprintf(out, "lc3_instructions_retired_total %llu\n", (unsigned long long)retired);
+    writeHeader(out, "lc3_instructions_per_second", "gauge", "Instructions retired per second since the previous scrape.");
+    fprintf(out, "lc3_instructions_per_second %.0f\n", rate);
+
+    writeHeader(out, "lc3_opcode_retired_total", "counter", "Guest instructions retired per op code.");
+    for (int op = 0; op < OP_COUNT; op++) {
+        fprintf(out, "lc3_opcode_retired_total{opcode=\"%d\",handler=\"%s\"} %llu\n", op, opcodeNames[op],
+                (unsigned long long)opcodes[op]);
+    }
+
+    writeHeader(out, "lc3_traps_total", "counter", "TRAP instructions executed per vector.");
+    for (int vector = 0; vector < TRAP_VECTORS; vector++) {
+        uint64_t count = sumMetric(offsetof(struct threadMetrics, traps[vector]));
+        if (trapNames[vector] || count) {
+            fprintf(out, "lc3_traps_total{vector=\"x%02X\",name=\"%s\"} %llu\n", vector,
+                    trapNames[vector] ? trapNames[vector] : "unknown", (unsigned long long)count);
+        }
+    }
+
+    writeHeader(out, "lc3_output_bytes_total", "counter", "Bytes written to the console.");
+    fprintf(out, "lc3_output_bytes_total %llu\n",
+            (unsigned long long)sumMetric(offsetof(struct threadMetrics, bytesOut)));
+    writeHeader(out, "lc3_output_peak_bytes", "gauge", "Most bytes written to the console between two flushes.");
+    fprintf(out, "lc3_output_peak_bytes %llu\n",
+            (unsigned long long)sumMetric(offsetof(struct threadMetrics, outputPeak)));
+    writeHeader(out, "lc3_input_bytes_total", "counter", "Bytes read from stdin.");
+    fprintf(out, "lc3_input_bytes_total %llu\n",
+            (unsigned long long)sumMetric(offsetof(struct threadMetrics, bytesIn)));
+    writeHeader(out, "lc3_input_blocked_seconds_total", "counter", "Time the guest spent waiting for input.");
+    fprintf(out, "lc3_input_blocked_seconds_total %.6f\n", blockedNs / 1e9);
+}
+
+/*
+ * Answer one client. An HTTP request gets an HTTP response; a client that
+ * sends nothing within REQUEST_TIMEOUT gets the bare text.
+ *
+ * client: Connected socket
+ * return: void
+ */
+static void serveClient(int client)
+{
+    char request[1024];
+    ssize_t length = 0;
+    struct pollfd readable = {client, POLLIN, 0};
+    if (poll(&readable, 1, REQUEST_TIMEOUT) > 0) {
+        length = recv(client, request, sizeof(request), 0);
+    }
+    int http = length >= 4 && memcmp(request, "GET ", 4) == 0;
+
+    char *body = NULL;
+    size_t bodyLength = 0;
+    FILE *out = open_memstream(&body, &bodyLength);
+    if (!out) {
+        return;
+    }
+    writeMetrics(out);
+    fclose(out);
+
+    if (http) {
+        char header[160];
+        int headerLength = snprintf(header, sizeof(header),
+                                    "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                    "Content-Length: %zu\r\n\r\n", bodyLength);
+        send(client, header, headerLength, MSG_NOSIGNAL);
+    }
+    for (size_t sent = 0; sent < bodyLength;) {
+        ssize_t count = send(client, body + sent, bodyLength - sent, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+        sent += count;
+    }
+    free(body);
+}
+
+/*
+ * Body of the metrics thread: answer connections one at a time, forever.
+ *
+ * arg: Unused
+ * return: NULL
+ */
+static void *metricsThread(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        int client = accept(listenFd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        serveClient(client);
+        close(client);
+    }
+    return NULL;
+}
+
+/*
+ * Remove the socket when the VM exits.
+ *
+ * return: void
+ */
+static void removeSocket()
+{
+    unlink(socketPath);
+}
+
+/*
+ * Listen on a UNIX socket and start the metrics thread. An existing socket
+ * at the path (left behind by a VM that was killed) is replaced; anything
+ * else at the path is left alone and the server does not start.
+ *
+ * path: Path of the socket
+ * return: 0 on success, -1 with errno set on failure
+ */
+int startMetricsServer(const char *path)
+{
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        return -1;
+    }
+    struct stat existing;
+    if (lstat(path, &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            close(listenFd);
+            errno = EEXIST;
+            return -1;
+        }
+        unlink(path);
+    }
+    if (bind(listenFd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listenFd, 8) != 0) {
+        int error = errno;
+        close(listenFd);
+        errno = error;
+        return -1;
+    }
+    socketPath = path;
+    atexit(removeSocket);
+    startNs = monotonicNs();
+
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, metricsThread, NULL);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRAP_VECTORS 256  // Trap vectors an 8-bit trapvect8 can name
+
+// Counters owned by a single thread. Only the owner updates them, with a
+// relaxed load and store rather than a locked read-modify-write, and the
+// metrics thread reads them with relaxed loads and sums the threads.
+struct threadMetrics {
+    _Atomic uint64_t traps[TRAP_VECTORS];  // TRAP instructions executed per vector
+    _Atomic uint64_t bytesOut;             // Bytes written to the console
+    _Atomic uint64_t outputPeak;           // Most bytes written to the console between two flushes
+    _Atomic uint64_t bytesIn;              // Bytes read from stdin
+    _Atomic uint64_t inputBlockedNs;       // Time the guest spent waiting for input...
+    _Atomic uint64_t inputBlockedSince;    // ... not counting the wait in progress since this time (0: none)
+};
+
+// Threads that own counters
+enum {
+    METRICS_VM,     // Interpreter thread
+    METRICS_INPUT,  // Terminal input thread
+    METRICS_THREADS
+};
+
+extern struct threadMetrics metrics[METRICS_THREADS];
+extern const char *trapNames[TRAP_VECTORS];
+
+/*
+ * Add to a counter owned by the calling thread.
+ *
+ * counter: The counter
+ * amount: Amount to add
+ * return: void
+ */
+static inline void metricAdd(_Atomic uint64_t *counter, uint64_t amount)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+// Function prototypes
+uint64_t monotonicNs();
+uint64_t sumMetric(size_t offset);
+int startMetricsServer(const char *path);
+
+#endif
@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "benchLog.h"
+#include "virtualMachine.h"
+
+/*
+ * Handler microbenchmarks. Each instruction handler (and extendSign and
+ * updateFlags) is called in a tight loop over a table of random
+ * instructions of its op code, so register and immediate forms, offsets,
+ * condition codes and branch directions all vary the way they do in real
+ * code. Memory and registers hold random addresses below the device page,
+ * so loads and stores never reach a device register.
+ *
+ * Every handler is warmed up first, then timed in batches sized to take
+ * about a millisecond each. Batches more than OUTLIER_MADS median absolute
+ * deviations from the median (an interrupt, a migration, another process)
+ * are discarded, and the rest give the mean ns/op with a 95% confidence
+ * interval. The process is pinned to one CPU so the samples are not spread
+ * over cores with different clocks. The "(loop)" row is the cost of the
+ * harness itself: an empty handler called the same way.
+ *
+ * Built with "make microbench"; main() in virtualMachine.c is left out.
+ */
+
+#define OPERAND_COUNT 4096          // Random operands per handler (power of two)
+#define WARMUP_NS 50000000          // Time each handler runs before it is measured
+#define BATCH_NS 1000000            // Target duration of one timed batch
+#define DEFAULT_SAMPLES 30          // Timed batches per handler
+#define MAX_SAMPLES 1000
+#define OUTLIER_MADS 3.0            // Batches further than this from the median are dropped
+#define ADDRESS_LOW 0x0100          // Random addresses stay in [ADDRESS_LOW, ADDRESS_HIGH)
+#define ADDRESS_HIGH 0x7F00
+
+struct handlerBench {
+    const char *name;
+    void (*run)(uint16_t operand);
+    int opCode;  // Op code of the random instructions, or -1 for raw random operands
+};
+
+static uint16_t operands[OPERAND_COUNT];
+static uint64_t randomState = 0x9E3779B97F4A7C15ULL;
+
+/*
+ * xorshift64* generator, so runs with the same --seed see the same operands.
+ *
+ * return: 64 random bits
+ */
+static uint64_t nextRandom()
+{
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return randomState * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * A random address that is not in the device page, and far enough from it
+ * and from zero that adding any offset keeps it that way.
+ *
+ * return: The address
+ */
+static uint16_t randomAddress()
+{
+    return ADDRESS_LOW + nextRandom() % (ADDRESS_HIGH - ADDRESS_LOW);
+}
+
+/*
+ * Does nothing, to measure the cost of the benchmark loop.
+ *
+ * operand: Unused
+ * return: void
+ */
+static void emptyHandler(uint16_t operand)
+{
+    (void)operand;
+}
+
+/*
+ * extendSign with the operand's low 11 bits and one of the field widths the
+ * decoder uses, picked by its top bits.
+ *
+ * operand: Random bits
+ * return: void
+ */
+static void runExtendSign(uint16_t operand)
+{
+    static const int widths[4] = {5, 6, 9, 11};
+    reg[R_R0] = extendSign(operand & 0x7FF, widths[operand >> 14]);
+}
+
+/*
+ * updateFlags on the register named by the operand's low bits, after
+ * giving that register the rest of the operand so all three flags occur.
+ *
+ * operand: Random bits
+ * return: void
+ */
+static void runUpdateFlags(uint16_t operand)
+{
+    uint16_t r = operand & 0x7;
+    reg[r] = (operand & 0x18) == 0 ? 0 : (uint16_t)(operand & 0xFFF8);
+    updateFlags(r);
+}
+
+static const struct handlerBench benches[] = {
+    {"(loop)", emptyHandler, -1},
+    {"branch", branch, OP_BR},
+    {"add", add, OP_ADD},
+    {"load", load, OP_LD},
+    {"store", store, OP_ST},
+    {"jumpToSubroutine", jumpToSubroutine, OP_JSR},
+    {"bitwiseAnd", bitwiseAnd, OP_AND},
+    {"loadBaseOffset", loadBaseOffset, OP_LDR},
+    {"storeBaseOffset", storeBaseOffset, OP_STR},
+    {"bitwiseNot", bitwiseNot, OP_NOT},
+    {"loadIndirect", loadIndirect, OP_LDI},
+    {"storeIndirect", storeIndirect, OP_STI},
+    {"jump", jump, OP_JMP},
+    {"loadEffectiveAddr", loadEffectiveAddr, OP_LEA},
+    {"extendSign", runExtendSign, -1},
+    {"updateFlags", runUpdateFlags, -1},
+};
+
+#define BENCH_COUNT (int)(sizeof(benches) / sizeof(benches[0]))
+
+/*
+ * Fill the operand table for a handler, fill memory with random in-range
+ * addresses and pick the condition codes.
+ *
+ * bench: The handler
+ * return: void
+ */
+static void prepare(const struct handlerBench *bench)
+{
+    for (uint32_t address = 0; address < MAX_MEMORY; address++) {
+        memory[address] = address < MR_KBSR ? randomAddress() : 0;
+    }
+    reg[R_COND] = 1 << (nextRandom() % 3);
+    for (int i = 0; i < OPERAND_COUNT; i++) {
+        uint16_t bits = nextRandom();
+        operands[i] = bench->opCode < 0 ? bits : (uint16_t)((bench->opCode << 12) | (bits & 0xFFF));
+    }
+}
+
+/*
+ * Give the registers in-range addresses again. Only loads change the
+ * registers that loads and stores use, and they load in-range addresses,
+ * but resetting keeps every handler starting each pass from the same state.
+ *
+ * return: void
+ */
+static void resetAddresses()
+{
+    for (int r = R_R0; r <= R_R7; r++) {
+        reg[r] = ADDRESS_LOW + (r + 1) * ((ADDRESS_HIGH - ADDRESS_LOW) / 9);
+    }
+    reg[R_PC] = (ADDRESS_LOW + ADDRESS_HIGH) / 2;
+}
+
+/*
+ * Time one batch: count calls to the handler, each with the next operand.
+ * The registers are reset every OPERAND_COUNT calls (outside the timed
+ * inner loop's critical path, at a cost shared by every handler).
+ *
+ * bench: The handler
+ * count: Calls to make (a multiple of OPERAND_COUNT)
+ * return: Elapsed nanoseconds
+ */
+static uint64_t timeBatch(const struct handlerBench *bench, uint64_t count)
+{
+    void (*run)(uint16_t) = bench->run;
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint64_t done = 0; done < count; done += OPERAND_COUNT) {
+        resetAddresses();
+        for (int i = 0; i < OPERAND_COUNT; i++) {
+            run(operands[i]);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+}
+
+/*
+ * Two-sided 95% critical value of Student's t distribution.
+ *
+ * degrees: Degrees of freedom
+ * return: The critical value
+ */
+static double tCritical(int degrees)
+{
+    static const double table[] = {
+        0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    if (degrees < (int)(sizeof(table) / sizeof(table[0]))) {
+        return table[degrees];
+    }
+    return degrees < 60 ? 2.000 : degrees < 120 ? 1.980 : 1.960;
+}
+
+/*
+ * Warm up, size the batches, time them and print the handler's row.
+ *
+ * bench: The handler
+ * samples: Batches to time
+ * return: void
+ */
+static void runBench(const struct handlerBench *bench, int samples)
+{
+    prepare(bench);
+
+    // Warm up caches, predictors and the clock, doubling the batch until it takes BATCH_NS
+    uint64_t count = OPERAND_COUNT;
+    uint64_t warmed = 0;
+    while (warmed < WARMUP_NS) {
+        uint64_t ns = timeBatch(bench, count);
+        warmed += ns;
+        if (ns < BATCH_NS) {
+            count *= 2;
+        }
+    }
+
+    double perOp[MAX_SAMPLES];
+    for (int i = 0; i < samples; i++) {
+        perOp[i] = (double)timeBatch(bench, count) / count;
+    }
+
+    // Drop the batches far from the median
+    double middle = median(perOp, samples);
+    double deviations[MAX_SAMPLES];
+    for (int i = 0; i < samples; i++) {
+        deviations[i] = fabs(perOp[i] - middle);
+    }
+    double limit = OUTLIER_MADS * 1.4826 * median(deviations, samples);  // 1.4826 MAD estimates one sigma
+    int kept = 0;
+    double sum = 0;
+    for (int i = 0; i < samples; i++) {
+        if (fabs(perOp[i] - middle) <= limit) {
+            perOp[kept++] = perOp[i];
+            sum += perOp[i];
+        }
+    }
+
+    double mean = sum / kept;
+    double variance = 0;
+    for (int i = 0; i < kept; i++) {
+        variance += (perOp[i] - mean) * (perOp[i] - mean);
+    }
+    double interval = kept > 1 ? tCritical(kept - 1) * sqrt(variance / (kept - 1) / kept) : 0;
+    printf("%-20s %9.3f %9.3f %8d/%-4d %12llu\n", bench->name, mean, interval, kept, samples,
+           (unsigned long long)count);
+}
+
+/*
+ * Pin the process to one CPU.
+ *
+ * cpu: The CPU, or -1 for the one it is running on now
+ * return: The CPU it was pinned to, or -1 if pinning failed
+ */
+static int pinToCpu(int cpu)
+{
+    if (cpu < 0) {
+        cpu = sched_getcpu();
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0 ? cpu : -1;
+}
+
+/*
+ * Print the options.
+ *
+ * program: argv[0]
+ * return: void
+ */
+static void printMicrobenchUsage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options] [handler ...]\n", program);
+    fprintf(stderr, "  --samples=N           Timed batches per handler (default %d, at most %d)\n", DEFAULT_SAMPLES,
+            MAX_SAMPLES);
+    fprintf(stderr, "  --cpu=N               CPU to pin to (default: the one it starts on)\n");
+    fprintf(stderr, "  --seed=N              Seed for the random operands\n");
+    fprintf(stderr, "Handlers:");
+    for (int i = 0; i < BENCH_COUNT; i++) {
+        fprintf(stderr, " %s", benches[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int samples = DEFAULT_SAMPLES;
+    int cpu = -1;
+    int selected[BENCH_COUNT] = {0};
+    int selectedCount = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--samples=", 10) == 0) {
+            samples = atoi(argv[i] + 10);
+            if (samples < 3 || samples > MAX_SAMPLES) {
+                printMicrobenchUsage(argv[0]);
+                return 2;
+            }
+        } else if (strncmp(argv[i], "--cpu=", 6) == 0) {
+            cpu = atoi(argv[i] + 6);
+        } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+            randomState = strtoull(argv[i] + 7, NULL, 0) | 1;
+        } else {
+            int found = 0;
+            for (int b = 0; b < BENCH_COUNT; b++) {
+                if (strcmp(argv[i], benches[b].name) == 0) {
+                    selected[b] = found = 1;
+                    selectedCount++;
+                }
+            }
+            if (!found) {
+                printMicrobenchUsage(argv[0]);
+                return 2;
+            }
+        }
+    }
+
+    cpu = pinToCpu(cpu);
+    if (cpu < 0) {
+        perror("sched_setaffinity");
+    }
+    fprintf(stderr, "pinned to CPU %d, %d batches per handler\n", cpu, samples);
+    printf("%-20s %9s %9s %13s %12s\n", "handler", "ns/op", "+-95%", "kept", "ops/batch");
+    for (int b = 0; b < BENCH_COUNT; b++) {
+        if (!selectedCount || selected[b] || b == 0) {
+            runBench(&benches[b], samples);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,315 @@
+#define _GNU_SOURCE  // F_SETSIG and F_SETOWN_EX
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "perfCounters.h"
+#include "virtualMachine.h"
+
+#define SAMPLE_PERIOD_CYCLES 1000000  // Cycles between samples when the PMU is available
+#define SAMPLE_PERIOD_NS 1000000      // Task-clock nanoseconds between samples otherwise (1 kHz)
+#define SAMPLE_TIMER_US 1000          // setitimer() interval when perf_event_open is unusable
+
+// Counted events
+enum {
+    PC_CYCLES,
+    PC_INSTRUCTIONS,
+    PC_BRANCH_MISSES,
+    PC_ICACHE_MISSES,
+    PC_COUNT
+};
+
+// Where per-handler samples come from
+enum {
+    SAMPLER_NONE,
+    SAMPLER_CYCLES,      // Hardware cycle counter overflow
+    SAMPLER_TASK_CLOCK,  // Software task-clock overflow
+    SAMPLER_ITIMER       // setitimer(ITIMER_PROF)
+};
+
+struct perfCounter {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int fd;
+    int error;       // errno from perf_event_open, 0 if the counter opened
+    double value;    // Count scaled for time the counter was multiplexed out
+};
+
+static struct perfCounter counters[PC_COUNT] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, 0, 0},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1, 0, 0},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1, 0, 0},
+    {"L1-icache-misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+     -1, 0, 0}
+};
+
+static int sampler = SAMPLER_NONE;
+static int sampleFd = -1;
+static volatile uint64_t opcodeSamples[OP_COUNT];
+static uint64_t startCounts[OP_COUNT];
+static struct timespec startTime;
+static struct timespec stopTime;
+
+/*
+ * Thin wrapper around the perf_event_open system call (glibc has none).
+ * Events are always counted for the calling thread in user space only, which
+ * is what perf_event_paranoid up to 2 allows unprivileged processes to do.
+ *
+ * attr: Event description (user-space only bits are set here)
+ * return: File descriptor of the event, or -1 with errno set
+ */
+static int openEvent(struct perf_event_attr *attr)
+{
+    attr->size = sizeof(*attr);
+    attr->disabled = 1;
+    attr->exclude_kernel = 1;
+    attr->exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, attr, 0, -1, -1, 0);
+}
+
+#ifdef HANDLER_PROFILE
+/*
+ * Record which handler was running when a sample fired and re-arm the
+ * overflow signal. Both the perf overflow signal and SIGPROF land here.
+ *
+ * signal: The signal that was received
+ * return: void
+ */
+static void takeSample(int signal)
+{
+    (void)signal;
+    opcodeSamples[currentOpCode & (OP_COUNT - 1)]++;
+    if (sampleFd >= 0) {
+        ioctl(sampleFd, PERF_EVENT_IOC_REFRESH, 1);
+    }
+}
+
+/*
+ * Open a sampling event that delivers a signal to this thread every time its
+ * period elapses.
+ *
+ * type: perf event type
+ * config: perf event config
+ * period: Sample period in units of the event
+ * return: 1 if sampling was set up, 0 otherwise
+ */
+static int startOverflowSampler(uint32_t type, uint64_t config, uint64_t period)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = type;
+    attr.config = config;
+    attr.sample_period = period;
+    attr.wakeup_events = 1;
+
+    int fd = openEvent(&attr);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct f_owner_ex owner = {F_OWNER_TID, (pid_t)syscall(SYS_gettid)};
+    if (fcntl(fd, F_SETFL, O_ASYNC) != 0 || fcntl(fd, F_SETSIG, SIGIO) != 0
+        || fcntl(fd, F_SETOWN_EX, &owner) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    sampleFd = fd;
+    signal(SIGIO, takeSample);
+    ioctl(sampleFd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(sampleFd, PERF_EVENT_IOC_REFRESH, 1);
+    return 1;
+}
+
+/*
+ * Start sampling which handler is running. Cycle overflow is preferred; if
+ * the PMU is not available (virtual machines, containers) the software task
+ * clock is used, and if perf_event_open cannot be used at all the process CPU
+ * time interval timer is used instead.
+ *
+ * return: void
+ */
+static void startSampler()
+{
+    if (startOverflowSampler(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, SAMPLE_PERIOD_CYCLES)) {
+        sampler = SAMPLER_CYCLES;
+        return;
+    }
+    if (startOverflowSampler(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, SAMPLE_PERIOD_NS)) {
+        sampler = SAMPLER_TASK_CLOCK;
+        return;
+    }
+
+    struct itimerval timer = {{0, SAMPLE_TIMER_US}, {0, SAMPLE_TIMER_US}};
+    signal(SIGPROF, takeSample);
+    if (setitimer(ITIMER_PROF, &timer, NULL) == 0) {
+        sampler = SAMPLER_ITIMER;
+    }
+}
+#endif
+
+/*
+ * Open and enable every counter that this host allows. Counters that cannot
+ * be opened are remembered with their error and reported as unavailable.
+ *
+ * return: void
+ */
+void perfCountersStart()
+{
+    for (int i = 0; i < PC_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = counters[i].type;
+        attr.config = counters[i].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        counters[i].fd = openEvent(&attr);
+        counters[i].error = counters[i].fd < 0 ? errno : 0;
+    }
+
+#ifdef HANDLER_PROFILE
+    startSampler();
+#endif
+    memcpy(startCounts, opcodeCounts, sizeof(startCounts));
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    for (int i = 0; i < PC_COUNT; i++) {
+        if (counters[i].fd >= 0) {
+            ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+/*
+ * Stop counting and sampling and read the final counter values.
+ *
+ * return: void
+ */
+void perfCountersStop()
+{
+    for (int i = 0; i < PC_COUNT; i++) {
+        if (counters[i].fd >= 0) {
+            ioctl(counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stopTime);
+
+    if (sampleFd >= 0) {
+        ioctl(sampleFd, PERF_EVENT_IOC_DISABLE, 0);
+        close(sampleFd);
+        sampleFd = -1;
+    } else if (sampler == SAMPLER_ITIMER) {
+        struct itimerval off = {{0, 0}, {0, 0}};
+        setitimer(ITIMER_PROF, &off, NULL);
+    }
+
+    for (int i = 0; i < PC_COUNT; i++) {
+        uint64_t data[3];  // value, time enabled, time running
+        if (counters[i].fd < 0) {
+            continue;
+        }
+        if (read(counters[i].fd, data, sizeof(data)) == sizeof(data) && data[2]) {
+            counters[i].value = (double)data[0] * data[1] / data[2];
+        }
+        close(counters[i].fd);
+        counters[i].fd = -1;
+    }
+}
+
+/*
+ * Read /proc/sys/kernel/perf_event_paranoid so an unavailable counter can be
+ * explained.
+ *
+ * return: The paranoid level, or -100 if it could not be read
+ */
+static int readParanoidLevel()
+{
+    int level = -100;
+    FILE *file = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+    if (file) {
+        if (fscanf(file, "%d", &level) != 1) {
+            level = -100;
+        }
+        fclose(file);
+    }
+    return level;
+}
+
+/*
+ * Print the counters normalized per retired guest instruction, followed by a
+ * per-handler breakdown built from the samples.
+ *
+ * out: Stream to print the report to
+ * return: void
+ */
+void perfCountersReport(FILE *out)
+{
+    static const char *samplerNames[] = {"none", "cycles", "task-clock", "setitimer"};
+
+    uint64_t retired[OP_COUNT];
+    uint64_t totalRetired = 0;
+    uint64_t totalSamples = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        retired[op] = opcodeCounts[op] - startCounts[op];
+        totalRetired += retired[op];
+        totalSamples += opcodeSamples[op];
+    }
+    double seconds = (stopTime.tv_sec - startTime.tv_sec) + (stopTime.tv_nsec - startTime.tv_nsec) / 1e9;
+    double perInstr = totalRetired ? 1.0 / totalRetired : 0;
+
+    fprintf(out, "\nPerformance counters: %llu guest instructions in %.3f s (%.1f MIPS)\n",
+            (unsigned long long)totalRetired, seconds, seconds > 0 ? totalRetired / seconds / 1e6 : 0);
+    fprintf(out, "  %-18s %16s %16s\n", "event", "total", "per guest instr");
+
+    int anyUnavailable = 0;
+    for (int i = 0; i < PC_COUNT; i++) {
+        if (counters[i].error) {
+            fprintf(out, "  %-18s %16s   (%s)\n", counters[i].name, "unavailable", strerror(counters[i].error));
+            anyUnavailable = 1;
+        } else {
+            fprintf(out, "  %-18s %16.0f %16.3f\n", counters[i].name, counters[i].value,
+                    counters[i].value * perInstr);
+        }
+    }
+    if (anyUnavailable) {
+        int level = readParanoidLevel();
+        fprintf(out, "  note: perf_event_paranoid is %d; unprivileged counting needs 2 or lower, "
+                "and hardware events need a PMU exposed to this host\n", level);
+    }
+
+    fprintf(out, "\nPer-handler breakdown (%llu samples from %s)\n", (unsigned long long)totalSamples,
+            samplerNames[sampler]);
+#ifndef HANDLER_PROFILE
+    fprintf(out, "  note: time per handler is only sampled in a build from make handler-profile\n");
+#endif
+    fprintf(out, "  %-20s %14s %8s %8s %8s %10s\n", "handler", "retired", "% instr", "samples", "% time",
+            "ns/instr");
+    double cycles = counters[PC_CYCLES].error ? 0 : counters[PC_CYCLES].value;
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (!retired[op] && !opcodeSamples[op]) {
+            continue;
+        }
+        double timeShare = totalSamples ? (double)opcodeSamples[op] / totalSamples : 0;
+        double nsPerInstr = retired[op] ? timeShare * seconds * 1e9 / retired[op] : 0;
+        fprintf(out, "  %-20s %14llu %7.2f%% %8llu %7.2f%% %10.2f", opcodeNames[op],
+                (unsigned long long)retired[op], 100.0 * retired[op] * perInstr,
+                (unsigned long long)opcodeSamples[op], 100.0 * timeShare, nsPerInstr);
+        if (cycles && retired[op]) {
+            fprintf(out, "  (%.1f cycles/instr)", timeShare * cycles / retired[op]);
+        }
+        fprintf(out, "\n");
+    }
+}
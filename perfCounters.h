@@ -0,0 +1,11 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdio.h>
+
+// Function prototypes
+void perfCountersStart();
+void perfCountersStop();
+void perfCountersReport(FILE *out);
+
+#endif
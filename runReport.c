@@ -0,0 +1,77 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "engine.h"
+#include "metrics.h"
+#include "runReport.h"
+#include "virtualMachine.h"
+
+/*
+ * Machine-readable summary of a run, written as JSON to --report=FILE when
+ * the guest stops: at exit (including after Ctrl-C, which only stops the
+ * guest), or just before the VM aborts. Everything in it is either final state or a counter the VM
+ * keeps anyway, so asking for it costs nothing while the guest runs:
+ *
+ *     {"stopReason": "halt", "engine": "switch", "registers": [...],
+ *      "pc": 12294, "cond": 2, "psr": 32768, "instructions": 3612,
+ *      "wallSeconds": 0.004, "traps": {"PUTS": 4, "HALT": 1},
+ *      "bytesIn": 0, "bytesOut": 31, "peakOutputBytes": 12}
+ */
+
+const char *reportPath = NULL;  // --report
+volatile sig_atomic_t stopReason = STOP_NONE;
+uint64_t runStartNs = 0;        // monotonicNs() when main() started
+
+static const char *stopReasonNames[STOP_COUNT] = {
+    "none", "halt", "clock", "illegal-opcode", "privilege-violation", "unknown-trap", "watchpoint", "interrupted",
+    "divergence"
+};
+
+/*
+ * Write the report to reportPath, if one was asked for. Safe to call more
+ * than once; each call replaces the file.
+ *
+ * return: void
+ */
+void writeRunReport()
+{
+    if (!reportPath) {
+        return;
+    }
+    FILE *out = fopen(reportPath, "w");
+    if (!out) {
+        perror(reportPath);
+        return;
+    }
+
+    uint64_t retired = retiredInstructions();
+
+    fprintf(out, "{\n  \"stopReason\": \"%s\",\n  \"engine\": \"%s\",\n  \"registers\": [",
+            stopReasonNames[stopReason], engineNames[engine]);
+    for (int r = R_R0; r <= R_R7; r++) {
+        fprintf(out, "%s%u", r ? ", " : "", reg[r]);
+    }
+    fprintf(out, "],\n  \"pc\": %u,\n  \"cond\": %u,\n  \"psr\": %u,\n", reg[R_PC], reg[R_COND],
+            psr | reg[R_COND]);
+    fprintf(out, "  \"instructions\": %llu,\n  \"wallSeconds\": %.6f,\n  \"traps\": {", (unsigned long long)retired,
+            (monotonicNs() - runStartNs) / 1e9);
+
+    const char *separator = "";
+    for (int vector = 0; vector < TRAP_VECTORS; vector++) {
+        uint64_t count = sumMetric(offsetof(struct threadMetrics, traps[vector]));
+        if (!count) {
+            continue;
+        }
+        if (trapNames[vector]) {
+            fprintf(out, "%s\"%s\": %llu", separator, trapNames[vector], (unsigned long long)count);
+        } else {
+            fprintf(out, "%s\"x%02X\": %llu", separator, vector, (unsigned long long)count);
+        }
+        separator = ", ";
+    }
+    fprintf(out, "},\n  \"bytesIn\": %llu,\n  \"bytesOut\": %llu,\n  \"peakOutputBytes\": %llu\n}\n",
+            (unsigned long long)sumMetric(offsetof(struct threadMetrics, bytesIn)),
+            (unsigned long long)sumMetric(offsetof(struct threadMetrics, bytesOut)),
+            (unsigned long long)sumMetric(offsetof(struct threadMetrics, outputPeak)));
+    fclose(out);
+}
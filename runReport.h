@@ -0,0 +1,28 @@
+#ifndef RUN_REPORT_H
+#define RUN_REPORT_H
+
+#include <signal.h>
+#include <stdint.h>
+
+// Why the guest stopped
+enum {
+    STOP_NONE,                 // Still running (or stopped some other way)
+    STOP_HALT,                 // TRAP x25
+    STOP_CLOCK,                // MCR clock enable bit cleared
+    STOP_ILLEGAL_OPCODE,       // RES with no exception handler installed
+    STOP_PRIVILEGE_VIOLATION,  // RTI in user mode with no exception handler installed
+    STOP_UNKNOWN_TRAP,         // TRAP to a vector the VM does not implement
+    STOP_WATCHPOINT,           // A --watch stop
+    STOP_INTERRUPTED,          // SIGINT
+    STOP_DIVERGENCE,           // --lockstep found the engines disagreeing
+    STOP_COUNT
+};
+
+extern const char *reportPath;
+extern volatile sig_atomic_t stopReason;
+extern uint64_t runStartNs;
+
+// Function prototypes
+void writeRunReport();
+
+#endif
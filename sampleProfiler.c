@@ -0,0 +1,201 @@
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "callStack.h"
+#include "sampleProfiler.h"
+#include "symbols.h"
+#include "virtualMachine.h"
+
+/*
+ * Sampling profiler. setitimer(ITIMER_PROF) raises SIGPROF every 1/profileHz
+ * seconds of CPU time, and the handler records the guest call stack at that
+ * moment: the shadow stack kept by jumpToSubroutine() and jump(), with the
+ * current PC as the innermost frame. Identical stacks are counted in a hash
+ * table that is allocated up front, so the handler never calls into the C
+ * library. At exit the table is written as folded stacks, one line per
+ * stack, for flamegraph.pl and similar tools:
+ *
+ *     x3000;x3040;x3080;x3080+5 812
+ *
+ * Frames are subroutine entry addresses, or their names if a symbol file was
+ * loaded; the last one is the sampled PC as an offset into the innermost
+ * subroutine. Stacks deeper than
+ * MAX_SAMPLE_FRAMES keep their outermost frames, followed by "..." and the
+ * PC on its own.
+ *
+ * jump() pops a frame before the PC returns to the caller and
+ * jumpToSubroutine() pushes one after the PC enters the callee, so a sample
+ * taken between the two stores can only pair the caller's frame with a PC
+ * in the subroutine it is calling or returning from. A PC below the
+ * innermost entry cannot be an offset into it, so it is written as a plain
+ * address under that frame instead:
+ *
+ *     x3000;x3040;x3020 3
+ */
+
+#define SAMPLE_SLOTS (1 << 16)    // Distinct stacks that can be counted (power of two)
+#define SAMPLE_ARENA (1 << 21)    // Words of frames they can hold in total
+#define MAX_SAMPLE_FRAMES 256     // Deeper stacks keep their outermost frames
+
+// A distinct stack and how often it was sampled
+struct sampleSlot {
+    uint64_t count;
+    uint32_t hash;
+    uint32_t offset;  // First frame in the arena
+    uint16_t length;  // Frames, including the PC
+    uint16_t truncated;
+};
+
+const char *profilePath = NULL;  // --profile
+int profileHz = 1000;            // --profile-hz
+
+static struct sampleSlot *slots = NULL;
+static uint16_t *arena = NULL;
+static uint32_t arenaUsed = 0;
+static uint64_t samples = 0;
+static uint64_t droppedSamples = 0;  // Samples whose stack did not fit in the table
+static struct sigaction previousProf;
+
+/*
+ * Count the current guest stack. Runs in the SIGPROF handler.
+ *
+ * signal: The signal that was received
+ * return: void
+ */
+static void takeStackSample(int signal)
+{
+    (void)signal;
+    uint16_t frames[MAX_SAMPLE_FRAMES + 2];
+    uint32_t depth = callDepth;
+    uint32_t recorded = depth < MAX_SAMPLE_FRAMES ? depth : MAX_SAMPLE_FRAMES;
+    uint16_t truncated = recorded < depth;
+
+    uint32_t length = 0;
+    frames[length++] = callRoot;
+    for (uint32_t i = 0; i < recorded; i++) {
+        frames[length++] = callStack[i].entry;
+    }
+    frames[length++] = reg[R_PC];
+
+    uint32_t hash = 2166136261u ^ truncated;  // FNV-1a
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash ^ frames[i]) * 16777619u;
+    }
+
+    samples++;
+    for (uint32_t probe = 0; probe < SAMPLE_SLOTS; probe++) {
+        struct sampleSlot *slot = &slots[(hash + probe) & (SAMPLE_SLOTS - 1)];
+        if (!slot->count) {
+            if (arenaUsed + length > SAMPLE_ARENA) {
+                break;
+            }
+            for (uint32_t i = 0; i < length; i++) {
+                arena[arenaUsed + i] = frames[i];
+            }
+            *slot = (struct sampleSlot){1, hash, arenaUsed, length, truncated};
+            arenaUsed += length;
+            return;
+        }
+        if (slot->hash == hash && slot->length == length && slot->truncated == truncated) {
+            uint32_t same = 0;
+            while (same < length && arena[slot->offset + same] == frames[same]) {
+                same++;
+            }
+            if (same == length) {
+                slot->count++;
+                return;
+            }
+        }
+    }
+    droppedSamples++;
+}
+
+/*
+ * Turn on call tracking and start the profiling timer.
+ *
+ * return: 0 on success, -1 if the table could not be allocated or the timer
+ *         could not be started
+ */
+int startSampleProfiler()
+{
+    slots = calloc(SAMPLE_SLOTS, sizeof(*slots));
+    arena = malloc(SAMPLE_ARENA * sizeof(*arena));
+    if (!slots || !arena || profileHz <= 0 || profileHz > 1000000) {
+        return -1;
+    }
+
+    callTracking = 1;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = takeStackSample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    long interval = 1000000 / profileHz;
+    struct itimerval timer = {{interval / 1000000, interval % 1000000}, {interval / 1000000, interval % 1000000}};
+    if (sigaction(SIGPROF, &action, &previousProf) != 0 || setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write the samples as folded stacks.
+ *
+ * out: Where to write
+ * return: void
+ */
+static void writeFoldedStacks(FILE *out)
+{
+    for (uint32_t i = 0; i < SAMPLE_SLOTS; i++) {
+        const struct sampleSlot *slot = &slots[i];
+        if (!slot->count) {
+            continue;
+        }
+        const uint16_t *frames = &arena[slot->offset];
+        char buffer[8];
+        for (uint32_t frame = 0; frame + 1 < slot->length; frame++) {
+            fprintf(out, "%s;", addressName(frames[frame], buffer));
+        }
+        uint16_t pc = frames[slot->length - 1];
+        uint16_t function = frames[slot->length - 2];
+        if (slot->truncated) {
+            fprintf(out, "...;%s %llu\n", addressName(pc, buffer), (unsigned long long)slot->count);
+        } else if (pc < function) {
+            fprintf(out, "%s %llu\n", addressName(pc, buffer), (unsigned long long)slot->count);  // Called from it
+        } else {
+            fprintf(out, "%s+%u %llu\n", addressName(function, buffer), (uint16_t)(pc - function),
+                    (unsigned long long)slot->count);
+        }
+    }
+}
+
+/*
+ * Stop the profiling timer and write the folded stacks to profilePath.
+ *
+ * return: 0 on success, -1 if the file could not be written
+ */
+int finishSampleProfiler()
+{
+    struct itimerval off = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &off, NULL);
+    sigaction(SIGPROF, &previousProf, NULL);
+    callTracking = 0;
+
+    FILE *out = fopen(profilePath, "w");
+    if (!out) {
+        return -1;
+    }
+    writeFoldedStacks(out);
+    fprintf(stderr, "profile: %llu samples at %d Hz written to %s", (unsigned long long)samples, profileHz,
+            profilePath);
+    if (droppedSamples) {
+        fprintf(stderr, " (%llu dropped: too many distinct stacks)", (unsigned long long)droppedSamples);
+    }
+    fprintf(stderr, "\n");
+    return fclose(out) == 0 ? 0 : -1;
+}
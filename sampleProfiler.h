@@ -0,0 +1,11 @@
+#ifndef SAMPLE_PROFILER_H
+#define SAMPLE_PROFILER_H
+
+extern const char *profilePath;
+extern int profileHz;
+
+// Function prototypes
+int startSampleProfiler();
+int finishSampleProfiler();
+
+#endif
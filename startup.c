@@ -0,0 +1,112 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "startup.h"
+
+/*
+ * Start-up latency. main() and the engines mark the points in startup.h as
+ * they pass them, which costs one clock read each, and --startup-stats
+ * prints the time between them at exit. The time from process creation to
+ * main() (the dynamic loader and C runtime) comes from the start time the
+ * kernel keeps in /proc/self/stat, which is only as precise as the clock
+ * tick.
+ *
+ * With --fast-start=N the guest's first N instructions run on the switch
+ * engine, which needs no set-up, and only then are the optional helpers
+ * started and the chosen engine entered (decode tables, translation and
+ * code caches). The report then shows the first fetch well before the
+ * optional work.
+ */
+
+int startupStats = 0;                // --startup-stats
+uint64_t fastStartInstructions = 0;  // --fast-start
+uint64_t startupNs[STARTUP_MARKS];
+
+/*
+ * Time from process creation to main(), from the start time in
+ * /proc/self/stat.
+ *
+ * return: Milliseconds, or -1 if it is not available
+ */
+static double processInitMs()
+{
+    FILE *stat = fopen("/proc/self/stat", "r");
+    if (!stat) {
+        return -1;
+    }
+    // Field 22 is the start time in clock ticks since boot; field 2 (the
+    // command name) may contain spaces, so skip to the last ')'
+    char line[1024];
+    size_t length = fread(line, 1, sizeof(line) - 1, stat);
+    fclose(stat);
+    line[length] = '\0';
+    char *field = NULL;
+    for (char *c = line; *c; c++) {
+        field = *c == ')' ? c : field;
+    }
+    unsigned long long startTicks;
+    if (!field || sscanf(field + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+                         &startTicks) != 1) {
+        return -1;
+    }
+
+    // CLOCK_BOOTTIME at main() entry, from how long ago main() was entered
+    struct timespec boot;
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    double bootAtMainMs = boot.tv_sec * 1e3 + boot.tv_nsec / 1e6 - (monotonicNs() - startupNs[STARTUP_MAIN]) / 1e6;
+    double startMs = startTicks * 1e3 / sysconf(_SC_CLK_TCK);
+    return bootAtMainMs > startMs ? bootAtMainMs - startMs : 0;
+}
+
+/*
+ * Print one phase: its length and when it ended, relative to main().
+ *
+ * out: Where to print
+ * name: Phase
+ * from: STARTUP_* mark it starts at
+ * to: STARTUP_* mark it ends at
+ * return: void
+ */
+static void printPhase(FILE *out, const char *name, int from, int to)
+{
+    if (!startupNs[from] || !startupNs[to]) {
+        return;
+    }
+    fprintf(out, "  %-34s %10.3f ms %10.3f ms\n", name, (startupNs[to] - startupNs[from]) / 1e6,
+            (startupNs[to] - startupNs[STARTUP_MAIN]) / 1e6);
+}
+
+/*
+ * Print the start-up breakdown.
+ *
+ * out: Where to print it
+ * return: void
+ */
+void startupReport(FILE *out)
+{
+    double initMs = processInitMs();
+    int first = startupNs[STARTUP_FAST_START] ? STARTUP_FAST_START : STARTUP_ENGINE_READY;
+
+    fprintf(out, "\nStart-up (%s):\n  %-34s %13s %13s\n", fastStartInstructions ? "fast start" : "normal", "phase",
+            "took", "done at");
+    if (initMs >= 0) {
+        fprintf(out, "  %-34s %10.0f ms %13s   (clock-tick resolution)\n", "process creation to main()", initMs, "");
+    }
+    printPhase(out, "parse options", STARTUP_MAIN, STARTUP_OPTIONS);
+    printPhase(out, "load images into memory[]", STARTUP_OPTIONS, STARTUP_IMAGES);
+    printPhase(out, "terminal and input thread", STARTUP_IMAGES, STARTUP_SETUP);
+    if (startupNs[STARTUP_FAST_START]) {
+        printPhase(out, "to first fetch (switch engine)", STARTUP_SETUP, STARTUP_FAST_START);
+        printPhase(out, "first instructions (switch engine)", STARTUP_FAST_START, STARTUP_FAST_DONE);
+        printPhase(out, "optional helpers (deferred)", STARTUP_FAST_DONE, STARTUP_OPTIONAL_DONE);
+    } else {
+        printPhase(out, "optional helpers", STARTUP_SETUP, STARTUP_OPTIONAL_DONE);
+    }
+    printPhase(out, "engine decoding and translation", STARTUP_ENGINE_ENTER, STARTUP_ENGINE_READY);
+    if (startupNs[first]) {
+        fprintf(out, "  %-34s %13s %10.3f ms\n", "first guest instruction fetched", "",
+                (startupNs[first] - startupNs[STARTUP_MAIN]) / 1e6);
+    }
+}
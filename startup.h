@@ -0,0 +1,44 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "metrics.h"
+
+// Points on the way from main() to the first guest instruction
+enum {
+    STARTUP_MAIN,           // main() entered
+    STARTUP_OPTIONS,        // Command line parsed
+    STARTUP_IMAGES,         // Images loaded into memory[]
+    STARTUP_SETUP,          // Terminal, input thread (and lockstep fork) ready
+    STARTUP_FAST_START,     // --fast-start: first instruction on the switch engine
+    STARTUP_FAST_DONE,      // --fast-start: N instructions retired
+    STARTUP_OPTIONAL_DONE,  // Metrics, tracing, profilers and perf counters started
+    STARTUP_ENGINE_ENTER,   // Engine function called
+    STARTUP_ENGINE_READY,   // Engine's first fetch, after its decoding or translation
+    STARTUP_MARKS
+};
+
+extern int startupStats;
+extern uint64_t fastStartInstructions;
+extern uint64_t startupNs[STARTUP_MARKS];
+
+/*
+ * Record when a point was first reached. Later calls for the same point
+ * (an engine falling back to the switch engine) are ignored.
+ *
+ * mark: STARTUP_* value
+ * return: void
+ */
+static inline void startupMark(int mark)
+{
+    if (!startupNs[mark]) {
+        startupNs[mark] = monotonicNs();
+    }
+}
+
+// Function prototypes
+void startupReport(FILE *out);
+
+#endif
@@ -0,0 +1,95 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "symbols.h"
+#include "virtualMachine.h"
+
+/*
+ * Guest symbol names for profiles. Symbol files are the tables written by
+ * the LC-3 assembler (lc3as), whose entries are comment lines holding a name
+ * and a hex address:
+ *
+ *     //	FIB               3015
+ *
+ * Plain "NAME ADDRESS" lines are read the same way, and the address may
+ * also be written x3015. Lines that are not a name followed by an address
+ * (the table's headings) are skipped.
+ */
+
+static char (*names)[SYMBOL_NAME_MAX] = NULL;  // Name of each address ("" if none)
+
+/*
+ * Read a symbol file. When two symbols share an address the first is kept.
+ *
+ * path: Symbol file
+ * return: Number of symbols read, or -1 if the file cannot be read
+ */
+int loadSymbols(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    if (!names && !(names = calloc(MAX_MEMORY, sizeof(*names)))) {
+        fclose(file);
+        return -1;
+    }
+
+    int count = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        char *text = line + strspn(line, " \t");
+        if (strncmp(text, "//", 2) == 0) {
+            text += 2;
+        }
+
+        char name[SYMBOL_NAME_MAX];
+        char address[16];
+        if (sscanf(text, "%63s %15s", name, address) != 2 || !(isalpha((unsigned char)name[0]) || name[0] == '_')) {
+            continue;
+        }
+        const char *digits = address[0] == 'x' || address[0] == 'X' ? address + 1 : address;
+        char *end;
+        unsigned long value = strtoul(digits, &end, 16);
+        if (end == digits || *end || value >= MAX_MEMORY) {
+            continue;
+        }
+        if (!names[value][0]) {
+            strcpy(names[value], name);
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+/*
+ * Look up the symbol at an address.
+ *
+ * address: Guest address
+ * return: The name, or NULL if no symbol is at the address
+ */
+const char *symbolName(uint16_t address)
+{
+    return names && names[address][0] ? names[address] : NULL;
+}
+
+/*
+ * Name an address for a report: its symbol if it has one, otherwise xNNNN.
+ *
+ * address: Guest address
+ * buffer: Space for xNNNN (at least 6 bytes)
+ * return: The name
+ */
+const char *addressName(uint16_t address, char *buffer)
+{
+    const char *name = symbolName(address);
+    if (name) {
+        return name;
+    }
+    sprintf(buffer, "x%04X", address);
+    return buffer;
+}
@@ -0,0 +1,13 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include <stdint.h>
+
+#define SYMBOL_NAME_MAX 64  // Longest name kept, including the terminator
+
+// Function prototypes
+int loadSymbols(const char *path);
+const char *symbolName(uint16_t address);
+const char *addressName(uint16_t address, char *buffer);
+
+#endif
@@ -0,0 +1,215 @@
+#include <stdint.h>
+
+#include "decode.h"
+#include "engine.h"
+#include "startup.h"
+#include "virtualMachine.h"
+
+/*
+ * Fully decoded dispatch table. Every LC-3 instruction is a single 16-bit
+ * word, so every possible encoding can be decoded ahead of time: the table
+ * has one entry per encoding holding the specialized handler (register vs
+ * immediate forms, JSR vs JSRR, branches that are never/always taken) and
+ * all register numbers and sign-extended offsets already extracted. Dispatch
+ * is then table[memory[pc]] with no decoding at run time.
+ *
+ * The table is built once when the engine starts (65536 entries, 384 KB)
+ * rather than generated by the compiler, which trades one instruction cache
+ * handler per encoding for a data cache lookup per instruction.
+ */
+
+#pragma GCC diagnostic ignored "-Wpedantic"  // Labels as values
+
+/*
+ * Run the guest through the fully decoded dispatch table until it stops.
+ *
+ * return: void
+ */
+void runTableEngine()
+{
+    static void *const labels[T_COUNT] = {
+        &&brNever, &&brAlways, &&br, &&addReg, &&addImm, &&ld, &&st, &&jsr, &&jsrr,
+        &&andReg, &&andImm, &&ldr, &&str, &&rti, &&not, &&ldi, &&sti, &&jmp, &&res,
+        &&lea, &&trap
+    };
+
+    buildDecodeTable();
+
+    uint16_t *r = reg;
+    uint16_t *mem = memory;
+    uint16_t pc = r[R_PC];
+    uint16_t instruction;
+    const struct decodedInstruction *d;
+    uint16_t address;
+
+// Fetch the instruction at pc and jump to its specialized handler
+#define DISPATCH()                                  \
+    do {                                            \
+        instruction = fastRead(mem, pc++);          \
+        PROFILE_OPCODE(instruction >> 12);          \
+        opcodeCounts[instruction >> 12]++;          \
+        d = &decodeTable[instruction];              \
+        goto *labels[d->handler];                   \
+    } while (0)
+
+// Deliver a pending keyboard interrupt (and, under --lockstep, compare) at a
+// block boundary
+#define BLOCK_BOUNDARY()                                \
+    do {                                                \
+        if ((mem[MR_KBSR] & KB_IE) || boundaryChecks) { \
+            r[R_PC] = pc;                               \
+            checkInterrupts();                          \
+            pc = r[R_PC];                               \
+            if (!running) {                             \
+                return;                                 \
+            }                                           \
+        }                                               \
+    } while (0)
+
+// Store a value, only calling memWrite() for the device register page
+#define STORE(value)                    \
+    do {                                \
+        if (address < MR_KBSR) {        \
+            mem[address] = (value);     \
+        } else {                        \
+            r[R_PC] = pc;               \
+            memWrite(address, (value)); \
+            if (!running) {             \
+                return;                 \
+            }                           \
+        }                               \
+    } while (0)
+
+// Write a register and set the condition codes
+#define SET(destReg, value)                     \
+    do {                                        \
+        r[destReg] = (value);                   \
+        r[R_COND] = conditionFor(r[destReg]);   \
+    } while (0)
+
+    startupMark(STARTUP_ENGINE_READY);
+    DISPATCH();
+
+brNever:
+    BLOCK_BOUNDARY();
+    DISPATCH();
+
+br:
+    if (!(d->dest & r[R_COND])) {
+        BLOCK_BOUNDARY();
+        DISPATCH();
+    }
+    // Fall through: branch taken
+brAlways: {
+    uint16_t branchAddr = pc - 1;
+    pc += d->imm;
+    if (pc <= branchAddr) {
+        r[R_PC] = pc;
+        detectSpinLoop(branchAddr);  // Backward branch: possibly a polling loop
+    }
+    BLOCK_BOUNDARY();
+    DISPATCH();
+}
+
+addReg:
+    SET(d->dest, r[d->src1] + r[d->src2]);
+    DISPATCH();
+
+addImm:
+    SET(d->dest, r[d->src1] + d->imm);
+    DISPATCH();
+
+ld:
+    SET(d->dest, fastRead(mem, pc + d->imm));
+    DISPATCH();
+
+st:
+    address = pc + d->imm;
+    STORE(r[d->dest]);
+    DISPATCH();
+
+jsr:
+    r[R_R7] = pc;
+    pc += d->imm;
+    BLOCK_BOUNDARY();
+    DISPATCH();
+
+jsrr: {
+    uint16_t target = r[d->src1];
+    r[R_R7] = pc;
+    pc = target;
+    BLOCK_BOUNDARY();
+    DISPATCH();
+}
+
+andReg:
+    SET(d->dest, r[d->src1] & r[d->src2]);
+    DISPATCH();
+
+andImm:
+    SET(d->dest, r[d->src1] & d->imm);
+    DISPATCH();
+
+ldr:
+    SET(d->dest, fastRead(mem, r[d->src1] + d->imm));
+    DISPATCH();
+
+str:
+    address = r[d->src1] + d->imm;
+    STORE(r[d->dest]);
+    DISPATCH();
+
+rti:
+    r[R_PC] = pc;
+    returnFromInterrupt();
+    pc = r[R_PC];
+    if (!running) {
+        return;
+    }
+    BLOCK_BOUNDARY();
+    DISPATCH();
+
+not:
+    SET(d->dest, ~r[d->src1]);
+    DISPATCH();
+
+ldi:
+    address = fastRead(mem, pc + d->imm);
+    SET(d->dest, fastRead(mem, address));
+    DISPATCH();
+
+sti:
+    address = fastRead(mem, pc + d->imm);
+    STORE(r[d->dest]);
+    DISPATCH();
+
+jmp:
+    pc = r[d->src1];
+    BLOCK_BOUNDARY();
+    DISPATCH();
+
+res:
+    r[R_PC] = pc;
+    raiseException(INT_ILLEGAL_OP);
+    pc = r[R_PC];
+    DISPATCH();
+
+lea:
+    SET(d->dest, pc + d->imm);
+    DISPATCH();
+
+trap:
+    r[R_PC] = pc;
+    executeTrapCode(instruction);
+    pc = r[R_PC];
+    if (!running) {
+        return;
+    }
+    BLOCK_BOUNDARY();
+    DISPATCH();
+
+#undef DISPATCH
+#undef BLOCK_BOUNDARY
+#undef STORE
+#undef SET
+}
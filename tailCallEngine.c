@@ -0,0 +1,241 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "engine.h"
+#include "startup.h"
+#include "virtualMachine.h"
+
+/*
+ * Tail-call threaded engine. Every handler executes its instruction, fetches
+ * the next one and tail-calls the next handler through a 16-entry table, so
+ * there is no central dispatch loop. The register file, memory and PC are
+ * passed as arguments, which keeps them in argument registers for the whole
+ * run. reg[R_PC] is only written back before calling code outside the engine
+ * (device registers, traps, interrupts) and when the machine stops.
+ *
+ * Guaranteed tail calls need musttail (clang, GCC 15+). Older compilers turn
+ * these calls into jumps at -O2 (sibling call optimization), but without
+ * optimization every instruction would grow the host stack, so the engine is
+ * disabled in that case. Handlers return int only so that the tail calls are
+ * valid ISO C; the value (0 once the machine stops) is not used.
+ */
+
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+
+#if defined(MUSTTAIL) || defined(__OPTIMIZE__)
+#define TAILCALL_SUPPORTED 1
+#else
+#define TAILCALL_SUPPORTED 0
+#endif
+
+#ifndef MUSTTAIL
+#define MUSTTAIL
+#endif
+
+typedef int tailHandler(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction);
+
+static tailHandler *const handlers[OP_COUNT];
+
+// Fetch the instruction at pc and tail-call its handler
+#define DISPATCH(r, mem, pc)                                                      \
+    do {                                                                          \
+        uint16_t nextInstruction = fastRead(mem, pc);                             \
+        uint16_t nextOpCode = nextInstruction >> 12;                              \
+        PROFILE_OPCODE(nextOpCode);                                               \
+        opcodeCounts[nextOpCode]++;                                               \
+        MUSTTAIL return handlers[nextOpCode](r, mem, pc + 1, nextInstruction);    \
+    } while (0)
+
+// Deliver a pending keyboard interrupt (and, under --lockstep, compare) at a
+// block boundary
+#define BLOCK_BOUNDARY(r, mem, pc)                      \
+    do {                                                \
+        if ((mem[MR_KBSR] & KB_IE) || boundaryChecks) { \
+            r[R_PC] = pc;                               \
+            checkInterrupts();                          \
+            pc = r[R_PC];                               \
+            if (!running) {                             \
+                return 0;                               \
+            }                                           \
+        }                                               \
+    } while (0)
+
+// Store a value, only calling memWrite() for the device register page
+#define STORE(r, mem, pc, address, value)   \
+    do {                                    \
+        uint16_t storeAddr = (address);     \
+        if (storeAddr < MR_KBSR) {          \
+            mem[storeAddr] = (value);       \
+        } else {                            \
+            r[R_PC] = pc;                   \
+            memWrite(storeAddr, (value));   \
+            if (!running) {                 \
+                return 0;                   \
+            }                               \
+        }                                   \
+    } while (0)
+
+static int tcBranch(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    if (((instruction >> 9) & 0x7) & r[R_COND]) {
+        uint16_t branchAddr = pc - 1;
+        pc += signExtend(instruction & 0x1FF, 9);
+        if (pc <= branchAddr) {
+            r[R_PC] = pc;
+            detectSpinLoop(branchAddr);  // Backward branch: possibly a polling loop
+        }
+    }
+    BLOCK_BOUNDARY(r, mem, pc);
+    DISPATCH(r, mem, pc);
+}
+
+static int tcAdd(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    execAdd(r, instruction);
+    DISPATCH(r, mem, pc);
+}
+
+static int tcLoad(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    setRegister(r, instruction, fastRead(mem, pc + signExtend(instruction & 0x1FF, 9)));
+    DISPATCH(r, mem, pc);
+}
+
+static int tcStore(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    STORE(r, mem, pc, pc + signExtend(instruction & 0x1FF, 9), r[(instruction >> 9) & 0x7]);
+    DISPATCH(r, mem, pc);
+}
+
+static int tcJumpToSubroutine(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    uint16_t r7 = pc;
+    if (instruction & 0x800) {
+        pc += signExtend(instruction & 0x7FF, 11);
+    } else {
+        pc = r[(instruction >> 6) & 0x7];
+    }
+    r[R_R7] = r7;
+    BLOCK_BOUNDARY(r, mem, pc);
+    DISPATCH(r, mem, pc);
+}
+
+static int tcBitwiseAnd(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    execAnd(r, instruction);
+    DISPATCH(r, mem, pc);
+}
+
+static int tcLoadBaseOffset(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    uint16_t address = r[(instruction >> 6) & 0x7] + signExtend(instruction & 0x3F, 6);
+    setRegister(r, instruction, fastRead(mem, address));
+    DISPATCH(r, mem, pc);
+}
+
+static int tcStoreBaseOffset(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    uint16_t address = r[(instruction >> 6) & 0x7] + signExtend(instruction & 0x3F, 6);
+    STORE(r, mem, pc, address, r[(instruction >> 9) & 0x7]);
+    DISPATCH(r, mem, pc);
+}
+
+static int tcReturnFromInterrupt(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    (void)instruction;
+    r[R_PC] = pc;
+    returnFromInterrupt();
+    pc = r[R_PC];
+    if (!running) {
+        return 0;
+    }
+    BLOCK_BOUNDARY(r, mem, pc);
+    DISPATCH(r, mem, pc);
+}
+
+static int tcBitwiseNot(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    execNot(r, instruction);
+    DISPATCH(r, mem, pc);
+}
+
+static int tcLoadIndirect(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    uint16_t pointer = fastRead(mem, pc + signExtend(instruction & 0x1FF, 9));
+    setRegister(r, instruction, fastRead(mem, pointer));
+    DISPATCH(r, mem, pc);
+}
+
+static int tcStoreIndirect(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    uint16_t pointer = fastRead(mem, pc + signExtend(instruction & 0x1FF, 9));
+    STORE(r, mem, pc, pointer, r[(instruction >> 9) & 0x7]);
+    DISPATCH(r, mem, pc);
+}
+
+static int tcJump(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    pc = r[(instruction >> 6) & 0x7];
+    BLOCK_BOUNDARY(r, mem, pc);
+    DISPATCH(r, mem, pc);
+}
+
+static int tcReserved(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    (void)instruction;
+    r[R_PC] = pc;
+    raiseException(INT_ILLEGAL_OP);
+    pc = r[R_PC];
+    DISPATCH(r, mem, pc);
+}
+
+static int tcLoadEffectiveAddr(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    setRegister(r, instruction, pc + signExtend(instruction & 0x1FF, 9));
+    DISPATCH(r, mem, pc);
+}
+
+static int tcExecuteTrapCode(uint16_t *r, uint16_t *mem, uint16_t pc, uint16_t instruction)
+{
+    r[R_PC] = pc;
+    executeTrapCode(instruction);
+    pc = r[R_PC];
+    if (!running) {
+        return 0;
+    }
+    BLOCK_BOUNDARY(r, mem, pc);
+    DISPATCH(r, mem, pc);
+}
+
+static tailHandler *const handlers[OP_COUNT] = {
+    tcBranch, tcAdd, tcLoad, tcStore, tcJumpToSubroutine, tcBitwiseAnd,
+    tcLoadBaseOffset, tcStoreBaseOffset, tcReturnFromInterrupt, tcBitwiseNot,
+    tcLoadIndirect, tcStoreIndirect, tcJump, tcReserved, tcLoadEffectiveAddr,
+    tcExecuteTrapCode
+};
+
+/*
+ * Run the guest with the tail-call threaded engine until it stops. Falls back
+ * to the switch engine when guaranteed tail calls are not available.
+ *
+ * return: void
+ */
+void runTailCallEngine()
+{
+    if (!TAILCALL_SUPPORTED) {
+        fprintf(stderr, "tailcall engine needs musttail or an optimized build, using switch\n");
+        runSwitchEngine();
+        return;
+    }
+
+    startupMark(STARTUP_ENGINE_READY);
+    uint16_t pc = reg[R_PC];
+    uint16_t instruction = fastRead(memory, pc);
+    PROFILE_OPCODE(instruction >> 12);
+    opcodeCounts[instruction >> 12]++;
+    handlers[instruction >> 12](reg, memory, pc + 1, instruction);
+}
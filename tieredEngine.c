@@ -0,0 +1,1240 @@
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "aot.h"
+#include "codeCache.h"
+#include "codeProtection.h"
+#include "decode.h"
+#include "engine.h"
+#include "startup.h"
+#include "virtualMachine.h"
+
+/*
+ * Tiered engine. Everything starts in the reference interpreter (tier 0),
+ * which counts how often each block is entered; block entries include the
+ * targets of backward branches, so loop bodies get hot first. Once a block
+ * has been entered tierThreshold times it is queued for promotion. A
+ * background compile thread decodes the block into a tier 1 block (the
+ * pre-decoded form the table engine uses, ending at the first control-flow
+ * instruction) and hands it back through a lock-free queue. The interpreter
+ * installs finished blocks at block boundaries, so it never waits for the
+ * compile thread.
+ *
+ * The compile thread reads guest memory while the guest runs, so a block is
+ * checked against memory again when it is installed and discarded if the
+ * guest changed it meanwhile. Installed blocks are dropped when the guest
+ * stores into them: tier 1 blocks and traces check their own stores, and
+ * the pages they were built from are write-protected so the interpreter's
+ * stores are caught without a check (codeProtection.c).
+ *
+ * Blocks are chained: the first time a block leaves through a statically
+ * known exit (fall-through, BR target, JSR target) and the dispatcher finds
+ * a block at the other end, the exit is linked to it, and from then on the
+ * block goes straight on to its successor without a trip through the
+ * dispatcher. Every block keeps a list of the blocks linked to it so the
+ * links can be cut when it is dropped. Returns are chained too, through a
+ * shadow stack of the return addresses of the calls made in tier 1: a RET
+ * that goes back to the address on top of the stack continues with the block
+ * there. A RET anywhere else (the guest changed R7, or an interrupt came in)
+ * empties the stack and goes through the dispatcher.
+ *
+ * Loops get a third tier. A loop header (the target of a taken backward
+ * branch) that is reached traceThreshold times is traced: the interpreter
+ * records the path one iteration takes, through any number of blocks, until
+ * it is back at the header. The compile thread turns the trace into a C
+ * function with the guest registers in locals and the whole iteration as one
+ * native loop, and builds it with the host compiler like the aot engine
+ * does. Every branch on the trace becomes a guard on the condition codes
+ * (and every JMP/JSRR a guard on the target register) that leaves the trace
+ * when the guest goes a different way than it did while recording.
+ *
+ * Blocks and traces live in the code cache (codeCache.c), which holds them
+ * to a byte budget and finds the ones to drop when the guest stores into a
+ * page of code.
+ */
+
+#define TIER_MAX_BLOCK 64        // Longest block that is promoted (instructions)
+#define TIER_QUEUE_SIZE 1024     // Capacity of the promotion queues (power of two)
+#define TIER_SAMPLE_US 1000      // Tier sampling interval with --bench
+#define TIER_COUNT 3             // Interpreter, decoded blocks, compiled traces
+#define TRACE_MAX_LENGTH 128     // Longest trace that is recorded (instructions)
+#define TRACE_TAG 0x7ACE         // Keeps trace hashes apart from whole-image hashes
+#define RETURN_STACK_SIZE 64     // Shadow return stack entries (power of two)
+#define INSTRUCTION_RET 0xC1C0   // JMP R7
+
+// Exits of a tier 1 block that can be chained
+enum {
+    CHAIN_NONE = -1,  // Computed target (JMP, JSRR, RTI) or the block was left early
+    CHAIN_TAKEN,      // Branch or JSR target
+    CHAIN_NEXT,       // Fall-through
+    CHAIN_SLOTS
+};
+
+int tierThreshold = 50;    // --tier-threshold
+int chainingEnabled = 1;   // --no-chaining
+int traceThreshold = 200;  // --trace-threshold, 0 disables tracing
+
+// Start of every block and trace, so the code cache can tell them apart
+struct translation {
+    struct cacheEntry cache;
+    int isTrace;
+};
+
+struct tierBlock {
+    struct translation header;
+    uint16_t start;
+    uint16_t length;
+    uint64_t requestTime;  // When promotion was requested (ns), for tier-up latency
+    uint16_t words[TIER_MAX_BLOCK];  // Instruction words the block was built from
+    struct decodedInstruction ops[TIER_MAX_BLOCK];
+    uint16_t targets[CHAIN_SLOTS];   // Where each exit goes
+    struct tierBlock *links[CHAIN_SLOTS];
+    struct chainLink *predecessors;  // Exits of other blocks linked to this one
+};
+
+struct chainLink {
+    struct tierBlock *from;
+    int slot;
+    struct chainLink *next;
+};
+
+struct tierTrace {
+    struct translation header;
+    uint16_t start;   // Loop header
+    uint16_t length;
+    uint64_t requestTime;
+    uint16_t addresses[TRACE_MAX_LENGTH];
+    uint16_t words[TRACE_MAX_LENGTH];
+    uint16_t successors[TRACE_MAX_LENGTH];  // Address each instruction went on to while recording
+    struct aotObject object;
+};
+
+// Work for the compile thread: a block to decode, or a recorded trace
+struct promotionRequest {
+    uint16_t start;
+    uint64_t requestTime;
+    struct tierTrace *trace;
+};
+
+struct promotionResult {
+    struct tierBlock *block;
+    struct tierTrace *trace;
+};
+
+static struct tierBlock *blockCache[MAX_MEMORY];  // Installed block starting at each address
+static uint16_t hotness[MAX_MEMORY];              // Tier 0 entries of each block
+static uint8_t promotionPending[MAX_MEMORY];
+
+static struct tierTrace *traceCache[MAX_MEMORY];  // Installed trace for each loop header
+static struct tierTrace *recording = NULL;         // Trace being recorded
+static uint32_t loopHotness[MAX_MEMORY];           // Taken backward branches to each address
+static uint8_t traceFailures[MAX_MEMORY];
+static uint8_t tracePending[MAX_MEMORY];
+static int32_t traceCandidate = -1;                // Loop header to record from when next reached
+static struct aotHost traceHost;
+static struct tierTrace *runningTrace = NULL;      // Trace whose native code is on the stack
+static struct tierBlock *exitBlock = NULL;         // Last block run, if the dispatcher may link it
+static int exitSlot = CHAIN_NONE;                  // Exit it left through
+static uint16_t returnStack[RETURN_STACK_SIZE];
+static unsigned returnTop = 0;
+
+// Promotion requests (interpreter -> compile thread), one queue for blocks
+// and one for traces. Blocks take microseconds and traces a run of the host
+// compiler, so blocks go first. Requests are rare, so a lock is fine here.
+static pthread_mutex_t requestLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t requestReady = PTHREAD_COND_INITIALIZER;
+static struct promotionRequest requests[2][TIER_QUEUE_SIZE];
+static uint32_t requestHead[2];
+static uint32_t requestTail[2];
+static int compileStop = 0;
+
+// Finished work (compile thread -> interpreter), lock-free so the check at
+// every block boundary is a single atomic load.
+static struct promotionResult completed[TIER_QUEUE_SIZE];
+static _Atomic uint32_t completedHead = 0;
+static _Atomic uint32_t completedTail = 0;
+
+// Statistics reported with --bench
+static volatile int currentTier = 0;
+static volatile uint64_t tierSamples[TIER_COUNT];
+static uint64_t tierInstructions[TIER_COUNT];
+static uint64_t blocksPromoted = 0;
+static uint64_t blocksStale = 0;
+static uint64_t blocksInvalidated = 0;
+static uint64_t tierUpLatencyTotal = 0;
+static uint64_t tierUpLatencyMax = 0;
+static uint64_t blockRuns = 0;
+static uint64_t chainedRuns = 0;
+static uint64_t chainsLinked = 0;
+static uint64_t chainsUnlinked = 0;
+static uint64_t returnsPredicted = 0;
+static uint64_t returnsMispredicted = 0;
+static uint64_t invalidations = 0;  // Bumped whenever blocks may have been freed
+static uint64_t useClock = 0;       // Ticks whenever a block or trace runs, for LRU eviction
+static uint64_t tracesInstalled = 0;
+static uint64_t tracesCached = 0;
+static uint64_t tracesAborted = 0;
+static uint64_t tracesFailed = 0;
+static uint64_t tracesStale = 0;
+static uint64_t tracesInvalidated = 0;
+static uint64_t traceRuns = 0;
+static uint64_t traceLatencyTotal = 0;
+static double traceCompileSeconds = 0;
+
+/*
+ * Current monotonic time in nanoseconds.
+ *
+ * return: Time in ns
+ */
+static uint64_t nowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Decode the block starting at an address. Runs on the compile thread, so
+ * memory is read with relaxed atomic loads.
+ *
+ * start: Address of the first instruction
+ * return: The new block, or NULL if there is nothing to promote
+ */
+static struct tierBlock *compileBlock(uint16_t start)
+{
+    struct tierBlock *block = malloc(sizeof(*block));
+    if (!block) {
+        return NULL;
+    }
+
+    block->start = start;
+    block->length = 0;
+    uint16_t address = start;
+    while (block->length < TIER_MAX_BLOCK && address < MR_KBSR) {
+        uint16_t instruction = __atomic_load_n(&memory[address], __ATOMIC_RELAXED);
+        block->words[block->length] = instruction;
+        block->ops[block->length] = decodeInstruction(instruction);
+        block->length++;
+        address++;
+        if (isControlFlow(instruction >> 12)) {
+            break;
+        }
+    }
+
+    if (!block->length) {
+        free(block);
+        return NULL;
+    }
+
+    uint16_t last = block->words[block->length - 1];
+    block->targets[CHAIN_TAKEN] = address;
+    block->targets[CHAIN_NEXT] = address;
+    if ((last >> 12) == OP_BR) {
+        block->targets[CHAIN_TAKEN] = address + signExtend(last & 0x1FF, 9);
+    } else if ((last >> 12) == OP_JSR && (last & 0x800)) {
+        block->targets[CHAIN_TAKEN] = address + signExtend(last & 0x7FF, 11);
+    }
+    block->links[CHAIN_TAKEN] = NULL;
+    block->links[CHAIN_NEXT] = NULL;
+    block->predecessors = NULL;
+    return block;
+}
+
+/*
+ * Emit code that takes back the retired-instruction counts of trace
+ * instructions that will not run after all.
+ *
+ * out: Generated source
+ * trace: The trace
+ * from: First instruction that will not run
+ * end: End of its segment (exclusive)
+ * return: void
+ */
+static void emitTraceUncount(FILE *out, const struct tierTrace *trace, int from, int end)
+{
+    for (int i = from; i < end; i++) {
+        fprintf(out, "n[%d]--; ", trace->words[i] >> 12);
+    }
+}
+
+/*
+ * Emit the C code for one trace instruction. Control flow that goes the way
+ * it went while recording stays on the trace; anything else leaves it.
+ *
+ * out: Generated source
+ * trace: The trace
+ * i: Index of the instruction
+ * end: End of its segment (exclusive)
+ * return: void
+ */
+static void emitTraceInstruction(FILE *out, const struct tierTrace *trace, int i, int end)
+{
+    uint16_t address = trace->addresses[i];
+    uint16_t instruction = trace->words[i];
+    uint16_t successor = trace->successors[i];
+    uint16_t next = address + 1;
+    uint16_t destReg = (instruction >> 9) & 0x7;
+    uint16_t srcReg1 = (instruction >> 6) & 0x7;
+
+    fprintf(out, "    /* %04X: %04X */\n", address, instruction);
+    if (aotEmitDataOperation(out, address, instruction)) {
+        return;
+    }
+
+    switch (instruction >> 12) {
+        case OP_BR: {
+            uint16_t mask = destReg;
+            uint16_t target = next + signExtend(instruction & 0x1FF, 9);
+            int spinCheck = (uint16_t)(address - target) < SPIN_MAX_BODY;
+            if (mask && target != next && successor == target) {
+                fprintf(out, "    if (!(cond & %d)) { BOUNDARY(0x%04X); EXIT(0x%04X, %d); }\n", mask, next, next,
+                        AOT_EXIT_DISPATCH);
+            } else if (mask && target != next) {
+                fprintf(out, "    if (cond & %d) {", mask);
+                if (spinCheck) {
+                    fprintf(out, " SYNC(0x%04X); host->detectSpinLoop(0x%04X);", target, address);
+                }
+                fprintf(out, " BOUNDARY(0x%04X); EXIT(0x%04X, %d); }\n", target, target, AOT_EXIT_DISPATCH);
+            }
+            if (successor == target && spinCheck) {
+                fprintf(out, "    SYNC(0x%04X); host->detectSpinLoop(0x%04X);\n", target, address);
+            }
+            fprintf(out, "    BOUNDARY(0x%04X);\n", successor);
+            break;
+        }
+        case OP_ST:
+        case OP_STR:
+        case OP_STI:
+            if ((instruction >> 12) == OP_ST) {
+                fprintf(out, "    { uint16_t a = 0x%04X;\n", (uint16_t)(next + signExtend(instruction & 0x1FF, 9)));
+            } else if ((instruction >> 12) == OP_STR) {
+                fprintf(out, "    { uint16_t a = r%d + 0x%04X;\n", srcReg1, signExtend(instruction & 0x3F, 6));
+            } else {
+                fprintf(out, "    { uint16_t a = RD(0x%04X);\n", (uint16_t)(next + signExtend(instruction & 0x1FF, 9)));
+            }
+            // Leave before storing into code: the store may free the trace
+            fprintf(out, "    if (a < 0x%04X) { if (code[a]) { ", MR_KBSR);
+            emitTraceUncount(out, trace, i + 1, end);
+            fprintf(out, "host->smcAddress = a; host->smcValue = r%d; EXIT(0x%04X, %d); } mem[a] = r%d; }\n",
+                    destReg, next, AOT_EXIT_SMC, destReg);
+            fprintf(out, "    else { SYNC(0x%04X); host->memWrite(a, r%d); RELOAD(); if (!*host->running) { ", next,
+                    destReg);
+            emitTraceUncount(out, trace, i + 1, end);
+            fprintf(out, "return %d; } }\n    }\n", AOT_EXIT_HALT);
+            break;
+        case OP_JSR:
+            if (instruction & 0x800) {
+                fprintf(out, "    r7 = 0x%04X;\n", next);
+            } else {
+                fprintf(out, "    pc = r%d; r7 = 0x%04X;\n", srcReg1, next);
+                fprintf(out, "    if (pc != 0x%04X) { BOUNDARY(pc); EXIT(pc, %d); }\n", successor, AOT_EXIT_DISPATCH);
+            }
+            fprintf(out, "    BOUNDARY(0x%04X);\n", successor);
+            break;
+        case OP_JMP:
+            fprintf(out, "    pc = r%d;\n", srcReg1);
+            fprintf(out, "    if (pc != 0x%04X) { BOUNDARY(pc); EXIT(pc, %d); }\n", successor, AOT_EXIT_DISPATCH);
+            fprintf(out, "    BOUNDARY(0x%04X);\n", successor);
+            break;
+        case OP_TRAP:
+            fprintf(out, "    SYNC(0x%04X); host->executeTrapCode(0x%04X); RELOAD();\n", next, instruction);
+            fprintf(out, "    if (!*host->running) return %d;\n", AOT_EXIT_HALT);
+            fprintf(out, "    BOUNDARY(0x%04X);\n", next);
+            break;
+        default:  // RTI and RES end a recording, so never appear here
+            break;
+    }
+}
+
+/*
+ * Write a trace as a C translation unit: one loop over the recorded
+ * iteration. Retired instructions are counted a segment (up to the next
+ * control-flow instruction) at a time.
+ *
+ * out: Where to write the source
+ * context: The trace
+ * return: void
+ */
+static void generateTrace(FILE *out, const void *context)
+{
+    const struct tierTrace *trace = context;
+
+    aotEmitPrelude(out);
+    fprintf(out, "\nloop:\n");
+    for (int start = 0; start < trace->length;) {
+        int end = start;
+        int opCounts[OP_COUNT] = {0};
+        while (end < trace->length) {
+            opCounts[trace->words[end] >> 12]++;
+            if (isControlFlow(trace->words[end++] >> 12)) {
+                break;
+            }
+        }
+        for (int op = 0; op < OP_COUNT; op++) {
+            if (opCounts[op]) {
+                fprintf(out, "    n[%d] += %d;\n", op, opCounts[op]);
+            }
+        }
+        for (int i = start; i < end; i++) {
+            emitTraceInstruction(out, trace, i, end);
+        }
+        start = end;
+    }
+    fprintf(out, "    goto loop;\n\ndispatch:\n    EXIT(pc, %d);\n}\n", AOT_EXIT_DISPATCH);
+}
+
+/*
+ * Compile a recorded trace. Runs on the compile thread. On failure the
+ * trace comes back without an entry point.
+ *
+ * trace: The trace
+ * return: void
+ */
+static void compileTrace(struct tierTrace *trace)
+{
+    uint64_t hash = aotHashWord(AOT_HASH_SEED, AOT_VERSION);
+    hash = aotHashWord(hash, TRACE_TAG);
+    for (int i = 0; i < trace->length; i++) {
+        hash = aotHashWord(hash, trace->addresses[i]);
+        hash = aotHashWord(hash, trace->words[i]);
+        hash = aotHashWord(hash, trace->successors[i]);
+    }
+    if (aotBuild(hash, generateTrace, trace, &trace->object) != 0) {
+        trace->object.entry = NULL;
+    }
+}
+
+/*
+ * Body of the compile thread: take promotion requests, build the blocks and
+ * pass them back to the interpreter.
+ *
+ * arg: Unused
+ * return: NULL
+ */
+static void *compileThread(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&requestLock);
+        while (requestHead[0] == requestTail[0] && requestHead[1] == requestTail[1] && !compileStop) {
+            pthread_cond_wait(&requestReady, &requestLock);
+        }
+        if (compileStop) {
+            pthread_mutex_unlock(&requestLock);
+            return NULL;
+        }
+        int queue = requestHead[0] == requestTail[0];
+        struct promotionRequest request = requests[queue][requestTail[queue]++ & (TIER_QUEUE_SIZE - 1)];
+        pthread_mutex_unlock(&requestLock);
+
+        struct promotionResult result = {NULL, request.trace};
+        if (request.trace) {
+            compileTrace(request.trace);
+        } else {
+            result.block = compileBlock(request.start);
+            if (!result.block) {
+                continue;
+            }
+            result.block->requestTime = request.requestTime;
+        }
+
+        uint32_t head = atomic_load_explicit(&completedHead, memory_order_relaxed);
+        while (head - atomic_load_explicit(&completedTail, memory_order_acquire) == TIER_QUEUE_SIZE) {
+            struct timespec pause = {0, 1000000};  // Interpreter is behind, 1 ms
+            nanosleep(&pause, NULL);
+        }
+        completed[head & (TIER_QUEUE_SIZE - 1)] = result;
+        atomic_store_explicit(&completedHead, head + 1, memory_order_release);
+    }
+}
+
+/*
+ * Queue a hot block, or a recorded trace, for the compile thread.
+ *
+ * start: Address of the block or loop header
+ * trace: The trace, or NULL to promote a block
+ * return: 0 if queued, -1 if the queue is full
+ */
+static int requestPromotion(uint16_t start, struct tierTrace *trace)
+{
+    int status = -1;
+    int queue = trace != NULL;
+    pthread_mutex_lock(&requestLock);
+    if (requestHead[queue] - requestTail[queue] < TIER_QUEUE_SIZE) {
+        uint64_t now = nowNs();
+        requests[queue][requestHead[queue]++ & (TIER_QUEUE_SIZE - 1)] = (struct promotionRequest){start, now, trace};
+        if (trace) {
+            trace->requestTime = now;
+        }
+        pthread_cond_signal(&requestReady);
+        status = 0;
+    }
+    pthread_mutex_unlock(&requestLock);
+    return status;
+}
+
+/*
+ * Link an exit of one block to another block.
+ *
+ * from: Block whose exit is linked
+ * slot: The exit
+ * to: Block the exit leads to
+ * return: void
+ */
+static void linkBlocks(struct tierBlock *from, int slot, struct tierBlock *to)
+{
+    struct chainLink *link = malloc(sizeof(*link));
+    if (!link) {
+        return;
+    }
+    *link = (struct chainLink){from, slot, to->predecessors};
+    to->predecessors = link;
+    from->links[slot] = to;
+    chainsLinked++;
+}
+
+/*
+ * Cut every link into a block, so it is only reached through the dispatcher.
+ *
+ * block: The block
+ * return: void
+ */
+static void unlinkPredecessors(struct tierBlock *block)
+{
+    while (block->predecessors) {
+        struct chainLink *link = block->predecessors;
+        link->from->links[link->slot] = NULL;
+        block->predecessors = link->next;
+        free(link);
+        chainsUnlinked++;
+    }
+}
+
+/*
+ * Remove an installed block.
+ *
+ * block: The block to remove
+ * return: void
+ */
+static void uninstallBlock(struct tierBlock *block)
+{
+    unlinkPredecessors(block);
+    for (int slot = 0; slot < CHAIN_SLOTS; slot++) {
+        struct tierBlock *successor = block->links[slot];
+        if (successor) {
+            for (struct chainLink **link = &successor->predecessors; *link; link = &(*link)->next) {
+                if ((*link)->from == block && (*link)->slot == slot) {
+                    struct chainLink *dead = *link;
+                    *link = dead->next;
+                    free(dead);
+                    break;
+                }
+            }
+        }
+    }
+
+    cacheRemove(&block->header.cache);
+    blockCache[block->start] = NULL;
+    hotness[block->start] = 0;
+    uint16_t addresses[TIER_MAX_BLOCK];
+    for (int i = 0; i < block->length; i++) {
+        addresses[i] = block->start + i;
+    }
+    unprotectCode(addresses, block->length);
+    free(block);
+}
+
+/*
+ * Remove an installed trace.
+ *
+ * trace: The trace to remove
+ * return: void
+ */
+static void uninstallTrace(struct tierTrace *trace)
+{
+    cacheRemove(&trace->header.cache);
+    traceCache[trace->start] = NULL;
+    unprotectCode(trace->addresses, trace->length);
+    if (trace == runningTrace) {
+        traceHost.abandoned = 1;  // runTrace() frees it once it has returned
+        return;
+    }
+    dlclose(trace->object.library);
+    free(trace);
+}
+
+/*
+ * Whether a block or trace was built from an address.
+ *
+ * entry: The block's or trace's cache header
+ * address: The address
+ * return: 1 if it was, 0 otherwise
+ */
+static int coversAddress(const struct cacheEntry *entry, uint16_t address)
+{
+    if (((const struct translation *)entry)->isTrace) {
+        const struct tierTrace *trace = (const struct tierTrace *)entry;
+        for (int i = 0; i < trace->length; i++) {
+            if (trace->addresses[i] == address) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    const struct tierBlock *block = (const struct tierBlock *)entry;
+    return (uint16_t)(address - block->start) < block->length;
+}
+
+/*
+ * Remove an installed block or trace. Passed to the code cache, which calls
+ * it to evict translations.
+ *
+ * entry: The block's or trace's cache header
+ * return: void
+ */
+static void dropTranslation(struct cacheEntry *entry)
+{
+    invalidations++;
+    if (((struct translation *)entry)->isTrace) {
+        uninstallTrace((struct tierTrace *)entry);
+        return;
+    }
+    struct tierBlock *block = (struct tierBlock *)entry;
+    if (exitBlock == block) {
+        exitBlock = NULL;
+    }
+    uninstallBlock(block);
+}
+
+/*
+ * Remove a block or trace the guest stored into.
+ *
+ * entry: The block's or trace's cache header
+ * return: void
+ */
+static void invalidateTranslation(struct cacheEntry *entry)
+{
+    if (((struct translation *)entry)->isTrace) {
+        tracesInvalidated++;
+    } else {
+        blocksInvalidated++;
+    }
+    dropTranslation(entry);
+}
+
+/*
+ * Drop every installed block and trace that contains an address. Called by
+ * memWrite() when the guest stores into translated code.
+ *
+ * address: The address that was written
+ * return: void
+ */
+static void invalidateBlocks(uint16_t address)
+{
+    invalidations++;
+    cacheInvalidate(address, coversAddress, invalidateTranslation);
+}
+
+/*
+ * Install a compiled trace, unless compiling failed or the guest changed the
+ * code it was recorded from.
+ *
+ * trace: The trace
+ * now: Current time (ns)
+ * return: void
+ */
+static void installTrace(struct tierTrace *trace, uint64_t now)
+{
+    tracePending[trace->start] = 0;
+    if (!trace->object.entry) {
+        traceFailures[trace->start] = TRACE_MAX_FAILURES;  // No compiler: do not try again
+        tracesFailed++;
+        free(trace);
+        return;
+    }
+
+    for (int i = 0; i < trace->length; i++) {
+        if (memory[trace->addresses[i]] != trace->words[i]) {
+            tracesStale++;
+            dlclose(trace->object.library);
+            free(trace);
+            return;
+        }
+    }
+
+    trace->header.isTrace = 1;
+    if (cacheInsert(&trace->header.cache, trace->addresses, trace->length, sizeof(*trace) + trace->object.size,
+                    dropTranslation) != 0) {
+        traceFailures[trace->start] = TRACE_MAX_FAILURES;  // Larger than the whole budget
+        dlclose(trace->object.library);
+        free(trace);
+        return;
+    }
+    if (protectCode(trace->addresses, trace->length) != 0) {
+        traceFailures[trace->start] = TRACE_MAX_FAILURES;
+        cacheRemove(&trace->header.cache);
+        dlclose(trace->object.library);
+        free(trace);
+        return;
+    }
+    traceCache[trace->start] = trace;
+    if (blockCache[trace->start]) {
+        unlinkPredecessors(blockCache[trace->start]);  // Reach the loop through the dispatcher, and the trace
+    }
+    traceLatencyTotal += now - trace->requestTime;
+    traceCompileSeconds += trace->object.compileSeconds;
+    tracesCached += trace->object.cached;
+    tracesInstalled++;
+}
+
+/*
+ * Install the blocks and traces the compile thread has finished. A block
+ * whose source changed after it was read is thrown away and the address
+ * starts counting again.
+ *
+ * return: void
+ */
+static void installCompletedBlocks()
+{
+    uint32_t tail = atomic_load_explicit(&completedTail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&completedHead, memory_order_acquire);
+    if (head == tail) {
+        return;
+    }
+
+    uint64_t now = nowNs();
+    for (; tail != head; tail++) {
+        struct promotionResult result = completed[tail & (TIER_QUEUE_SIZE - 1)];
+        if (result.trace) {
+            installTrace(result.trace, now);
+            continue;
+        }
+
+        struct tierBlock *block = result.block;
+        promotionPending[block->start] = 0;
+        if (memcmp(block->words, &memory[block->start], block->length * sizeof(uint16_t)) != 0
+            || blockCache[block->start]) {
+            hotness[block->start] = 0;
+            blocksStale++;
+            free(block);
+            continue;
+        }
+
+        uint16_t addresses[TIER_MAX_BLOCK];
+        for (int i = 0; i < block->length; i++) {
+            addresses[i] = block->start + i;
+        }
+        block->header.isTrace = 0;
+        if (cacheInsert(&block->header.cache, addresses, block->length, sizeof(*block), dropTranslation) != 0) {
+            hotness[block->start] = 0;
+            free(block);
+            continue;
+        }
+        if (protectCode(addresses, block->length) != 0) {
+            cacheRemove(&block->header.cache);
+            hotness[block->start] = UINT16_MAX;  // Stays in the interpreter
+            free(block);
+            continue;
+        }
+
+        blockCache[block->start] = block;
+        uint64_t latency = now - block->requestTime;
+        tierUpLatencyTotal += latency;
+        tierUpLatencyMax = latency > tierUpLatencyMax ? latency : tierUpLatencyMax;
+        blocksPromoted++;
+    }
+    atomic_store_explicit(&completedTail, tail, memory_order_release);
+}
+
+/*
+ * Count a taken backward branch. A loop header that gets hot enough is
+ * traced the next time the interpreter reaches it; headers whose recordings
+ * keep failing need exponentially more trips before the next attempt.
+ *
+ * target: The branch target
+ * return: void
+ */
+static inline void countLoopHeader(uint16_t target)
+{
+    if (traceThreshold && target < MR_KBSR && !traceCache[target] && !tracePending[target]
+        && traceFailures[target] < TRACE_MAX_FAILURES
+        && ++loopHotness[target] >= (uint32_t)traceThreshold << traceFailures[target]) {
+        loopHotness[target] = 0;
+        traceCandidate = target;
+    }
+}
+
+/*
+ * Run a tier 1 block. Control flow only ever appears as the last instruction,
+ * which leaves the next PC in reg[R_PC]. A store into translated code ends
+ * the block right away, since the block itself may just have been freed.
+ *
+ * block: The block to run
+ * return: void
+ */
+static void executeBlock(const struct tierBlock *block)
+{
+    uint16_t *r = reg;
+    uint16_t *mem = writableMemory;
+    uint16_t pc = block->start;
+    uint16_t address;
+
+// Store a value; leave the block if it modified translated code or stopped
+// the machine
+#define STORE(value)                                \
+    do {                                            \
+        uint16_t storeValue = (value);              \
+        r[R_PC] = pc;                               \
+        if (address < MR_KBSR) {                    \
+            if (translatedCode[address]) {          \
+                invalidateCode(address);            \
+                mem[address] = storeValue;          \
+                tierInstructions[1] += i + 1;       \
+                return;                             \
+            }                                       \
+            mem[address] = storeValue;              \
+        } else {                                    \
+            memWrite(address, storeValue);          \
+            if (!running) {                         \
+                tierInstructions[1] += i + 1;       \
+                return;                             \
+            }                                       \
+        }                                           \
+    } while (0)
+
+#define SET(destReg, value)                     \
+    do {                                        \
+        r[destReg] = (value);                   \
+        r[R_COND] = conditionFor(r[destReg]);   \
+    } while (0)
+
+    int i;
+    for (i = 0; i < block->length; i++) {
+        const struct decodedInstruction *d = &block->ops[i];
+        uint16_t instruction = block->words[i];
+        pc++;
+        PROFILE_OPCODE(instruction >> 12);
+        opcodeCounts[instruction >> 12]++;
+
+        switch (d->handler) {
+            case T_BR_NEVER:
+                break;
+            case T_BR:
+                if (!(d->dest & r[R_COND])) {
+                    break;
+                }
+                // Branch taken
+                // fall through
+            case T_BR_ALWAYS: {
+                uint16_t branchAddr = pc - 1;
+                pc += d->imm;
+                if (pc <= branchAddr) {
+                    r[R_PC] = pc;
+                    detectSpinLoop(branchAddr);  // Backward branch: possibly a polling loop
+                    countLoopHeader(pc);
+                }
+                break;
+            }
+            case T_ADD_REG:
+                SET(d->dest, r[d->src1] + r[d->src2]);
+                break;
+            case T_ADD_IMM:
+                SET(d->dest, r[d->src1] + d->imm);
+                break;
+            case T_LD:
+                SET(d->dest, fastRead(mem, pc + d->imm));
+                break;
+            case T_ST:
+                address = pc + d->imm;
+                STORE(r[d->dest]);
+                break;
+            case T_JSR:
+                r[R_R7] = pc;
+                pc += d->imm;
+                break;
+            case T_JSRR: {
+                uint16_t target = r[d->src1];
+                r[R_R7] = pc;
+                pc = target;
+                break;
+            }
+            case T_AND_REG:
+                SET(d->dest, r[d->src1] & r[d->src2]);
+                break;
+            case T_AND_IMM:
+                SET(d->dest, r[d->src1] & d->imm);
+                break;
+            case T_LDR:
+                SET(d->dest, fastRead(mem, r[d->src1] + d->imm));
+                break;
+            case T_STR:
+                address = r[d->src1] + d->imm;
+                STORE(r[d->dest]);
+                break;
+            case T_RTI:
+                r[R_PC] = pc;
+                returnFromInterrupt();
+                pc = r[R_PC];
+                break;
+            case T_NOT:
+                SET(d->dest, ~r[d->src1]);
+                break;
+            case T_LDI:
+                address = fastRead(mem, pc + d->imm);
+                SET(d->dest, fastRead(mem, address));
+                break;
+            case T_STI:
+                address = fastRead(mem, pc + d->imm);
+                STORE(r[d->dest]);
+                break;
+            case T_JMP:
+                pc = r[d->src1];
+                break;
+            case T_RES:
+                r[R_PC] = pc;
+                raiseException(INT_ILLEGAL_OP);
+                tierInstructions[1] += i + 1;
+                return;  // Exceptions do not check for interrupts
+            case T_LEA:
+                SET(d->dest, pc + d->imm);
+                break;
+            case T_TRAP:
+                r[R_PC] = pc;
+                executeTrapCode(instruction);
+                pc = r[R_PC];
+                break;
+        }
+    }
+    tierInstructions[1] += i;
+    r[R_PC] = pc;
+
+    if (running && isControlFlow(block->words[block->length - 1] >> 12)) {
+        checkInterrupts();
+    }
+
+#undef STORE
+#undef SET
+}
+
+/*
+ * Run tier 1 blocks, going straight from block to block through chained
+ * exits. Control returns to the dispatcher at an exit that is not linked
+ * yet, when a block may have been freed, and when the dispatcher has other
+ * work: a loop to trace or finished blocks to install.
+ *
+ * block: The first block to run
+ * return: void
+ */
+static void runBlocks(struct tierBlock *block)
+{
+    currentTier = 1;
+    exitBlock = NULL;
+    for (;;) {
+        uint64_t epoch = invalidations;
+        block->header.cache.lastUsed = ++useClock;
+        executeBlock(block);
+        blockRuns++;
+        if (!running || invalidations != epoch) {
+            break;
+        }
+
+        uint16_t pc = reg[R_PC];
+        int slot = pc == block->targets[CHAIN_TAKEN] ? CHAIN_TAKEN
+                   : pc == block->targets[CHAIN_NEXT] ? CHAIN_NEXT
+                   : CHAIN_NONE;
+        struct tierBlock *next = slot == CHAIN_NONE ? NULL : block->links[slot];
+
+        uint16_t last = block->words[block->length - 1];
+        if (chainingEnabled && (last >> 12) == OP_JSR) {
+            returnStack[returnTop++ & (RETURN_STACK_SIZE - 1)] = block->targets[CHAIN_NEXT];
+        } else if (chainingEnabled && last == INSTRUCTION_RET) {
+            if (returnTop && returnStack[(returnTop - 1) & (RETURN_STACK_SIZE - 1)] == pc) {
+                returnTop--;
+                returnsPredicted++;
+                next = traceCache[pc] ? NULL : blockCache[pc];
+            } else {
+                returnsMispredicted++;
+                returnTop = 0;
+            }
+        }
+
+        if (!next || traceCandidate >= 0
+            || atomic_load_explicit(&completedHead, memory_order_relaxed)
+                   != atomic_load_explicit(&completedTail, memory_order_relaxed)) {
+            exitBlock = block;
+            exitSlot = slot;
+            break;
+        }
+        chainedRuns++;
+        block = next;
+    }
+    currentTier = 0;
+}
+
+/*
+ * Give up on the trace being recorded.
+ *
+ * return: void
+ */
+static void abortRecording()
+{
+    traceFailures[recording->start]++;
+    tracesAborted++;
+    free(recording);
+    recording = NULL;
+}
+
+/*
+ * Interpret one instruction and add it to the trace being recorded. The
+ * recording ends when the guest is back at the loop header, and is given up
+ * on when the trace gets too long, the guest halts, returns from an
+ * interrupt, or an interrupt or exception takes it somewhere the instruction
+ * itself would not have gone.
+ *
+ * return: Opcode of the instruction
+ */
+static uint16_t recordInstruction()
+{
+    struct tierTrace *trace = recording;
+    uint16_t address = reg[R_PC];
+    uint16_t instruction = memory[address];
+    uint16_t next = address + 1;
+    uint16_t opCode = instruction >> 12;
+
+    int traceable = address < MR_KBSR && opCode != OP_RTI && opCode != OP_RES
+                    && instruction != (OP_TRAP << 12 | TRAP_HALT);
+    uint16_t expected = next;      // Where the instruction goes by itself
+    uint16_t alternative = next;
+    if (opCode == OP_BR) {
+        alternative = next + signExtend(instruction & 0x1FF, 9);
+    } else if (opCode == OP_JSR) {
+        expected = instruction & 0x800 ? next + signExtend(instruction & 0x7FF, 11) : reg[(instruction >> 6) & 0x7];
+    } else if (opCode == OP_JMP) {
+        expected = reg[(instruction >> 6) & 0x7];
+    }
+
+    stepInstruction();
+
+    uint16_t successor = reg[R_PC];
+    if (!traceable || !running || (successor != expected && successor != alternative)) {
+        abortRecording();
+        return opCode;
+    }
+
+    trace->addresses[trace->length] = address;
+    trace->words[trace->length] = instruction;
+    trace->successors[trace->length] = successor;
+    trace->length++;
+
+    if (successor == trace->start) {
+        recording = NULL;
+        if (requestPromotion(trace->start, trace) == 0) {
+            tracePending[trace->start] = 1;
+        } else {
+            free(trace);
+        }
+    } else if (trace->length == TRACE_MAX_LENGTH) {
+        abortRecording();
+    }
+    return opCode;
+}
+
+/*
+ * Run a compiled trace until it leaves the loop. A trace can be dropped by a
+ * host callback while it runs: a keyboard interrupt taken at a boundary
+ * pushes the PSR and PC, and the stack may hold code the trace was built
+ * from. uninstallTrace() then only sets traceHost.abandoned, the trace leaves
+ * at that boundary, and it is freed here.
+ *
+ * trace: The trace
+ * return: void
+ */
+static void runTrace(struct tierTrace *trace)
+{
+    uint64_t before = retiredInstructions();
+
+    trace->header.cache.lastUsed = ++useClock;
+    currentTier = 2;
+    runningTrace = trace;
+    traceHost.abandoned = 0;
+    int status = trace->object.entry(&traceHost);
+    runningTrace = NULL;
+    currentTier = 0;
+    traceRuns++;
+    if (traceHost.abandoned) {
+        dlclose(trace->object.library);  // Dropped while it ran: only now is it safe to unmap
+        free(trace);
+    }
+
+    tierInstructions[2] += retiredInstructions() - before;
+
+    if (status == AOT_EXIT_SMC) {
+        invalidateBlocks(traceHost.smcAddress);  // Frees the trace if it wrote into itself
+        writableMemory[traceHost.smcAddress] = traceHost.smcValue;
+    }
+}
+
+/*
+ * Count a sample for the tier that is running.
+ *
+ * signal: The signal that was received
+ * return: void
+ */
+static void sampleTier(int signal)
+{
+    (void)signal;
+    tierSamples[currentTier]++;
+}
+
+/*
+ * Print tier-up and per-tier statistics.
+ *
+ * return: void
+ */
+static void printTierStats()
+{
+    uint64_t total = 0;
+    uint64_t samples = 0;
+    for (int tier = 0; tier < TIER_COUNT; tier++) {
+        total += tierInstructions[tier];
+        samples += tierSamples[tier];
+    }
+    fprintf(stderr, "\ntiered: %llu blocks promoted, %llu stale at install, %llu invalidated; "
+            "tier-up latency mean %.1f us, max %.1f us\n",
+            (unsigned long long)blocksPromoted, (unsigned long long)blocksStale,
+            (unsigned long long)blocksInvalidated,
+            blocksPromoted ? tierUpLatencyTotal / 1e3 / blocksPromoted : 0, tierUpLatencyMax / 1e3);
+    fprintf(stderr, "tiered: %llu block runs, %llu through chained exits (%llu links made, %llu cut), "
+            "dispatcher-exit rate %.1f%%\n", (unsigned long long)blockRuns, (unsigned long long)chainedRuns,
+            (unsigned long long)chainsLinked, (unsigned long long)chainsUnlinked,
+            blockRuns ? 100.0 * (blockRuns - chainedRuns) / blockRuns : 0);
+    fprintf(stderr, "tiered: %llu returns predicted by the shadow stack, %llu mispredicted\n",
+            (unsigned long long)returnsPredicted, (unsigned long long)returnsMispredicted);
+    fprintf(stderr, "tiered: %llu traces installed (%llu from cache, %.3f s compiling), %llu aborted, "
+            "%llu failed, %llu stale, %llu invalidated; trace latency mean %.1f ms, %llu trace runs\n",
+            (unsigned long long)tracesInstalled, (unsigned long long)tracesCached, traceCompileSeconds,
+            (unsigned long long)tracesAborted, (unsigned long long)tracesFailed, (unsigned long long)tracesStale,
+            (unsigned long long)tracesInvalidated, tracesInstalled ? traceLatencyTotal / 1e6 / tracesInstalled : 0,
+            (unsigned long long)traceRuns);
+    for (int tier = 0; tier < TIER_COUNT; tier++) {
+        fprintf(stderr, "tiered: tier %d ran %llu instructions (%.1f%%), %.1f%% of time\n", tier,
+                (unsigned long long)tierInstructions[tier], total ? 100.0 * tierInstructions[tier] / total : 0,
+                samples ? 100.0 * tierSamples[tier] / samples : 0);
+    }
+}
+
+/*
+ * Run the guest with the tiered engine until it stops.
+ *
+ * return: void
+ */
+void runTieredEngine()
+{
+    if (startCodeProtection() != 0) {
+        fprintf(stderr, "tiered: cannot catch stores into code, using switch\n");
+        runSwitchEngine();
+        return;
+    }
+    // SIGPROF samples the tier the interpreter is in, so the compile thread
+    // must not take it
+    sigset_t profSignal;
+    sigemptyset(&profSignal);
+    sigaddset(&profSignal, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &profSignal, NULL);
+    pthread_t compiler;
+    int error = pthread_create(&compiler, NULL, compileThread, NULL);
+    pthread_sigmask(SIG_UNBLOCK, &profSignal, NULL);
+    if (error) {
+        fprintf(stderr, "tiered: cannot start compile thread, using switch\n");
+        runSwitchEngine();
+        return;
+    }
+    invalidateCode = invalidateBlocks;
+    traceHost = (struct aotHost){
+        reg, writableMemory, opcodeCounts, translatedCode, &running, memRead, memWrite, executeTrapCode,
+        returnFromInterrupt, raiseException, checkInterrupts, detectSpinLoop, 0, 0, 0, 0
+    };
+
+    struct itimerval timer = {{0, TIER_SAMPLE_US}, {0, TIER_SAMPLE_US}};
+    if (benchEnabled) {
+        signal(SIGPROF, sampleTier);
+        setitimer(ITIMER_PROF, &timer, NULL);
+    }
+
+    startupMark(STARTUP_ENGINE_READY);
+    while (running) {
+        installCompletedBlocks();
+
+        uint16_t pc = reg[R_PC];
+        struct tierBlock *linkFrom = exitBlock;
+        exitBlock = NULL;
+        if (pc < MR_KBSR && !recording) {
+            cacheLookups++;
+            cacheHits += traceCache[pc] || blockCache[pc];
+            if (traceCache[pc]) {
+                runTrace(traceCache[pc]);
+                continue;
+            }
+            if (pc == traceCandidate) {
+                traceCandidate = -1;
+                recording = calloc(1, sizeof(*recording));
+                if (recording) {
+                    recording->start = pc;
+                }
+            } else if (blockCache[pc]) {
+                if (linkFrom && exitSlot != CHAIN_NONE && chainingEnabled && !linkFrom->links[exitSlot]) {
+                    linkBlocks(linkFrom, exitSlot, blockCache[pc]);
+                }
+                runBlocks(blockCache[pc]);
+                continue;
+            }
+        }
+
+        if (pc < MR_KBSR && hotness[pc] < UINT16_MAX && ++hotness[pc] == tierThreshold && !promotionPending[pc]) {
+            if (requestPromotion(pc, NULL) == 0) {
+                promotionPending[pc] = 1;
+            } else {
+                hotness[pc] = 0;  // Queue full: ask again later
+            }
+        }
+
+        // Interpret to the end of the block
+        uint16_t opCode;
+        do {
+            if (recording) {
+                opCode = recordInstruction();
+            } else {
+                uint16_t address = reg[R_PC];
+                opCode = stepInstruction();
+                if (opCode == OP_BR && reg[R_PC] <= address) {
+                    countLoopHeader(reg[R_PC]);
+                }
+            }
+            tierInstructions[0]++;
+        } while (running && !isControlFlow(opCode));
+    }
+
+    if (benchEnabled) {
+        struct itimerval off = {{0, 0}, {0, 0}};
+        setitimer(ITIMER_PROF, &off, NULL);
+        printTierStats();
+        cacheReport(stderr);
+        codeProtectionReport(stderr, tierInstructions[0] + tierInstructions[1] + tierInstructions[2]);
+    }
+
+    // The compile thread may be waiting for the host compiler; do not hold up
+    // the exit for a trace nobody will run.
+    pthread_mutex_lock(&requestLock);
+    compileStop = 1;
+    pthread_cond_signal(&requestReady);
+    pthread_mutex_unlock(&requestLock);
+    pthread_detach(compiler);
+}
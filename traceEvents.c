@@ -0,0 +1,240 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "callStack.h"
+#include "metrics.h"
+#include "symbols.h"
+#include "traceEvents.h"
+#include "virtualMachine.h"
+
+/*
+ * Chrome trace-event export (chrome://tracing, ui.perfetto.dev). A call
+ * listener turns every guest subroutine call and return into a begin/end
+ * pair and every trap routine into a complete event with its vector. The
+ * interpreter thread only stores a fixed-size record into a ring; a writer
+ * thread drains the ring, formats the JSON and writes the file, and adds an
+ * instructions-per-millisecond counter from opcodeCounts as it goes. If the
+ * writer falls behind and the ring fills up, events are dropped (and
+ * counted) rather than stalling the guest.
+ */
+
+#define EVENT_RING_SIZE (1 << 18)  // Events waiting for the writer (power of two)
+#define WRITER_PERIOD_NS 1000000   // How often the writer samples the counter, and how long it sleeps when idle
+#define WRITER_BATCH 4096          // Events formatted between checks of the clock
+
+struct traceEvent {
+    uint64_t ns;          // When it started (monotonicNs)
+    uint64_t durationNs;  // Trap routines only
+    uint16_t address;     // Subroutine entry, or trap vector
+    char phase;           // 'B', 'E' or 'X'
+};
+
+const char *traceEventsPath = NULL;  // --trace-events
+
+static struct traceEvent ring[EVENT_RING_SIZE];
+static _Atomic uint32_t ringHead = 0;  // Next slot the interpreter fills
+static _Atomic uint32_t ringTail = 0;  // Next slot the writer formats
+static uint64_t droppedEvents = 0;
+static uint32_t openFrames = 0;                   // Subroutines whose begin event was queued but not their end
+static uint8_t queuedFrames[CALL_STACK_DEPTH];  // Whether the begin event of each active frame was queued
+static atomic_int stopWriter = 0;
+static pthread_t writer;
+static FILE *out = NULL;
+static uint64_t startNs = 0;
+
+/*
+ * Queue an event for the writer. Runs on the interpreter thread. The end
+ * event of every subroutine whose begin event was queued must fit too, so
+ * room for those is held back: anything else is dropped once only that much
+ * room is left, and a begin event that is dropped takes its end event with
+ * it, so the trace stays balanced.
+ *
+ * event: The event
+ * return: 1 if it was queued, 0 if it was dropped
+ */
+static int pushEvent(struct traceEvent event)
+{
+    uint32_t head = atomic_load_explicit(&ringHead, memory_order_relaxed);
+    uint32_t used = head - atomic_load_explicit(&ringTail, memory_order_acquire);
+    if (event.phase != 'E' && used + openFrames >= EVENT_RING_SIZE) {
+        droppedEvents++;
+        return 0;
+    }
+    ring[head & (EVENT_RING_SIZE - 1)] = event;
+    atomic_store_explicit(&ringHead, head + 1, memory_order_release);
+    return 1;
+}
+
+/*
+ * Listener: a subroutine was called.
+ *
+ * depth: Its frame in callStack[]
+ * return: void
+ */
+static void traceCall(uint32_t depth)
+{
+    queuedFrames[depth] = pushEvent((struct traceEvent){monotonicNs(), 0, callStack[depth].entry, 'B'});
+    openFrames += queuedFrames[depth];
+}
+
+/*
+ * Listener: a subroutine returned.
+ *
+ * depth: Its frame in callStack[]
+ * return: void
+ */
+static void traceReturn(uint32_t depth)
+{
+    if (!queuedFrames[depth]) {
+        droppedEvents++;
+        return;
+    }
+    openFrames--;
+    pushEvent((struct traceEvent){monotonicNs(), 0, callStack[depth].entry, 'E'});
+}
+
+/*
+ * Listener: a trap routine ran.
+ *
+ * vector: Trap vector
+ * startNs: When it started
+ * endNs: When it finished
+ * return: void
+ */
+static void traceTrap(uint16_t vector, uint64_t startNs, uint64_t endNs)
+{
+    pushEvent((struct traceEvent){startNs, endNs - startNs, vector, 'X'});
+}
+
+static const struct callListener traceListener = {traceCall, traceReturn, traceTrap};
+
+/*
+ * Write one event.
+ *
+ * event: The event
+ * return: void
+ */
+static void writeEvent(const struct traceEvent *event)
+{
+    char buffer[SYMBOL_NAME_MAX + 8];
+    double ts = (event->ns - startNs) / 1e3;
+    if (event->phase == 'X') {
+        const char *name = trapNames[event->address & 0xFF];
+        if (name) {
+            fprintf(out, ",\n{\"name\":\"TRAP %s\"", name);
+        } else {
+            fprintf(out, ",\n{\"name\":\"TRAP x%02X\"", event->address);
+        }
+        fprintf(out, ",\"cat\":\"trap\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1,"
+                "\"args\":{\"vector\":\"x%02X\"}}", ts, event->durationNs / 1e3, event->address);
+    } else {
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"call\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":1}",
+                addressName(event->address, buffer), event->phase, ts);
+    }
+}
+
+/*
+ * Add a sample of the instruction rate since the previous one.
+ *
+ * now: Time of the sample
+ * return: void
+ */
+static void writeCounter(uint64_t now)
+{
+    static uint64_t lastNs = 0;
+    static uint64_t lastRetired = 0;
+    uint64_t retired = retiredInstructions();
+    if (lastNs && now > lastNs) {
+        fprintf(out, ",\n{\"name\":\"instructions\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"args\":{\"per ms\":%.0f}}",
+                (now - startNs) / 1e3, (retired - lastRetired) * 1e6 / (now - lastNs));
+    }
+    lastNs = now;
+    lastRetired = retired;
+}
+
+/*
+ * Body of the writer thread: format the queued events a batch at a time,
+ * sample the instruction rate every WRITER_PERIOD_NS, and sleep whenever
+ * the ring is empty. Drains the ring one last time once it is told to stop.
+ *
+ * arg: Unused
+ * return: NULL
+ */
+static void *writerThread(void *arg)
+{
+    (void)arg;
+    uint64_t nextSampleNs = 0;
+    for (;;) {
+        int stopping = atomic_load_explicit(&stopWriter, memory_order_acquire);
+        uint32_t tail = atomic_load_explicit(&ringTail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&ringHead, memory_order_acquire);
+        if (head - tail > WRITER_BATCH) {
+            head = tail + WRITER_BATCH;
+        }
+        for (; tail != head; tail++) {
+            writeEvent(&ring[tail & (EVENT_RING_SIZE - 1)]);
+        }
+        atomic_store_explicit(&ringTail, tail, memory_order_release);
+
+        uint64_t now = monotonicNs();
+        if (now >= nextSampleNs) {
+            writeCounter(now);
+            nextSampleNs = now + WRITER_PERIOD_NS;
+        }
+        if (tail != atomic_load_explicit(&ringHead, memory_order_acquire)) {
+            continue;
+        }
+        if (stopping) {
+            writeCounter(monotonicNs());
+            return NULL;
+        }
+        struct timespec pause = {0, WRITER_PERIOD_NS};
+        nanosleep(&pause, NULL);
+    }
+}
+
+/*
+ * Open the trace file, start the writer thread and start listening to
+ * calls and traps.
+ *
+ * return: 0 on success, -1 if the file could not be created or the thread
+ *         could not be started
+ */
+int startTraceEvents()
+{
+    out = fopen(traceEventsPath, "w");
+    if (!out) {
+        return -1;
+    }
+    startNs = monotonicNs();
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"LC-3 guest\"}}");
+    if (pthread_create(&writer, NULL, writerThread, NULL) != 0) {
+        fclose(out);
+        return -1;
+    }
+    addCallListener(&traceListener);
+    return 0;
+}
+
+/*
+ * End the calls still active, let the writer drain the ring and close the
+ * file.
+ *
+ * return: 0 on success, -1 if the file could not be written
+ */
+int finishTraceEvents()
+{
+    unwindCalls();
+    atomic_store_explicit(&stopWriter, 1, memory_order_release);
+    pthread_join(writer, NULL);
+    fprintf(out, "\n]}\n");
+    if (droppedEvents) {
+        fprintf(stderr, "trace events: %llu events dropped (the writer fell behind)\n",
+                (unsigned long long)droppedEvents);
+    }
+    return fclose(out) == 0 ? 0 : -1;
+}
@@ -0,0 +1,10 @@
+#ifndef TRACE_EVENTS_H
+#define TRACE_EVENTS_H
+
+extern const char *traceEventsPath;
+
+// Function prototypes
+int startTraceEvents();
+int finishTraceEvents();
+
+#endif
@@ -1,534 +1,1683 @@
-#include <stdint.h>
-#include <stdio.h>
-
-#define MAX_MEMORY (1 << 16)  // 16-bits (65536 in decimal)
-
-// Registers
-enum {
-    R_R0,    // General Register 0
-    R_R1,    // General Register 1
-    R_R2,    // General Register 2
-    R_R3,    // General Register 3
-    R_R4,    // General Register 4
-    R_R5,    // General Register 5
-    R_R6,    // General Register 6
-    R_R7,    // General Register 7
-    R_PC,    // Program Counter
-    R_COND,  // Flag Register
-    R_COUNT  // Number of Registers
-};
-
-// Condition Flags
-enum {
-    FL_POS = 1 << 0,  // P
-    FL_ZRO = 1 << 1,  // Z
-    FL_NEG = 1 << 2   // N
-};
-
-// Instructions
-enum {
-    OP_BR,   // Branch (opCode = 0000)
-    OP_ADD,  // Add (opCode = 0001)
-    OP_LD,   // Load (opCode = 0010)
-    OP_ST,   // Store (opCode = 0011)
-    OP_JSR,  // Jump to Subroutine (opCode = 0100)
-    OP_AND,  // Bitwise AND (opCode = 0101)
-    OP_LDR,  // Load Base + Offset (opCode = 0110)
-    OP_STR,  // Store Base + Offset (opCode = 0111)
-    OP_RTI,  // Unused (opCode = 1000)
-    OP_NOT,  // Bitwise NOT (opCode = 1001)
-    OP_LDI,  // Load Indirect (opCode = 1010)
-    OP_STI,  // Store Indirect (opCode = 1011)
-    OP_JMP,  // Jump (opCode = 1100)
-    OP_RES,  // Reserved (Unused) (opCode = 1101)
-    OP_LEA,  // Load Effective Address (opCode = 1110)
-    OP_TRAP  // Execute Trap (opCode = 1111)
-};
-
-// Trap Codes
-enum {
-    TRAP_GETC = 0x20,   // Read a single character from the keyboard. The character is not echoed onto the console.
-    TRAP_OUT = 0x21,    // Write a character in a register to the console display.
-    TRAP_PUTS = 0x22,   // Write a string of ASCII characters to the console display.
-    TRAP_IN = 0x23,     // Print a prompt on the screen and read a single character from the keyboard.
-    TRAP_PUTSP = 0x24,  // Write a string of ASCII characters to the console. (bytes)
-    TRAP_HALT = 0x25    // Halt execution and print a message on the console.
-};
-
-uint16_t memory[MAX_MEMORY];  // 16-bit memory for VM (64 KB)
-uint16_t reg[R_COUNT];        // 16-bit registers
-int running = 0;
-
-// Function prototypes
-uint16_t memRead(uint16_t address);
-uint16_t memWrite(uint16_t addr, uint16_t val);
-uint16_t extendSign(uint16_t bits, int bitCount);
-void updateFlags(uint16_t regMarker);
-void branch(uint16_t instruction);
-void add(uint16_t instruction);
-void load(uint16_t instruction);
-void store(uint16_t instruction);
-void jumpToSubroutine(uint16_t instruction);
-void bitwiseAnd(uint16_t instruction);
-void loadBaseOffset(uint16_t instruction);
-void storeBaseOffset(uint16_t instruction);
-void bitwiseNot(uint16_t instruction);
-void loadIndirect(uint16_t instruction);
-void storeIndirect(uint16_t instruction);
-void jump(uint16_t instruction);
-void loadEffectiveAddr(uint16_t instruction);
-void executeTrapCode(uint16_t instruction);
-void trapGetc();
-void trapOut();
-void trapPuts();
-void trapIn();
-void trapPutsp();
-void trapHalt();
-
-int main(int argc, char *argv[])
-{
-    reg[R_COND] = FL_ZRO;  // Set initial condition flag
-
-    // Set initial value of PC
-    // 0x3000 will be the starting point
-    uint16_t PC_START = 0x3000;
-    reg[R_PC] = PC_START;
-
-    running = 1;
-    while (running) {
-        // Fetch the instruction from the PC
-        uint16_t instruction = memRead(reg[R_PC]++);
-        uint16_t opCode = instruction >> 12;  // Get 4 leftmost bits for opCode
-
-        switch (opCode) {
-            case OP_BR:
-                branch(instruction);
-                break;
-            case OP_ADD:
-                add(instruction);
-                break;
-            case OP_LD:
-                load(instruction);
-                break;
-            case OP_ST:
-                store(instruction);
-                break;
-            case OP_JSR:
-                jumpToSubroutine(instruction);
-                break;
-            case OP_AND:
-                bitwiseAnd(instruction);
-                break;
-            case OP_LDR:
-                loadBaseOffset(instruction);
-                break;
-            case OP_STR:
-                storeBaseOffset(instruction);
-                break;
-            case OP_RTI:
-                abort();  // op code not used, so close program
-                break;
-            case OP_NOT:
-                bitwiseNot(instruction);
-                break;
-            case OP_LDI:
-                loadIndirect(instruction);
-                break;
-            case OP_STI:
-                storeIndirect(instruction);
-                break;
-            case OP_JMP:
-                jump(instruction);
-                break;
-            case OP_RES:
-                abort();  // op code not used, so close program
-                break;
-            case OP_LEA:
-                loadEffectiveAddr(instruction);
-                break;
-            case OP_TRAP:
-                // Implement code for Execute Trap
-                break;
-            default:
-                // Implement code for a bad op code
-                break;
-        }
-    }
-
-    return 0;
-}
-
-/*
- * If a value is negative, extend the bits to 16 bits such that the
- * the value remains negative. For example, 1 1111 will become
- * 1111 1111 1111 1111. For positive values, just fill in 0's to get
- * 16 bits (done by casting as a 16-bit int in the parameter).
- *
- * bits: The bits to be converted into a 16-bit int value
- * bitCount: The number of bits contained in the original argument value
- * return: 16-bit int value with respect for Two's Complement
- */
-uint16_t extendSign(uint16_t bits, int bitCount)
-{
-    if ((bits >> (bitCount - 1)) & 1) {
-        bits |= (0xFFFF << bitCount);
-    }
-
-    return bits;
-}
-
-/*
- * Write if a value written to a register is negative, zero, or
- * positive in the condition register.
- *
- * regMarker: Marks the register being examined for the condition flag.
- * return: Void
- */
-void updateFlags(uint16_t regMarker)
-{
-    // Using two'c compliment, a 1 being in the leftmost bit indicates
-    // a negative value.
-    if (reg[regMarker] >> 15) {
-        reg[R_COND] = FL_NEG;
-    } else if (reg[regMarker] == 0) {
-        reg[R_COND] = FL_ZRO;
-    } else {
-        reg[R_COND] = FL_POS;
-    }
-}
-
-/*
- * Branch operation to specify a new set of instructions to begin implementing
- * based on conditions set in the condition register.
- *
- * return: void
- */
-void branch(uint16_t instruction)
-{
-    uint16_t conditionFlag = (instruction >> 9) & 0x7;  // Test bits 11 - 9 for condition check
-    // if ((n AND N) OR (z AND Z) OR (p AND P))
-    if (conditionFlag & reg[R_COND]) {
-        uint16_t pcOffset = extendSign(instruction & 0x1FF, 9);
-        reg[R_PC] += pcOffset;  // PC = PC‡ + SEXT(PCoffset9)
-    }
-}
-
-/*
- * Add operation
- *
- * return: void
- */
-void add(uint16_t instruction)
-{
-    uint16_t destReg = (instruction >> 9) & 0x7;  // destination register
-    uint16_t immFlag = (instruction >> 5) & 0x1;  // indicates if in immediate mode
-    uint16_t srcReg1 = (instruction >> 6) & 0x7;  // first number to add (in reg[sr1])
-    // If immFlag is 0, use value stored in reg[srcReg2] for second operand.
-    // Else, use the 5-bit imm5 value with a sign extension.
-    if (!immFlag) {
-        uint16_t srcReg2 = instruction & 0x7;  // second number to add (in reg[sr2])
-        reg[destReg] = reg[srcReg1] + reg[srcReg2];
-    } else {
-        uint16_t imm5 = extendSign(instruction & 0x1F, 5);  // second number to add (given 5 bit value)
-        reg[destReg] = reg[srcReg1] + imm5;
-    }
-    updateFlags(destReg);
-}
-
-/*
- * Load instruction to move data in memory to a register.
- *
- * return: void
- */
-void load(uint16_t instruction)
-{
-    uint16_t destReg = (instruction >> 9) & 0x7;
-    uint16_t pcOffset = extendSign(instruction & 0x1FF, 9);
-    reg[destReg] = memRead(reg[R_PC] + pcOffset);
-    updateFlags(destReg);
-}
-
-/*
- * Store instruction to move data in a register to memory.
- *
- * return: void
- */
-void store(uint16_t instruction)
-{
-    uint16_t srcReg = (instruction >> 9) & 0x7;
-    uint16_t pcOffset = extendSign(instruction & 0x1FF, 9);
-    memWrite(reg[R_PC] + pcOffset, reg[srcReg]);
-}
-
-/*
- * Jump to subroutine instruction.
- *
- * return: void
- */
-void jumpToSubroutine(uint16_t instruction)
-{
-    uint16_t r7 = reg[R_PC];
-    uint16_t addrFlag = (instruction >> 11) & 0x1;
-    // If addrFlag is 0, pull address from a register.
-    // Else, use the last 11 bits of the instruction as the PC offset
-    // to get get the address.
-    if (!addrFlag) {
-        uint16_t baseReg = (instruction >> 6) & 0x7;
-        reg[R_PC] = reg[baseReg];
-    } else {
-        uint16_t pcOffset = extendSign(instruction & 0x7FF, 11);
-        reg[R_PC] += pcOffset;
-    }
-}
-
-/*
- * Bitwise AND instruction
- *
- * return: void
- */
-void bitwiseAnd(uint16_t instruction)
-{
-    uint16_t destReg = (instruction >> 9) & 0x7;
-    uint16_t srcReg1 = (instruction >> 6) & 0x7;
-    uint16_t immFlag = (instruction >> 5) & 0x1;
-    // If immFlag is 0, use value is reg[srcReg2] for AND operation.
-    // Else, use the provided 5-bit value in the imm5 postion with a sign
-    // extension for  the AND operation.
-    if (!immFlag) {
-        uint16_t srcReg2 = instruction & 0x7;
-        reg[destReg] = reg[srcReg1] + reg[srcReg2];
-    } else {
-        uint16_t imm5 = extendSign(instruction & 0x1F, 5);
-        reg[destReg] = reg[srcReg1] + imm5;
-    }
-    updateFlags(destReg);
-}
-
-/*
- * Load Base + Offset Instruction
- *
- * return: void
- */
-void loadBaseOffset(uint16_t instruction)
-{
-    uint16_t destReg = (instruction >> 9) & 0x7;
-    uint16_t baseReg = (instruction >> 6) & 0x7;
-    uint16_t offset = extendSign(instruction & 0x3F, 6);
-    reg[destReg] = memRead(reg[baseReg] + offset);
-    updateFlags(destReg);
-}
-
-/*
- * Store base + offset instruction
- *
- * return: void
- */
-void storeBaseOffset(uint16_t instruction)
-{
-    uint16_t srcReg = (instruction >> 9) & 0x7;
-    uint16_t baseReg = (instruction >> 6) & 0x7;
-    uint16_t offset = extendSign(instruction & 0x3F, 6);
-    memWrite(reg[baseReg] + offset, reg[srcReg]);
-}
-
-/*
- * Bitwise NOT instruction
- *
- * return: void
- */
-void bitwiseNot(uint16_t instruction)
-{
-    uint16_t destReg = (instruction >> 9) & 0x7;
-    uint16_t srcReg = (instruction >> 6) & 0x7;
-    reg[destReg] = ~reg[srcReg];
-    updateFlags(destReg);
-}
-
-/*
- * Load indirect instruction
- *
- * return: void
- */
-void loadIndirect(uint16_t instruction)
-{
-    uint16_t destReg = (instruction >> 9) & 0x7;
-    uint16_t pcOffset = extendSign(instruction & 0x1FF, 9);
-    reg[destReg] = memRead(memRead(reg[R_PC] + pcOffset));
-    updateFlags(destReg);
-}
-
-/*
- * Store indirect instruction
- *
- * return: void
- */
-void storeIndirect(uint16_t instruction)
-{
-    uint16_t srcReg = (instruction >> 9) & 0x7;
-    uint16_t pcOffset = extendSign(instruction & 0x1FF, 9);
-    memWrite(reg[R_PC] + pcOffset, reg[srcReg]);
-}
-
-/*
- * Jump instruction
- *
- * return: void
- */
-void jump(uint16_t instruction)
-{
-    uint16_t baseReg = (instruction >> 6) & 0x7;
-    reg[R_PC] = reg[baseReg];
-}
-
-/*
- * Load effective address instruction
- *
- * return: void
- */
-void loadEffectiveAddr(uint16_t instruction)
-{
-    uint16_t destReg = (instruction >> 9) & 0x7;
-    uint16_t pcOffset = extendSign(instruction & 0x1FF, 9);
-    reg[destReg] = reg[R_PC] + pcOffset;
-    updateFlags(destReg);
-}
-
-/*
- * Execute the trap code provided in 16-bit instruction (will
- * be contained in bits 7-0).
- *
- * return: void
- */
-void executeTrapCode(uint16_t instruction)
-{
-    uint16_t trapVect = instruction & 0xFF;
-    reg[R_R7] = reg[R_PC];
-    switch (trapVect) {
-        case TRAP_GETC:
-            trapGetc();
-            break;
-        case TRAP_OUT:
-            trapOut();
-            break;
-        case TRAP_PUTS:
-            trapPuts();
-            break;
-        case TRAP_IN:
-            trapIn();
-            break;
-        case TRAP_PUTSP:
-            trapPutsp();
-            break;
-        case TRAP_HALT:
-            trapHalt();
-            break;
-        default:
-            abort();  // End program if unknown trap code is present
-            break;
-    }
-}
-
-/*
- * Read a single character from the keyboard. The character is not echoed onto the
- * console. Its ASCII code is copied into R0. The high eight bits of R0 are cleared.
- *
- * return: void
- */
-void trapGetc()
-{
-    uint16_t inputChar = (uint16_t)getchar();  // High bits are naturally 0
-    reg[R_R0] = inputChar;
-    updateFlags(R_R0);
-}
-
-/*
- * Write a character in R0[7:0] to the console display.
- *
- * return: void
- */
-void trapOut()
-{
-    char c = (char)reg[R_R0];  // Character from R0
-    putchar(c);
-    fflush(stdout);  // Force output buffer to be outputted to OS
-}
-
-/*
- * x22 PUTS Write a string of ASCII characters to the console display. The characters are contained
- * in consecutive memory locations, one character per memory location, starting with
- * the address specified in R0. Writing terminates with the occurrence of x0000 in a
- * memory location.
- *
- * return: void
- */
-void trapPuts()
-{
-    uint16_t *c = memory + reg[R_R0];  // Memory address of where the first char is located
-    while (*c) {
-        putchar((char)*c);
-        c++;  // Move pointer to point to next uint16_t value address (2 bytes)
-    }
-    fflush(stdout);
-}
-
-/*
- * Print a prompt on the screen and read a single character from the keyboard. The
- * character is echoed onto the console monitor, and its ASCII code is copied into R0.
- * The high eight bits of R0 are cleared.
- *
- * return: void
- */
-void trapIn()
-{
-    // Get character and echo it on the screen
-    printf("Enter a single character: ");
-    char c = getchar();
-    putchar(c);
-    fflush(stdout);
-
-    // Store character in r0 and update flag
-    reg[R_R0] = (uint16_t)c;  // high eight bits are naturally 0
-    updateFlags(R_R0);
-}
-
-/*
- * Write a string of ASCII characters to the console. The characters are contained in
- * consecutive memory locations, two characters per memory location, starting with the
- * address specified in R0. The ASCII code contained in bits [7:0] of a memory location
- * is written to the console first. Then the ASCII code contained in bits [15:8] of that
- * memory location is written to the console. (A character string consisting of an odd
- * number of characters to be written will have x00 in bits [15:8] of the memory
- * location containing the last character to be written.) Writing terminates with the
- * occurrence of x0000 in a memory location.
- *
- * return: void
- */
-void trapPutsp()
-{
-    uint16_t *c = memory + reg[R_R0];
-    while (*c) {
-        // The rightmost eight bits will contain one character while the leftmost
-        // eight bits will possibly contain another character (assuming there is
-        // an even number of characters in the string).
-        char rightChar = ((char)*c) & 0xFF;
-        char leftChar = ((char)*c) >> 8;
-        putchar(rightChar);
-        if (leftChar) {
-            putchar(leftChar);
-        }
-        c++;  // Move pointer to point to next uint16_t value address (2 bytes)
-    }
-    fflush(stdout);
-}
-
-/*
- * Halt execution and print a message on the console.
- *
- * return: void
- */
-void trapHalt()
-{
-    prtinf("Machine has halted\n");
-    fflush(stdout);
-    running = 0;
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aot.h"
+#include "benchLog.h"
+#include "callGraph.h"
+#include "callStack.h"
+#include "codeCache.h"
+#include "codeProtection.h"
+#include "engine.h"
+#include "heatmap.h"
+#include "lockstep.h"
+#include "metrics.h"
+#include "perfCounters.h"
+#include "runReport.h"
+#include "sampleProfiler.h"
+#include "startup.h"
+#include "symbols.h"
+#include "traceEvents.h"
+#include "virtualMachine.h"
+#include "watchpoints.h"
+
+#define SPIN_MATCHES 2          // Identical iterations required before the VM is parked
+#define SPIN_PARK_TIMEOUT 100   // Longest time (ms) to block while parked
+#define INPUT_RING_SIZE 4096    // Keyboard ring capacity in bytes (power of two)
+#define INPUT_CHUNK 1024        // Largest read() the input thread issues
+
+uint16_t memory[MAX_MEMORY] __attribute__((aligned(MEMORY_ALIGNMENT)));  // 16-bit memory for VM (64 KB)
+uint16_t reg[R_COUNT];        // 16-bit registers
+uint16_t psr = PSR_USER;      // Privilege and priority bits of the PSR (condition codes live in reg[R_COND])
+uint16_t savedSSP = 0x3000;   // Supervisor stack pointer while running in user mode (Saved_SSP)
+uint16_t savedUSP = 0;        // User stack pointer while running in supervisor mode (Saved_USP)
+volatile sig_atomic_t running = 0;
+uint64_t opcodeCounts[OP_COUNT];  // Instructions retired per op code
+volatile int currentOpCode = 0;   // Op code being executed (read by samplers)
+uint8_t translatedCode[MAX_MEMORY];  // Number of translations covering each address
+void (*invalidateCode)(uint16_t address) = NULL;  // Called when a store hits translated code
+int boundaryChecks = 0;        // Engines call checkInterrupts() at every block boundary (--lockstep)
+struct termios originalTio;    // Terminal settings to restore on exit
+int terminalConfigured = 0;
+int perfCountersEnabled = 0;   // --perf-counters
+int benchEnabled = 0;          // --bench
+int engine = ENGINE_SWITCH;    // --engine
+const char *metricsSocket = NULL;  // --metrics-socket
+
+// Keyboard input ring. The input thread is the only producer and the
+// interpreter thread is the only consumer, so no locks are needed: each side
+// only ever writes its own index.
+uint8_t inputRing[INPUT_RING_SIZE];
+_Atomic uint32_t inputHead = 0;   // Next slot the input thread fills
+_Atomic uint32_t inputTail = 0;   // Next slot the interpreter reads
+uint32_t inputTailLocal = 0;      // Interpreter's private copy of inputTail
+atomic_int inputClosed = 0;       // Set once stdin has been exhausted
+int inputDoorbell[2] = {-1, -1};  // Pipe the input thread writes to after pushing bytes
+
+// Spin-loop detection state
+uint16_t spinHead = 0;            // Target of the backward branch being watched
+uint16_t spinRegs[R_COUNT];       // Registers the last time the loop head was reached
+uint16_t spinKbsr = 0;            // KBSR the last time the loop head was reached
+int spinPure = 0;                 // Loop body has no side effects other than device reads
+int spinReadsMemory = 0;          // Loop body contains a load (may be polling a device)
+int spinMatches = 0;              // Consecutive identical iterations seen
+
+static inline uint16_t executeInstruction() __attribute__((always_inline));
+#ifndef MICROBENCH
+static int startHelpers(const char *metricsSocket);
+static void runFastStart();
+static void runEngine();
+#endif
+
+// Name of each engine, as given to --engine
+const char *engineNames[ENGINE_COUNT] = {"switch", "tailcall", "goto", "table", "aot", "tiered", "locals"};
+
+// Name of the handler that executes each op code
+const char *opcodeNames[OP_COUNT] = {
+    "branch", "add", "load", "store", "jumpToSubroutine", "bitwiseAnd",
+    "loadBaseOffset", "storeBaseOffset", "returnFromInterrupt", "bitwiseNot",
+    "loadIndirect", "storeIndirect", "jump", "reserved", "loadEffectiveAddr",
+    "executeTrapCode"
+};
+
+#ifndef MICROBENCH
+int main(int argc, char *argv[])
+{
+    runStartNs = monotonicNs();
+    startupMark(STARTUP_MAIN);
+    int imageCount = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--perf-counters") == 0) {
+            perfCountersEnabled = 1;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            benchEnabled = 1;
+        } else if (strncmp(argv[i], "--bench-log=", 12) == 0) {
+            benchLogPath = argv[i] + 12;
+            benchEnabled = 1;
+        } else if (strncmp(argv[i], "--bench-compare=", 16) == 0) {
+            benchBaselinePath = argv[i] + 16;
+        } else if (strncmp(argv[i], "--bench-threshold=", 18) == 0) {
+            benchThreshold = atof(argv[i] + 18);
+        } else if (strcmp(argv[i], "--startup-stats") == 0) {
+            startupStats = 1;
+        } else if (strncmp(argv[i], "--fast-start=", 13) == 0) {
+            if (parseCount(argv[i] + 13, 0, UINT64_MAX, &fastStartInstructions) != 0) {
+                printUsage(argv[0]);
+                return 2;
+            }
+        } else if (strncmp(argv[i], "--aot-cache=", 12) == 0) {
+            aotCacheDir = argv[i] + 12;
+        } else if (strncmp(argv[i], "--tier-threshold=", 17) == 0) {
+            // Entries are counted in a uint16_t that stops at UINT16_MAX
+            uint64_t threshold;
+            if (parseCount(argv[i] + 17, 1, UINT16_MAX - 1, &threshold) != 0) {
+                printUsage(argv[0]);
+                return 2;
+            }
+            tierThreshold = (int)threshold;
+        } else if (strncmp(argv[i], "--trace-threshold=", 18) == 0) {
+            // Doubled after each failed recording, in a uint32_t
+            uint64_t threshold;
+            if (parseCount(argv[i] + 18, 0, UINT32_MAX >> TRACE_MAX_FAILURES, &threshold) != 0) {
+                printUsage(argv[0]);
+                return 2;
+            }
+            traceThreshold = (int)threshold;
+        } else if (strcmp(argv[i], "--no-chaining") == 0) {
+            chainingEnabled = 0;
+        } else if (strncmp(argv[i], "--code-cache=", 13) == 0) {
+            if (parseSize(argv[i] + 13, &codeCacheBudget) != 0) {
+                printUsage(argv[0]);
+                return 2;
+            }
+        } else if (strncmp(argv[i], "--code-cache-policy=", 20) == 0) {
+            codeCachePolicy = parseCachePolicy(argv[i] + 20);
+            if (codeCachePolicy < 0) {
+                printUsage(argv[0]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--aot-return-stack") == 0) {
+            aotReturnStack = 1;
+        } else if (strncmp(argv[i], "--watch=", 8) == 0) {
+            if (addWatchpoint(argv[i] + 8) != 0) {
+                fprintf(stderr, "Bad watchpoint: %s\n", argv[i] + 8);
+                printUsage(argv[0]);
+                return 2;
+            }
+        } else if (strncmp(argv[i], "--metrics-socket=", 17) == 0) {
+            metricsSocket = argv[i] + 17;
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profilePath = argv[i] + 10;
+        } else if (strncmp(argv[i], "--profile-hz=", 13) == 0) {
+            uint64_t hz;
+            if (parseCount(argv[i] + 13, 1, 1000000, &hz) != 0) {  // setitimer() counts microseconds
+                printUsage(argv[0]);
+                return 2;
+            }
+            profileHz = (int)hz;
+        } else if (strncmp(argv[i], "--call-graph=", 13) == 0) {
+            callGraphPath = argv[i] + 13;
+        } else if (strncmp(argv[i], "--symbols=", 10) == 0) {
+            if (loadSymbols(argv[i] + 10) < 0) {
+                fprintf(stderr, "Cannot read symbols: %s\n", argv[i] + 10);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--heatmap=", 10) == 0) {
+            heatmapPath = argv[i] + 10;
+        } else if (strncmp(argv[i], "--report=", 9) == 0) {
+            reportPath = argv[i] + 9;
+        } else if (strncmp(argv[i], "--trace-events=", 15) == 0) {
+            traceEventsPath = argv[i] + 15;
+        } else if (strncmp(argv[i], "--lockstep=", 11) == 0) {
+            lockstepEngine = parseEngine(argv[i] + 11);
+            if (lockstepEngine < 0) {
+                printUsage(argv[0]);
+                return 2;
+            }
+        } else if (strncmp(argv[i], "--lockstep-interval=", 20) == 0) {
+            if (parseCount(argv[i] + 20, 1, UINT64_MAX, &lockstepInterval) != 0) {
+                printUsage(argv[0]);
+                return 2;
+            }
+        } else if (strncmp(argv[i], "--engine=", 9) == 0) {
+            engine = parseEngine(argv[i] + 9);
+            if (engine < 0) {
+                printUsage(argv[0]);
+                return 2;
+            }
+        } else if (argv[i][0] == '-') {
+            printUsage(argv[0]);
+            return 2;
+        } else {
+            imageCount++;
+        }
+    }
+    startupMark(STARTUP_OPTIONS);
+    if (benchBaselinePath) {
+        // Compare mode: the one file named is a --bench-log, not an image
+        if (imageCount != 1) {
+            printUsage(argv[0]);
+            return 2;
+        }
+        int log = 1;
+        while (argv[log][0] == '-') {
+            log++;
+        }
+        return compareBenchLogs(argv[log]);
+    }
+    if (!imageCount) {
+        printUsage(argv[0]);
+        return 2;
+    }
+    if (heatmapPath && watchpointCount) {
+        fprintf(stderr, "--heatmap and --watch each need their own engine; use one at a time\n");
+        return 2;
+    }
+    if (profilePath && perfCountersEnabled) {
+        fprintf(stderr, "--profile and --perf-counters both sample with SIGPROF; use one at a time\n");
+        return 2;
+    }
+    if (fastStartInstructions
+        && (watchpointCount || heatmapPath || lockstepEngine >= 0 || profilePath || callGraphPath || traceEventsPath)) {
+        fprintf(stderr, "--fast-start runs the first instructions on the plain switch engine; it cannot be combined\n"
+                "with --watch, --heatmap, --lockstep, or with --profile, --call-graph or --trace-events, which\n"
+                "follow the guest's calls from the first one\n");
+        return 2;
+    }
+    if (lockstepEngine >= 0 && (watchpointCount || heatmapPath || profilePath || callGraphPath || traceEventsPath)) {
+        fprintf(stderr, "--lockstep runs its own engines; it cannot be combined with --watch, --heatmap, --profile,\n"
+                "--call-graph or --trace-events\n");
+        return 2;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            continue;
+        }
+        if (!readImage(argv[i])) {
+            printf("Failed to load image: %s\n", argv[i]);
+            return 1;
+        }
+        addBenchWorkload(argv[i]);
+    }
+    startupMark(STARTUP_IMAGES);
+
+    if (lockstepEngine >= 0 && startLockstep() != 0) {
+        fprintf(stderr, "lockstep: cannot start the second engine: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // SIGPROF samples the guest, so only the interpreter thread may take it;
+    // the input thread inherits the blocked mask
+    sigset_t profSignal;
+    sigemptyset(&profSignal);
+    sigaddset(&profSignal, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &profSignal, NULL);
+    signal(SIGINT, handleSignal);
+    disableInputBuffering();
+    startInputThread();
+    pthread_sigmask(SIG_UNBLOCK, &profSignal, NULL);
+
+    memory[MR_MCR] = MCR_CLOCK;
+    reg[R_COND] = FL_ZRO;  // Set initial condition flag
+
+    // Set initial value of PC
+    // 0x3000 will be the starting point
+    uint16_t PC_START = 0x3000;
+    reg[R_PC] = PC_START;
+    callRoot = PC_START;
+
+    struct timespec benchStart;
+    clock_gettime(CLOCK_MONOTONIC, &benchStart);
+
+    if (watchpointCount && engine != ENGINE_SWITCH) {
+        fprintf(stderr, "watchpoints: using the switch engine\n");
+        engine = ENGINE_SWITCH;
+    }
+    if (heatmapPath && engine != ENGINE_SWITCH) {
+        fprintf(stderr, "heatmap: using the switch engine\n");
+        engine = ENGINE_SWITCH;
+    }
+    if ((profilePath || callGraphPath || traceEventsPath) && engine != ENGINE_SWITCH) {
+        fprintf(stderr, "profile: using the switch engine\n");
+        engine = ENGINE_SWITCH;
+    }
+    startupMark(STARTUP_SETUP);
+
+    running = 1;
+    if (fastStartInstructions) {
+        runFastStart();
+    }
+    if (startHelpers(metricsSocket) != 0) {
+        restoreInputBuffering();
+        return 1;
+    }
+    startupMark(STARTUP_ENGINE_ENTER);
+    if (running) {
+        runEngine();
+    }
+
+    if (lockstepEngine >= 0) {
+        finishLockstep();  // The candidate exits here
+    }
+    if (benchEnabled) {
+        printBenchResult(&benchStart);
+    }
+    if (watchpointCount) {
+        watchpointReport(stderr);
+    }
+    if (heatmapPath && writeHeatmap(stderr) != 0) {
+        fprintf(stderr, "heatmap: cannot write %s: %s\n", heatmapPath, strerror(errno));
+    }
+    if (profilePath && finishSampleProfiler() != 0) {
+        fprintf(stderr, "profile: cannot write %s: %s\n", profilePath, strerror(errno));
+    }
+    if (callGraphPath) {
+        FILE *report = fopen(callGraphPath, "w");
+        if (report) {
+            callGraphReport(report);
+            fclose(report);
+        } else {
+            fprintf(stderr, "call graph: cannot write %s: %s\n", callGraphPath, strerror(errno));
+        }
+    }
+    if (traceEventsPath && finishTraceEvents() != 0) {
+        fprintf(stderr, "trace events: cannot write %s: %s\n", traceEventsPath, strerror(errno));
+    }
+    if (perfCountersEnabled) {
+        perfCountersStop();
+        perfCountersReport(stderr);
+    }
+    if (startupStats) {
+        startupReport(stderr);
+    }
+    writeRunReport();
+
+    restoreInputBuffering();
+    if (stopReason == STOP_INTERRUPTED) {
+        printf("\n");
+        return -2;
+    }
+    return stopReason == STOP_DIVERGENCE;
+}
+
+/*
+ * Start the optional helpers: the metrics server, trace events, the call
+ * graph, the sampling profiler and the hardware counters. They run before
+ * the first instruction, or after the first --fast-start instructions.
+ *
+ * metricsSocket: --metrics-socket path, or NULL
+ * return: 0 on success, -1 (with a message printed) if one could not start
+ */
+static int startHelpers(const char *metricsSocket)
+{
+    // SIGPROF samples the guest, so the helper threads must not take it
+    sigset_t profSignal;
+    sigemptyset(&profSignal);
+    sigaddset(&profSignal, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &profSignal, NULL);
+    if (metricsSocket && !lockstepCandidate && startMetricsServer(metricsSocket) != 0) {
+        fprintf(stderr, "metrics: cannot listen on %s: %s\n", metricsSocket, strerror(errno));
+        return -1;
+    }
+    if (traceEventsPath && startTraceEvents() != 0) {
+        fprintf(stderr, "trace events: cannot write %s: %s\n", traceEventsPath, strerror(errno));
+        return -1;
+    }
+    pthread_sigmask(SIG_UNBLOCK, &profSignal, NULL);
+
+    if (callGraphPath && startCallGraph() != 0) {
+        fprintf(stderr, "call graph: out of memory\n");
+        return -1;
+    }
+    if (profilePath && startSampleProfiler() != 0) {
+        fprintf(stderr, "profile: cannot start the profiling timer at %d Hz\n", profileHz);
+        return -1;
+    }
+    if (perfCountersEnabled) {
+        perfCountersStart();
+    }
+    startupMark(STARTUP_OPTIONAL_DONE);
+    return 0;
+}
+
+/*
+ * --fast-start: run the guest's first instructions on the switch engine,
+ * which needs no decoding or translation, before the optional helpers are
+ * started and the chosen engine is entered.
+ *
+ * return: void
+ */
+static void runFastStart()
+{
+    startupMark(STARTUP_FAST_START);
+    for (uint64_t i = 0; i < fastStartInstructions && running; i++) {
+        stepInstruction();
+    }
+    startupMark(STARTUP_FAST_DONE);
+}
+
+/*
+ * Run the guest on the chosen engine until it stops.
+ *
+ * return: void
+ */
+static void runEngine()
+{
+    switch (engine) {
+        case ENGINE_TAILCALL:
+            runTailCallEngine();
+            break;
+        case ENGINE_GOTO:
+            runGotoEngine();
+            break;
+        case ENGINE_TABLE:
+            runTableEngine();
+            break;
+        case ENGINE_AOT:
+            runAotEngine();
+            break;
+        case ENGINE_TIERED:
+            runTieredEngine();
+            break;
+        case ENGINE_LOCALS:
+            runLocalsEngine();
+            break;
+        default:
+            if (watchpointCount) {
+                runWatchedEngine();
+            } else if (heatmapPath) {
+                runHeatmapEngine();
+            } else if (lockstepEngine >= 0 && !lockstepCandidate) {
+                runLockstepEngine();
+            } else {
+                runSwitchEngine();
+            }
+            break;
+    }
+}
+#endif
+
+/*
+ * Reference interpreter: fetch, decode with a switch on the op code, and call
+ * the handler for the instruction until the machine stops running.
+ *
+ * return: void
+ */
+void runSwitchEngine()
+{
+    startupMark(STARTUP_ENGINE_READY);
+    while (running) {
+        executeInstruction();
+    }
+}
+
+/*
+ * Fetch, decode and execute a single instruction with the reference handlers.
+ * Other engines use this to interpret code they cannot run themselves.
+ *
+ * return: The op code of the instruction that was executed
+ */
+uint16_t stepInstruction()
+{
+    return executeInstruction();
+}
+
+/*
+ * Body of the reference interpreter loop. Always inlined so that
+ * runSwitchEngine() keeps a tight loop while stepInstruction() shares the
+ * same code.
+ *
+ * return: The op code of the instruction that was executed
+ */
+static inline uint16_t executeInstruction()
+{
+    // Fetch the instruction from the PC
+    uint16_t instruction = memRead(reg[R_PC]++);
+    uint16_t opCode = instruction >> 12;  // Get 4 leftmost bits for opCode
+    PROFILE_OPCODE(opCode);
+    opcodeCounts[opCode]++;
+
+    switch (opCode) {
+        case OP_BR: {
+            uint16_t branchAddr = reg[R_PC] - 1;
+            branch(instruction);
+            if (reg[R_PC] <= branchAddr) {
+                detectSpinLoop(branchAddr);  // Backward branch: possibly a polling loop
+            }
+            checkInterrupts();
+            break;
+        }
+        case OP_ADD:
+            add(instruction);
+            break;
+        case OP_LD:
+            load(instruction);
+            break;
+        case OP_ST:
+            store(instruction);
+            break;
+        case OP_JSR:
+            jumpToSubroutine(instruction);
+            checkInterrupts();
+            break;
+        case OP_AND:
+            bitwiseAnd(instruction);
+            break;
+        case OP_LDR:
+            loadBaseOffset(instruction);
+            break;
+        case OP_STR:
+            storeBaseOffset(instruction);
+            break;
+        case OP_RTI:
+            returnFromInterrupt();
+            checkInterrupts();
+            break;
+        case OP_NOT:
+            bitwiseNot(instruction);
+            break;
+        case OP_LDI:
+            loadIndirect(instruction);
+            break;
+        case OP_STI:
+            storeIndirect(instruction);
+            break;
+        case OP_JMP:
+            jump(instruction);
+            checkInterrupts();
+            break;
+        case OP_RES:
+            raiseException(INT_ILLEGAL_OP);  // op code not used
+            break;
+        case OP_LEA:
+            loadEffectiveAddr(instruction);
+            break;
+        case OP_TRAP:
+            executeTrapCode(instruction);
+            checkInterrupts();
+            break;
+        default:
+            // Implement code for a bad op code
+            break;
+    }
+
+    return opCode;
+}
+
+/*
+ * Instructions retired so far: the sum of the per op code counters. Safe to
+ * call from the helper threads, which read the counters with relaxed loads
+ * (see metrics.c).
+ *
+ * return: The count
+ */
+uint64_t retiredInstructions()
+{
+    uint64_t retired = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        retired += __atomic_load_n(&opcodeCounts[op], __ATOMIC_RELAXED);
+    }
+    return retired;
+}
+
+/*
+ * Print how long the engine ran and how fast it executed guest instructions.
+ *
+ * start: Time the engine was started
+ * return: void
+ */
+void printBenchResult(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+
+    uint64_t retired = retiredInstructions();
+    fprintf(stderr, "\nengine=%s instructions=%llu seconds=%.6f MIPS=%.2f ns/instr=%.3f\n",
+            engineNames[engine], (unsigned long long)retired, seconds,
+            seconds > 0 ? retired / seconds / 1e6 : 0, retired ? seconds * 1e9 / retired : 0);
+    if (benchLogPath) {
+        appendBenchLog(retired, seconds);
+    }
+}
+
+/*
+ * Print the command line usage.
+ *
+ * program: Name the VM was started with (argv[0])
+ * return: void
+ */
+void printUsage(const char *program)
+{
+    printf("Usage: %s [options] image-file1 [image-file2 ...]\n", program);
+    printf("Options:\n");
+    printf("  --perf-counters       Report hardware counters and a per-handler profile at exit\n");
+    printf("  --engine=NAME         Interpreter engine: switch (default), tailcall, goto,\n");
+    printf("                        table, aot, tiered, locals\n");
+    printf("  --tier-threshold=N    Block entries before the tiered engine promotes a block (default 50, at most 65534)\n");
+    printf("  --trace-threshold=N   Loop iterations before the tiered engine traces a loop (default 200, 0 = off)\n");
+    printf("  --no-chaining         Return to the tiered engine's dispatcher after every block\n");
+    printf("  --code-cache=BYTES    Budget for the tiered engine's blocks and traces, K/M/G suffixes\n");
+    printf("                        allowed (default 64M)\n");
+    printf("  --code-cache-policy=P What to evict when the budget is reached: lru (default), flush\n");
+    printf("  --aot-cache=DIR       Where translations are kept (default /tmp/lc3-aot-UID)\n");
+    printf("  --aot-return-stack    Predict returns with a shadow stack in aot translations\n");
+    printf("  --watch=SPEC          Watch ADDRESS[-LAST][,r|w|x...][,=VALUE][,stop[=N]][,log]; counts\n");
+    printf("                        hits and stops the guest at the Nth with stop (repeatable)\n");
+    printf("  --profile=FILE        Sample the guest call stack with SIGPROF and write folded stacks\n");
+    printf("                        for flame graphs to FILE (uses the switch engine)\n");
+    printf("  --profile-hz=N        Samples per second of CPU time for --profile (default 1000)\n");
+    printf("  --call-graph=FILE     Count instructions and trap time per guest subroutine and write a\n");
+    printf("                        gprof-style call graph to FILE (uses the switch engine)\n");
+    printf("  --symbols=FILE        Name subroutines in profiles from an lc3as symbol table (repeatable)\n");
+    printf("  --heatmap=FILE        Count data reads and writes per page and per instruction; write them\n");
+    printf("                        to FILE as CSV and draw them at exit and on SIGUSR1 (switch engine)\n");
+    printf("  --report=FILE         Write registers, stop reason and run counters to FILE as JSON when\n");
+    printf("                        the guest stops\n");
+    printf("  --trace-events=FILE   Write guest calls, trap routines and instructions per ms to FILE as\n");
+    printf("                        Chrome trace events for Perfetto (uses the switch engine)\n");
+    printf("  --startup-stats       Report the time spent in each start-up phase at exit\n");
+    printf("  --fast-start=N        Run the first N instructions on the switch engine before starting\n");
+    printf("                        counters, metrics and the chosen engine\n");
+    printf("  --lockstep=ENGINE     Run ENGINE alongside the switch engine and stop where they first differ\n");
+    printf("  --lockstep-interval=N Compare at the first block boundary or trap after N instructions\n");
+    printf("                        (default 1: every one)\n");
+    printf("  --metrics-socket=PATH Serve live counters in the Prometheus text format on a UNIX socket\n");
+    printf("  --bench               Report instructions executed and MIPS at exit\n");
+    printf("  --bench-log=FILE      Also append the --bench result, host and revision to FILE as JSON lines\n");
+    printf("Comparing benchmark logs: %s --bench-compare=BASELINE [--bench-threshold=PERCENT] FILE\n", program);
+    printf("  Tests each engine and workload in FILE against BASELINE (Mann-Whitney U) and exits with\n");
+    printf("  status 1 if one is significantly slower by more than PERCENT (default 2)\n");
+}
+
+/*
+ * Look up an engine by name.
+ *
+ * name: Engine name given on the command line
+ * return: The ENGINE_* value, or -1 if there is no such engine
+ */
+int parseEngine(const char *name)
+{
+    for (int i = 0; i < ENGINE_COUNT; i++) {
+        if (strcmp(name, engineNames[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Look up a code cache eviction policy by name.
+ *
+ * name: Policy name given on the command line
+ * return: The CACHE_* value, or -1 if there is no such policy
+ */
+int parseCachePolicy(const char *name)
+{
+    for (int i = 0; i < CACHE_POLICY_COUNT; i++) {
+        if (strcmp(name, cachePolicyNames[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Parse a decimal count given on the command line and check its range.
+ *
+ * text: The number given on the command line
+ * min: Smallest value allowed
+ * max: Largest value allowed
+ * count: Receives the count
+ * return: 0 on success, -1 if the text is not a count in the range
+ */
+int parseCount(const char *text, uint64_t min, uint64_t max, uint64_t *count)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (!isdigit((unsigned char)*text) || *end || errno || value < min || value > max) {
+        return -1;
+    }
+    *count = value;
+    return 0;
+}
+
+/*
+ * Parse a byte count with an optional K, M or G suffix.
+ *
+ * text: The number given on the command line
+ * bytes: Receives the byte count
+ * return: 0 on success, -1 if the text is not a byte count
+ */
+int parseSize(const char *text, size_t *bytes)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text || errno) {
+        return -1;
+    }
+    const char *suffix = strchr("KMG", toupper((unsigned char)*end));
+    if (*end && suffix) {
+        value <<= 10 * (suffix - "KMG" + 1);
+        end++;
+    }
+    if (*end) {
+        return -1;
+    }
+    *bytes = value;
+    return 0;
+}
+
+/*
+ * Load an LC-3 object file into memory. The first 16-bit word of the file is
+ * the origin (the address where the rest of the image is placed). All words
+ * are stored big-endian, so they are swapped into host order as they are read.
+ *
+ * imagePath: Path of the object file to load
+ * return: 1 if the image was loaded, 0 otherwise
+ */
+int readImage(const char *imagePath)
+{
+    FILE *file = fopen(imagePath, "rb");
+    if (!file) {
+        return 0;
+    }
+
+    uint16_t origin;
+    if (fread(&origin, sizeof(origin), 1, file) != 1) {
+        fclose(file);
+        return 0;
+    }
+    origin = (origin << 8) | (origin >> 8);
+
+    // Never read past the end of memory
+    size_t maxRead = MAX_MEMORY - origin;
+    uint16_t *p = memory + origin;
+    size_t wordsRead = fread(p, sizeof(uint16_t), maxRead, file);
+    while (wordsRead-- > 0) {
+        *p = (*p << 8) | (*p >> 8);
+        p++;
+    }
+
+    fclose(file);
+    return 1;
+}
+
+/*
+ * Put the terminal into raw, non-canonical mode without echo so that every
+ * key press reaches the input thread as soon as it is typed, the way the
+ * KBSR/KBDR device expects.
+ *
+ * return: void
+ */
+void disableInputBuffering()
+{
+    if (tcgetattr(STDIN_FILENO, &originalTio) != 0) {
+        return;  // Not a terminal (e.g. input is piped in)
+    }
+
+    struct termios newTio = originalTio;
+    newTio.c_lflag &= ~ICANON & ~ECHO;
+    newTio.c_cc[VMIN] = 1;   // read() returns as soon as one byte is available
+    newTio.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &newTio);
+    terminalConfigured = 1;
+}
+
+/*
+ * Restore the terminal settings saved by disableInputBuffering().
+ *
+ * return: void
+ */
+void restoreInputBuffering()
+{
+    if (terminalConfigured) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &originalTio);
+        terminalConfigured = 0;
+    }
+}
+
+/*
+ * Stop the guest when the VM is interrupted (Ctrl-C). Only async-signal-safe
+ * work happens here; main() restores the terminal and writes the reports on
+ * its normal exit path. Every engine checks the KBSR interrupt enable bit at
+ * block boundaries, so setting it makes even a guest spinning in translated
+ * code reach checkInterrupts() and see that the machine has stopped, and the
+ * doorbell wakes the interpreter if it is waiting for input.
+ *
+ * signal: The signal that was received
+ * return: void
+ */
+void handleSignal(int signal)
+{
+    (void)signal;
+    stopReason = STOP_INTERRUPTED;
+    running = 0;
+    writableMemory[MR_KBSR] |= KB_IE;  // The view that is never write-protected
+    ringDoorbell();
+}
+
+/*
+ * Start the terminal input thread. If the thread or its doorbell cannot be
+ * created, the VM cannot read input, so the program is closed.
+ *
+ * return: void
+ */
+void startInputThread()
+{
+    if (pipe(inputDoorbell) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    fcntl(inputDoorbell[0], F_SETFL, O_NONBLOCK);
+    fcntl(inputDoorbell[1], F_SETFL, O_NONBLOCK);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, inputThread, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/*
+ * Body of the terminal input thread. Reads stdin in large chunks and pushes
+ * the bytes into the input ring, ringing the doorbell once per chunk so the
+ * interpreter can sleep while it waits for input. If the ring is full the
+ * thread waits for the interpreter to catch up.
+ *
+ * arg: Unused
+ * return: NULL
+ */
+void *inputThread(void *arg)
+{
+    (void)arg;
+    uint8_t chunk[INPUT_CHUNK];
+
+    for (;;) {
+        ssize_t bytesRead = read(STDIN_FILENO, chunk, sizeof(chunk));
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            break;
+        }
+
+        ssize_t pushed = 0;
+        while (pushed < bytesRead) {
+            uint32_t head = atomic_load_explicit(&inputHead, memory_order_relaxed);
+            uint32_t tail = atomic_load_explicit(&inputTail, memory_order_acquire);
+            uint32_t space = INPUT_RING_SIZE - (head - tail);
+            if (!space) {
+                struct timespec pause = {0, 1000000};  // 1 ms
+                nanosleep(&pause, NULL);
+                continue;
+            }
+
+            uint32_t count = bytesRead - pushed < space ? bytesRead - pushed : space;
+            for (uint32_t i = 0; i < count; i++) {
+                inputRing[(head + i) & (INPUT_RING_SIZE - 1)] = chunk[pushed + i];
+            }
+            atomic_store_explicit(&inputHead, head + count, memory_order_release);
+            pushed += count;
+        }
+        metricAdd(&metrics[METRICS_INPUT].bytesIn, bytesRead);
+        ringDoorbell();
+    }
+
+    atomic_store_explicit(&inputClosed, 1, memory_order_release);
+    ringDoorbell();
+    return NULL;
+}
+
+/*
+ * Wake the interpreter thread if it is waiting for input.
+ *
+ * return: void
+ */
+void ringDoorbell()
+{
+    char signalByte = 1;
+    ssize_t ignored = write(inputDoorbell[1], &signalByte, 1);  // A full pipe already wakes the reader
+    (void)ignored;
+}
+
+/*
+ * Count bytes written to the console since the last flush.
+ *
+ * bytes: Bytes written
+ * return: void
+ */
+static void countOutput(uint64_t bytes)
+{
+    metricAdd(&metrics[METRICS_VM].bytesOut, bytes);
+    if (bytes > atomic_load_explicit(&metrics[METRICS_VM].outputPeak, memory_order_relaxed)) {
+        atomic_store_explicit(&metrics[METRICS_VM].outputPeak, bytes, memory_order_relaxed);
+    }
+}
+
+/*
+ * Note that the guest is about to block waiting for input, so that a scrape
+ * during the wait includes it.
+ *
+ * return: Time the wait started
+ */
+static uint64_t startInputWait()
+{
+    uint64_t start = monotonicNs();
+    atomic_store_explicit(&metrics[METRICS_VM].inputBlockedSince, start, memory_order_relaxed);
+    return start;
+}
+
+/*
+ * Count a finished wait for input as time blocked.
+ *
+ * start: Time the wait started
+ * return: void
+ */
+static void finishInputWait(uint64_t start)
+{
+    atomic_store_explicit(&metrics[METRICS_VM].inputBlockedSince, 0, memory_order_relaxed);
+    metricAdd(&metrics[METRICS_VM].inputBlockedNs, monotonicNs() - start);
+}
+
+/*
+ * Sleep until the input thread rings the doorbell or the timeout expires,
+ * then clear any pending rings. The time asleep is counted as time blocked
+ * in input.
+ *
+ * timeout: Longest time to wait in milliseconds (-1 waits forever)
+ * return: void
+ */
+void waitForDoorbell(int timeout)
+{
+    uint64_t start = startInputWait();
+    struct pollfd doorbell = {inputDoorbell[0], POLLIN, 0};
+    if (poll(&doorbell, 1, timeout) > 0) {
+        char drain[64];
+        while (read(inputDoorbell[0], drain, sizeof(drain)) > 0) {
+        }
+    }
+    finishInputWait(start);
+}
+
+/*
+ * Check whether a character can be read from the keyboard without blocking.
+ * This is a single atomic load of the producer's index.
+ *
+ * return: 1 if a character is waiting, 0 otherwise
+ */
+int keyAvailable()
+{
+    return atomic_load_explicit(&inputHead, memory_order_acquire) != inputTailLocal;
+}
+
+/*
+ * Take the next character from the input ring, sleeping until one arrives.
+ *
+ * return: The character read, or EOF once stdin is exhausted
+ */
+int readKey()
+{
+    while (!keyAvailable()) {
+        if (!running) {
+            return EOF;  // Interrupted while waiting
+        }
+        if (atomic_load_explicit(&inputClosed, memory_order_acquire) && !keyAvailable()) {
+            return EOF;
+        }
+        waitForDoorbell(-1);
+    }
+
+    uint8_t c = inputRing[inputTailLocal & (INPUT_RING_SIZE - 1)];
+    atomic_store_explicit(&inputTail, ++inputTailLocal, memory_order_release);
+    return c;
+}
+
+/*
+ * Move a waiting character from the keyboard into KBDR and set the ready bit
+ * in KBSR. Nothing happens if KBDR still holds a character the program has
+ * not read yet.
+ *
+ * return: void
+ */
+void pollKeyboard()
+{
+    if ((memory[MR_KBSR] & KB_READY) || !keyAvailable()) {
+        return;
+    }
+
+    memory[MR_KBDR] = (uint16_t)readKey();
+    memory[MR_KBSR] |= KB_READY;
+}
+
+/*
+ * Read a 16-bit value from memory. Addresses in the device register page
+ * (xFE00 - xFFFF) are routed to the device they belong to.
+ *
+ * address: Address to read from
+ * return: Value stored at the address
+ */
+uint16_t memRead(uint16_t address)
+{
+    if (address < MR_KBSR) {
+        return memory[address];
+    }
+
+    switch (address) {
+        case MR_KBSR:
+            pollKeyboard();
+            return memory[MR_KBSR];
+        case MR_KBDR:
+            memory[MR_KBSR] &= ~KB_READY;  // Reading KBDR consumes the character
+            return memory[MR_KBDR];
+        case MR_DSR:
+            return DS_READY;  // Output is written synchronously, so always ready
+        case MR_PSR:
+            return psr | reg[R_COND];
+        default:
+            return memory[address];
+    }
+}
+
+/*
+ * Write a 16-bit value to memory. Addresses in the device register page
+ * (xFE00 - xFFFF) are routed to the device they belong to, and writes to
+ * addresses that an engine has translated invalidate the translation: by
+ * faulting on the write-protected page where SMC_PAGE_PROTECTION is
+ * available (see codeProtection.c), otherwise by checking every store.
+ *
+ * addr: Address to write to
+ * val: Value to write
+ * return: The value written
+ */
+uint16_t memWrite(uint16_t addr, uint16_t val)
+{
+    if (addr < MR_KBSR) {
+        memory[addr] = val;
+#ifndef SMC_PAGE_PROTECTION
+        if (translatedCode[addr]) {
+            invalidateCode(addr);  // Self-modifying code: drop stale translations
+        }
+#endif
+        return val;
+    }
+
+    switch (addr) {
+        case MR_KBSR:
+            // Only the interrupt enable bit can be written by a program
+            memory[MR_KBSR] = (memory[MR_KBSR] & KB_READY) | (val & KB_IE);
+            break;
+        case MR_DDR:
+            putchar((char)val);
+            countOutput(1);
+            fflush(stdout);
+            break;
+        case MR_PSR:
+            psr = val & (PSR_USER | PSR_PRIORITY);
+            reg[R_COND] = val & PSR_COND;
+            break;
+        case MR_MCR:
+            memory[MR_MCR] = val;
+            if (!(val & MCR_CLOCK)) {
+                stopReason = STOP_CLOCK;
+                running = 0;
+            }
+            break;
+        default:
+            memory[addr] = val;
+            break;
+    }
+    return val;
+}
+
+/*
+ * Start servicing an interrupt or exception. The PSR and PC are pushed onto
+ * the supervisor stack (switching R6 to it if the program was in user mode),
+ * the processor enters supervisor mode at the given priority, and execution
+ * continues at the address found in the interrupt vector table.
+ *
+ * vector: Offset of the service routine's entry in the interrupt vector table
+ * priority: Priority level to run the service routine at
+ * return: void
+ */
+void raiseInterrupt(uint16_t vector, uint16_t priority)
+{
+    uint16_t oldPsr = psr | reg[R_COND];
+    if (psr & PSR_USER) {
+        savedUSP = reg[R_R6];
+        reg[R_R6] = savedSSP;
+    }
+
+    memWrite(--reg[R_R6], oldPsr);
+    memWrite(--reg[R_R6], reg[R_PC]);
+
+    psr = (priority << 8) & PSR_PRIORITY;  // Supervisor mode
+    reg[R_PC] = memRead(INT_VECTOR_TABLE + vector);
+}
+
+/*
+ * Raise an exception. Exceptions run at the current priority level. If the
+ * program has not installed a handler for the exception, there is nothing
+ * sensible to return to, so the program is closed.
+ *
+ * vector: Offset of the handler's entry in the interrupt vector table
+ * return: void
+ */
+void raiseException(uint16_t vector)
+{
+    if (!memory[INT_VECTOR_TABLE + vector]) {
+        stopReason = vector == INT_PRIVILEGE ? STOP_PRIVILEGE_VIOLATION : STOP_ILLEGAL_OPCODE;
+        writeRunReport();
+        restoreInputBuffering();
+        abort();
+    }
+    raiseInterrupt(vector, (psr & PSR_PRIORITY) >> 8);
+}
+
+/*
+ * Check for a pending keyboard interrupt. This is only called at block
+ * boundaries (after instructions that can change the flow of control) so the
+ * straight-line instructions never pay for it. The common case, interrupts
+ * disabled, costs a single load. In the --lockstep candidate every engine
+ * calls it at every block boundary, and it also offers the state to the
+ * reference once any interrupt has been taken.
+ *
+ * return: void
+ */
+void checkInterrupts()
+{
+    if ((memory[MR_KBSR] & KB_IE) && running && ((psr & PSR_PRIORITY) >> 8) < PL_KEYBOARD) {
+        pollKeyboard();
+        if (memory[MR_KBSR] & KB_READY) {
+            raiseInterrupt(INT_KEYBOARD, PL_KEYBOARD);
+        }
+    }
+    if (boundaryChecks && running) {
+        lockstepBoundary();
+    }
+}
+
+/*
+ * Check that every instruction in a loop body is free of side effects: only
+ * branches, register arithmetic and loads are allowed. Loads may read device
+ * registers, which is fine because reading KBSR/KBDR while no key is waiting
+ * changes nothing.
+ *
+ * head: Address of the first instruction of the loop
+ * branchAddr: Address of the backward branch closing the loop
+ * return: 1 if the loop body has no side effects, 0 otherwise
+ */
+int isPureLoop(uint16_t head, uint16_t branchAddr)
+{
+    spinReadsMemory = 0;
+    for (uint16_t addr = head; addr != branchAddr; addr++) {
+        switch (memory[addr] >> 12) {
+            case OP_BR:
+            case OP_ADD:
+            case OP_AND:
+            case OP_NOT:
+            case OP_LEA:
+                break;
+            case OP_LD:
+            case OP_LDR:
+            case OP_LDI:
+                spinReadsMemory = 1;
+                break;
+            default:
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Called after a backward branch is taken. If the loop is short, has no side
+ * effects, and two consecutive iterations start from exactly the same machine
+ * state, then every following iteration will be identical until keyboard
+ * input arrives (nothing else can change memory, registers or devices). The
+ * host thread is then parked until input is available instead of running the
+ * loop millions of times. Nothing about the guest's view of execution changes:
+ * once a key arrives the loop continues from where it was.
+ *
+ * branchAddr: Address of the backward branch that was taken
+ * return: void
+ */
+void detectSpinLoop(uint16_t branchAddr)
+{
+    uint16_t head = reg[R_PC];
+    if ((uint16_t)(branchAddr - head) >= SPIN_MAX_BODY) {
+        return;
+    }
+
+    if (head != spinHead) {
+        spinHead = head;
+        spinPure = isPureLoop(head, branchAddr);
+        spinMatches = 0;
+    } else if (spinPure && memory[MR_KBSR] == spinKbsr
+               && memcmp(reg, spinRegs, sizeof(reg)) == 0) {
+        spinMatches++;
+    } else {
+        spinMatches = 0;
+    }
+    memcpy(spinRegs, reg, sizeof(reg));
+    spinKbsr = memory[MR_KBSR];
+
+    if (spinMatches < SPIN_MATCHES) {
+        return;
+    }
+
+    // Only park when the keyboard can end the wait: the loop is polling a
+    // device register or a keyboard interrupt can be delivered.
+    int interruptible = (memory[MR_KBSR] & KB_IE) && ((psr & PSR_PRIORITY) >> 8) < PL_KEYBOARD;
+    if (spinReadsMemory || interruptible) {
+        waitForInput();
+    }
+}
+
+/*
+ * Block the host thread until the input thread delivers keyboard input or
+ * the park timeout expires. Once stdin is exhausted no input will ever
+ * arrive, so just sleep for the timeout.
+ *
+ * return: void
+ */
+void waitForInput()
+{
+    if (keyAvailable()) {
+        return;
+    }
+    if (atomic_load_explicit(&inputClosed, memory_order_acquire)) {
+        uint64_t start = startInputWait();
+        poll(NULL, 0, SPIN_PARK_TIMEOUT);
+        finishInputWait(start);
+        return;
+    }
+    waitForDoorbell(SPIN_PARK_TIMEOUT);
+}
+
+/*
+ * Return from interrupt. Pops the PC and PSR off the supervisor stack and,
+ * when returning to user mode, swaps R6 back to the user stack. Executing RTI
+ * in user mode is a privilege mode violation.
+ *
+ * return: void
+ */
+void returnFromInterrupt()
+{
+    if (psr & PSR_USER) {
+        raiseException(INT_PRIVILEGE);
+        return;
+    }
+
+    reg[R_PC] = memRead(reg[R_R6]++);
+    uint16_t newPsr = memRead(reg[R_R6]++);
+    psr = newPsr & (PSR_USER | PSR_PRIORITY);
+    reg[R_COND] = newPsr & PSR_COND;
+
+    if (psr & PSR_USER) {
+        savedSSP = reg[R_R6];
+        reg[R_R6] = savedUSP;
+    }
+}
+
+/*
+ * If a value is negative, extend the bits to 16 bits such that the
+ * the value remains negative. For example, 1 1111 will become
+ * 1111 1111 1111 1111. For positive values, just fill in 0's to get
+ * 16 bits (done by casting as a 16-bit int in the parameter).
+ *
+ * bits: The bits to be converted into a 16-bit int value
+ * bitCount: The number of bits contained in the original argument value
+ * return: 16-bit int value with respect for Two's Complement
+ */
+uint16_t extendSign(uint16_t bits, int bitCount)
+{
+    if ((bits >> (bitCount - 1)) & 1) {
+        bits |= (0xFFFF << bitCount);
+    }
+
+    return bits;
+}
+
+/*
+ * Write if a value written to a register is negative, zero, or
+ * positive in the condition register.
+ *
+ * regMarker: Marks the register being examined for the condition flag.
+ * return: Void
+ */
+void updateFlags(uint16_t regMarker)
+{
+    // Using two'c compliment, a 1 being in the leftmost bit indicates
+    // a negative value.
+    if (reg[regMarker] >> 15) {
+        reg[R_COND] = FL_NEG;
+    } else if (reg[regMarker] == 0) {
+        reg[R_COND] = FL_ZRO;
+    } else {
+        reg[R_COND] = FL_POS;
+    }
+}
+
+/*
+ * Branch operation to specify a new set of instructions to begin implementing
+ * based on conditions set in the condition register.
+ *
+ * return: void
+ */
+void branch(uint16_t instruction)
+{
+    uint16_t conditionFlag = (instruction >> 9) & 0x7;  // Test bits 11 - 9 for condition check
+    // if ((n AND N) OR (z AND Z) OR (p AND P))
+    if (conditionFlag & reg[R_COND]) {
+        uint16_t pcOffset = extendSign(instruction & 0x1FF, 9);
+        reg[R_PC] += pcOffset;  // PC = PC‡ + SEXT(PCoffset9)
+    }
+}
+
+/*
+ * Add operation
+ *
+ * return: void
+ */
+void add(uint16_t instruction)
+{
+    uint16_t destReg = (instruction >> 9) & 0x7;  // destination register
+    uint16_t immFlag = (instruction >> 5) & 0x1;  // indicates if in immediate mode
+    uint16_t srcReg1 = (instruction >> 6) & 0x7;  // first number to add (in reg[sr1])
+    // If immFlag is 0, use value stored in reg[srcReg2] for second operand.
+    // Else, use the 5-bit imm5 value with a sign extension.
+    if (!immFlag) {
+        uint16_t srcReg2 = instruction & 0x7;  // second number to add (in reg[sr2])
+        reg[destReg] = reg[srcReg1] + reg[srcReg2];
+    } else {
+        uint16_t imm5 = extendSign(instruction & 0x1F, 5);  // second number to add (given 5 bit value)
+        reg[destReg] = reg[srcReg1] + imm5;
+    }
+    updateFlags(destReg);
+}
+
+/*
+ * Load instruction to move data in memory to a register.
+ *
+ * return: void
+ */
+void load(uint16_t instruction)
+{
+    uint16_t destReg = (instruction >> 9) & 0x7;
+    uint16_t pcOffset = extendSign(instruction & 0x1FF, 9);
+    reg[destReg] = memRead(reg[R_PC] + pcOffset);
+    updateFlags(destReg);
+}
+
+/*
+ * Store instruction to move data in a register to memory.
+ *
+ * return: void
+ */
+void store(uint16_t instruction)
+{
+    uint16_t srcReg = (instruction >> 9) & 0x7;
+    uint16_t pcOffset = extendSign(instruction & 0x1FF, 9);
+    memWrite(reg[R_PC] + pcOffset, reg[srcReg]);
+}
+
+/*
+ * Jump to subroutine instruction.
+ *
+ * return: void
+ */
+void jumpToSubroutine(uint16_t instruction)
+{
+    uint16_t r7 = reg[R_PC];
+    uint16_t addrFlag = (instruction >> 11) & 0x1;
+    // If addrFlag is 0, pull address from a register.
+    // Else, use the last 11 bits of the instruction as the PC offset
+    // to get get the address.
+    if (!addrFlag) {
+        uint16_t baseReg = (instruction >> 6) & 0x7;
+        reg[R_PC] = reg[baseReg];
+    } else {
+        uint16_t pcOffset = extendSign(instruction & 0x7FF, 11);
+        reg[R_PC] += pcOffset;
+    }
+    reg[R_R7] = r7;
+    if (callTracking) {
+        atomic_signal_fence(memory_order_release);  // New PC first, then the frame (see jump())
+        callEnter(reg[R_PC], r7);
+    }
+}
+
+/*
+ * Bitwise AND instruction
+ *
+ * return: void
+ */
+void bitwiseAnd(uint16_t instruction)
+{
+    uint16_t destReg = (instruction >> 9) & 0x7;
+    uint16_t srcReg1 = (instruction >> 6) & 0x7;
+    uint16_t immFlag = (instruction >> 5) & 0x1;
+    // If immFlag is 0, use value is reg[srcReg2] for AND operation.
+    // Else, use the provided 5-bit value in the imm5 postion with a sign
+    // extension for  the AND operation.
+    if (!immFlag) {
+        uint16_t srcReg2 = instruction & 0x7;
+        reg[destReg] = reg[srcReg1] & reg[srcReg2];
+    } else {
+        uint16_t imm5 = extendSign(instruction & 0x1F, 5);
+        reg[destReg] = reg[srcReg1] & imm5;
+    }
+    updateFlags(destReg);
+}
+
+/*
+ * Load Base + Offset Instruction
+ *
+ * return: void
+ */
+void loadBaseOffset(uint16_t instruction)
+{
+    uint16_t destReg = (instruction >> 9) & 0x7;
+    uint16_t baseReg = (instruction >> 6) & 0x7;
+    uint16_t offset = extendSign(instruction & 0x3F, 6);
+    reg[destReg] = memRead(reg[baseReg] + offset);
+    updateFlags(destReg);
+}
+
+/*
+ * Store base + offset instruction
+ *
+ * return: void
+ */
+void storeBaseOffset(uint16_t instruction)
+{
+    uint16_t srcReg = (instruction >> 9) & 0x7;
+    uint16_t baseReg = (instruction >> 6) & 0x7;
+    uint16_t offset = extendSign(instruction & 0x3F, 6);
+    memWrite(reg[baseReg] + offset, reg[srcReg]);
+}
+
+/*
+ * Bitwise NOT instruction
+ *
+ * return: void
+ */
+void bitwiseNot(uint16_t instruction)
+{
+    uint16_t destReg = (instruction >> 9) & 0x7;
+    uint16_t srcReg = (instruction >> 6) & 0x7;
+    reg[destReg] = ~reg[srcReg];
+    updateFlags(destReg);
+}
+
+/*
+ * Load indirect instruction
+ *
+ * return: void
+ */
+void loadIndirect(uint16_t instruction)
+{
+    uint16_t destReg = (instruction >> 9) & 0x7;
+    uint16_t pcOffset = extendSign(instruction & 0x1FF, 9);
+    reg[destReg] = memRead(memRead(reg[R_PC] + pcOffset));
+    updateFlags(destReg);
+}
+
+/*
+ * Store indirect instruction
+ *
+ * return: void
+ */
+void storeIndirect(uint16_t instruction)
+{
+    uint16_t srcReg = (instruction >> 9) & 0x7;
+    uint16_t pcOffset = extendSign(instruction & 0x1FF, 9);
+    memWrite(memRead(reg[R_PC] + pcOffset), reg[srcReg]);
+}
+
+/*
+ * Jump instruction
+ *
+ * return: void
+ */
+void jump(uint16_t instruction)
+{
+    uint16_t baseReg = (instruction >> 6) & 0x7;
+    uint16_t target = reg[baseReg];
+    if (callTracking && baseReg == R_R7) {
+        // RET: pop the frame before the PC leaves it, so a SIGPROF sample
+        // never pairs the caller's PC with the callee's frame
+        callReturn(target);
+        atomic_signal_fence(memory_order_release);
+    }
+    reg[R_PC] = target;
+}
+
+/*
+ * Load effective address instruction
+ *
+ * return: void
+ */
+void loadEffectiveAddr(uint16_t instruction)
+{
+    uint16_t destReg = (instruction >> 9) & 0x7;
+    uint16_t pcOffset = extendSign(instruction & 0x1FF, 9);
+    reg[destReg] = reg[R_PC] + pcOffset;
+    updateFlags(destReg);
+}
+
+/*
+ * Execute the trap code provided in 16-bit instruction (will
+ * be contained in bits 7-0).
+ *
+ * return: void
+ */
+void executeTrapCode(uint16_t instruction)
+{
+    uint16_t trapVect = instruction & 0xFF;
+    if (lockstepEngine >= 0 && lockstepCheckpoint() != 0) {
+        return;  // The engines diverged
+    }
+    reg[R_R7] = reg[R_PC];
+    metricAdd(&metrics[METRICS_VM].traps[trapVect], 1);
+    uint64_t trapStart = callListenerCount ? monotonicNs() : 0;
+    switch (trapVect) {
+        case TRAP_GETC:
+            trapGetc();
+            break;
+        case TRAP_OUT:
+            trapOut();
+            break;
+        case TRAP_PUTS:
+            trapPuts();
+            break;
+        case TRAP_IN:
+            trapIn();
+            break;
+        case TRAP_PUTSP:
+            trapPutsp();
+            break;
+        case TRAP_HALT:
+            trapHalt();
+            break;
+        default:
+            stopReason = STOP_UNKNOWN_TRAP;
+            writeRunReport();
+            restoreInputBuffering();
+            abort();  // End program if unknown trap code is present
+            break;
+    }
+    if (callListenerCount) {
+        callTrap(trapVect, trapStart);
+    }
+}
+
+/*
+ * Read a single character from the keyboard. The character is not echoed onto the
+ * console. Its ASCII code is copied into R0. The high eight bits of R0 are cleared.
+ *
+ * return: void
+ */
+void trapGetc()
+{
+    uint16_t inputChar = (uint16_t)readKey();  // High bits are naturally 0
+    reg[R_R0] = inputChar;
+    updateFlags(R_R0);
+}
+
+/*
+ * Write a character in R0[7:0] to the console display.
+ *
+ * return: void
+ */
+void trapOut()
+{
+    char c = (char)reg[R_R0];  // Character from R0
+    putchar(c);
+    fflush(stdout);  // Force output buffer to be outputted to OS
+    countOutput(1);
+}
+
+/*
+ * x22 PUTS Write a string of ASCII characters to the console display. The characters are contained
+ * in consecutive memory locations, one character per memory location, starting with
+ * the address specified in R0. Writing terminates with the occurrence of x0000 in a
+ * memory location.
+ *
+ * return: void
+ */
+void trapPuts()
+{
+    uint16_t *c = memory + reg[R_R0];  // Memory address of where the first char is located
+    while (*c) {
+        putchar((char)*c);
+        c++;  // Move pointer to point to next uint16_t value address (2 bytes)
+    }
+    fflush(stdout);
+    countOutput(c - (memory + reg[R_R0]));
+}
+
+/*
+ * Print a prompt on the screen and read a single character from the keyboard. The
+ * character is echoed onto the console monitor, and its ASCII code is copied into R0.
+ * The high eight bits of R0 are cleared.
+ *
+ * return: void
+ */
+void trapIn()
+{
+    // Get character and echo it on the screen
+    int written = printf("Enter a single character: ");
+    char c = readKey();
+    putchar(c);
+    fflush(stdout);
+    countOutput(written + 1);
+
+    // Store character in r0 and update flag
+    reg[R_R0] = (uint16_t)c;  // high eight bits are naturally 0
+    updateFlags(R_R0);
+}
+
+/*
+ * Write a string of ASCII characters to the console. The characters are contained in
+ * consecutive memory locations, two characters per memory location, starting with the
+ * address specified in R0. The ASCII code contained in bits [7:0] of a memory location
+ * is written to the console first. Then the ASCII code contained in bits [15:8] of that
+ * memory location is written to the console. (A character string consisting of an odd
+ * number of characters to be written will have x00 in bits [15:8] of the memory
+ * location containing the last character to be written.) Writing terminates with the
+ * occurrence of x0000 in a memory location.
+ *
+ * return: void
+ */
+void trapPutsp()
+{
+    uint16_t *c = memory + reg[R_R0];
+    uint64_t written = 0;
+    while (*c) {
+        // The rightmost eight bits will contain one character while the leftmost
+        // eight bits will possibly contain another character (assuming there is
+        // an even number of characters in the string).
+        char rightChar = ((char)*c) & 0xFF;
+        char leftChar = (char)(*c >> 8);
+        putchar(rightChar);
+        written++;
+        if (leftChar) {
+            putchar(leftChar);
+            written++;
+        }
+        c++;  // Move pointer to point to next uint16_t value address (2 bytes)
+    }
+    fflush(stdout);
+    countOutput(written);
+}
+
+/*
+ * Halt execution and print a message on the console.
+ *
+ * return: void
+ */
+void trapHalt()
+{
+    int written = printf("Machine has halted\n");
+    fflush(stdout);
+    countOutput(written);
+    stopReason = STOP_HALT;
+    running = 0;
 }
\ No newline at end of file
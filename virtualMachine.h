@@ -0,0 +1,175 @@
+#ifndef VIRTUAL_MACHINE_H
+#define VIRTUAL_MACHINE_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_MEMORY (1 << 16)  // 16-bits (65536 in decimal)
+#define OP_COUNT 16           // Number of op codes (4-bit op code field)
+#define SPIN_MAX_BODY 8       // Longest loop body (in instructions) checked for spinning
+
+// The per-handler breakdown of --perf-counters needs every engine to publish
+// the op code it is executing, a store per guest instruction, so it is only
+// compiled in with -DHANDLER_PROFILE (make handler-profile).
+#ifdef HANDLER_PROFILE
+#define PROFILE_OPCODE(opCode) (currentOpCode = (opCode))
+#else
+#define PROFILE_OPCODE(opCode) ((void)0)
+#endif
+
+// Registers
+enum {
+    R_R0,    // General Register 0
+    R_R1,    // General Register 1
+    R_R2,    // General Register 2
+    R_R3,    // General Register 3
+    R_R4,    // General Register 4
+    R_R5,    // General Register 5
+    R_R6,    // General Register 6
+    R_R7,    // General Register 7
+    R_PC,    // Program Counter
+    R_COND,  // Flag Register
+    R_COUNT  // Number of Registers
+};
+
+// Condition Flags
+enum {
+    FL_POS = 1 << 0,  // P
+    FL_ZRO = 1 << 1,  // Z
+    FL_NEG = 1 << 2   // N
+};
+
+// Instructions
+enum {
+    OP_BR,   // Branch (opCode = 0000)
+    OP_ADD,  // Add (opCode = 0001)
+    OP_LD,   // Load (opCode = 0010)
+    OP_ST,   // Store (opCode = 0011)
+    OP_JSR,  // Jump to Subroutine (opCode = 0100)
+    OP_AND,  // Bitwise AND (opCode = 0101)
+    OP_LDR,  // Load Base + Offset (opCode = 0110)
+    OP_STR,  // Store Base + Offset (opCode = 0111)
+    OP_RTI,  // Unused (opCode = 1000)
+    OP_NOT,  // Bitwise NOT (opCode = 1001)
+    OP_LDI,  // Load Indirect (opCode = 1010)
+    OP_STI,  // Store Indirect (opCode = 1011)
+    OP_JMP,  // Jump (opCode = 1100)
+    OP_RES,  // Reserved (Unused) (opCode = 1101)
+    OP_LEA,  // Load Effective Address (opCode = 1110)
+    OP_TRAP  // Execute Trap (opCode = 1111)
+};
+
+// Trap Codes
+enum {
+    TRAP_GETC = 0x20,   // Read a single character from the keyboard. The character is not echoed onto the console.
+    TRAP_OUT = 0x21,    // Write a character in a register to the console display.
+    TRAP_PUTS = 0x22,   // Write a string of ASCII characters to the console display.
+    TRAP_IN = 0x23,     // Print a prompt on the screen and read a single character from the keyboard.
+    TRAP_PUTSP = 0x24,  // Write a string of ASCII characters to the console. (bytes)
+    TRAP_HALT = 0x25    // Halt execution and print a message on the console.
+};
+
+// Memory Mapped Registers
+enum {
+    MR_KBSR = 0xFE00,  // Keyboard Status Register
+    MR_KBDR = 0xFE02,  // Keyboard Data Register
+    MR_DSR = 0xFE04,   // Display Status Register
+    MR_DDR = 0xFE06,   // Display Data Register
+    MR_PSR = 0xFFFC,   // Processor Status Register
+    MR_MCR = 0xFFFE    // Machine Control Register
+};
+
+// Device Status Bits
+enum {
+    KB_READY = 1 << 15,  // KBSR[15]: a character is waiting in KBDR
+    KB_IE = 1 << 14,     // KBSR[14]: interrupt enable
+    DS_READY = 1 << 15,  // DSR[15]: display is ready for another character
+    MCR_CLOCK = 1 << 15  // MCR[15]: clock enable, clearing it stops the machine
+};
+
+// Processor Status Register
+enum {
+    PSR_USER = 1 << 15,           // PSR[15]: 0 = supervisor mode, 1 = user mode
+    PSR_PRIORITY = 0x7 << 8,      // PSR[10:8]: priority level of the running program
+    PSR_COND = 0x7                // PSR[2:0]: condition codes (kept in reg[R_COND])
+};
+
+// Interrupts and Exceptions
+enum {
+    INT_VECTOR_TABLE = 0x0100,  // Base address of the interrupt vector table
+    INT_PRIVILEGE = 0x00,       // Privilege mode violation exception
+    INT_ILLEGAL_OP = 0x01,      // Illegal op code exception
+    INT_KEYBOARD = 0x80,        // Keyboard interrupt
+    PL_KEYBOARD = 4             // Priority level of the keyboard interrupt
+};
+
+extern uint16_t memory[MAX_MEMORY];
+extern uint16_t reg[R_COUNT];
+extern uint16_t psr;
+extern volatile sig_atomic_t running;
+extern int benchEnabled;
+extern uint64_t opcodeCounts[OP_COUNT];
+extern volatile int currentOpCode;
+extern const char *opcodeNames[OP_COUNT];
+extern uint8_t translatedCode[MAX_MEMORY];
+extern void (*invalidateCode)(uint16_t address);
+extern int boundaryChecks;
+extern uint16_t spinHead;
+extern int spinPure;
+
+struct timespec;
+
+// Function prototypes
+void printUsage(const char *program);
+int parseEngine(const char *name);
+int parseCachePolicy(const char *name);
+int parseCount(const char *text, uint64_t min, uint64_t max, uint64_t *count);
+int parseSize(const char *text, size_t *bytes);
+uint64_t retiredInstructions();
+void printBenchResult(const struct timespec *start);
+uint16_t stepInstruction();
+int readImage(const char *imagePath);
+void disableInputBuffering();
+void restoreInputBuffering();
+void handleSignal(int signal);
+void startInputThread();
+void *inputThread(void *arg);
+void ringDoorbell();
+void waitForDoorbell(int timeout);
+int keyAvailable();
+int readKey();
+void pollKeyboard();
+uint16_t memRead(uint16_t address);
+uint16_t memWrite(uint16_t addr, uint16_t val);
+void raiseInterrupt(uint16_t vector, uint16_t priority);
+void raiseException(uint16_t vector);
+void checkInterrupts();
+void returnFromInterrupt();
+int isPureLoop(uint16_t head, uint16_t branchAddr);
+void detectSpinLoop(uint16_t branchAddr);
+void waitForInput();
+uint16_t extendSign(uint16_t bits, int bitCount);
+void updateFlags(uint16_t regMarker);
+void branch(uint16_t instruction);
+void add(uint16_t instruction);
+void load(uint16_t instruction);
+void store(uint16_t instruction);
+void jumpToSubroutine(uint16_t instruction);
+void bitwiseAnd(uint16_t instruction);
+void loadBaseOffset(uint16_t instruction);
+void storeBaseOffset(uint16_t instruction);
+void bitwiseNot(uint16_t instruction);
+void loadIndirect(uint16_t instruction);
+void storeIndirect(uint16_t instruction);
+void jump(uint16_t instruction);
+void loadEffectiveAddr(uint16_t instruction);
+void executeTrapCode(uint16_t instruction);
+void trapGetc();
+void trapOut();
+void trapPuts();
+void trapIn();
+void trapPutsp();
+void trapHalt();
+
+#endif
@@ -0,0 +1,229 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode.h"
+#include "engine.h"
+#include "runReport.h"
+#include "startup.h"
+#include "virtualMachine.h"
+#include "watchpoints.h"
+
+/*
+ * Memory watchpoints. None of the engines know about them: when any are set
+ * the VM runs the reference handlers through runWatchedEngine(), which works
+ * out what the next instruction will read, write and execute before it runs
+ * it, and only looks at the watchpoints when a page flag says the page has
+ * one. Without watchpoints nothing changes, whatever the engine.
+ *
+ * Accesses are those of the instructions themselves (fetch, LD, LDR, LDI,
+ * ST, STR, STI); memory the trap routines read and the stack pushes of
+ * interrupts are not watched.
+ */
+
+struct watchpoint {
+    uint16_t first;
+    uint16_t last;
+    int types;          // WATCH_* bits
+    int conditional;
+    uint16_t value;     // Value read or written that triggers it, if conditional
+    uint64_t stopAfter; // Hit that stops the machine (0: never)
+    int log;            // Print every hit
+    uint64_t hits;
+};
+
+int watchpointCount = 0;
+static struct watchpoint watchpoints[MAX_WATCHPOINTS];
+static uint8_t watchedPages[MAX_MEMORY >> 8];  // WATCH_* bits of the watchpoints on each 256-word page
+
+static const char *accessNames[] = {"", "read", "write", "", "exec"};
+
+/*
+ * Parse an address or value: x3000, 0x3000, #12 or 12.
+ *
+ * text: The number
+ * end: Receives the first character after it
+ * value: Receives the number
+ * return: 0 on success, -1 if there is no number or it does not fit 16 bits
+ */
+static int parseWord(const char *text, const char **end, uint16_t *value)
+{
+    const char *digits = text;
+    int base = 0;
+    if (text[0] == 'x' || text[0] == 'X') {
+        digits = text + 1;
+        base = 16;
+    } else if (text[0] == '#') {
+        digits = text + 1;
+        base = 10;
+    }
+
+    char *stop;
+    long number = strtol(digits, &stop, base);
+    if (stop == digits || number < -0x8000 || number > 0xFFFF) {
+        return -1;
+    }
+    *value = (uint16_t)number;
+    *end = stop;
+    return 0;
+}
+
+/*
+ * Add a watchpoint from its command line form:
+ * ADDRESS[-LAST][,TYPES][,=VALUE][,stop[=N]][,log], where TYPES is any of r,
+ * w and x (default w).
+ *
+ * spec: The watchpoint, as given to --watch
+ * return: 0 on success, -1 if it cannot be parsed or there are too many
+ */
+int addWatchpoint(const char *spec)
+{
+    if (watchpointCount == MAX_WATCHPOINTS) {
+        return -1;
+    }
+    struct watchpoint watch = {0};
+    const char *next;
+    if (parseWord(spec, &next, &watch.first) != 0) {
+        return -1;
+    }
+    watch.last = watch.first;
+    if (*next == '-' && (parseWord(next + 1, &next, &watch.last) != 0 || watch.last < watch.first)) {
+        return -1;
+    }
+
+    while (*next == ',') {
+        const char *option = next + 1;
+        next = option + strcspn(option, ",");
+        size_t length = next - option;
+        if (option[0] == '=') {
+            const char *end;
+            if (parseWord(option + 1, &end, &watch.value) != 0 || end != next) {
+                return -1;
+            }
+            watch.conditional = 1;
+        } else if (length == 3 && strncmp(option, "log", 3) == 0) {
+            watch.log = 1;
+        } else if (length >= 4 && strncmp(option, "stop", 4) == 0) {
+            watch.stopAfter = 1;
+            if (length > 4) {
+                char *end;
+                watch.stopAfter = strtoull(option + 5, &end, 10);
+                if (option[4] != '=' || end != next || !watch.stopAfter) {
+                    return -1;
+                }
+            }
+        } else if (length && strspn(option, "rwx") >= length) {
+            for (size_t i = 0; i < length; i++) {
+                watch.types |= option[i] == 'r' ? WATCH_READ : option[i] == 'w' ? WATCH_WRITE : WATCH_EXEC;
+            }
+        } else {
+            return -1;
+        }
+    }
+    if (*next) {
+        return -1;
+    }
+    if (!watch.types) {
+        watch.types = WATCH_WRITE;
+    }
+
+    for (int page = watch.first >> 8; page <= watch.last >> 8; page++) {
+        watchedPages[page] |= watch.types;
+    }
+    watchpoints[watchpointCount++] = watch;
+    return 0;
+}
+
+/*
+ * Count an access against every watchpoint it triggers, and stop the
+ * machine if one of them says so.
+ *
+ * access: The access
+ * pc: Address of the instruction making it
+ * return: 1 if the machine was stopped, 0 otherwise
+ */
+static int checkAccess(const struct memoryAccess *access, uint16_t pc)
+{
+    int stopped = 0;
+    for (int i = 0; i < watchpointCount; i++) {
+        struct watchpoint *watch = &watchpoints[i];
+        if (!(watch->types & access->type) || access->address < watch->first || access->address > watch->last
+            || (watch->conditional && access->value != watch->value)) {
+            continue;
+        }
+
+        watch->hits++;
+        int stop = watch->hits == watch->stopAfter;
+        if (watch->log || stop) {
+            fprintf(stderr, "watchpoint %d: %s x%04X value x%04X at PC x%04X (hit %llu)\n", i + 1,
+                    accessNames[access->type], access->address, access->value, pc, (unsigned long long)watch->hits);
+        }
+        if (stop) {
+            fprintf(stderr, "watchpoint %d: stopped; R0-R7", i + 1);
+            for (int r = R_R0; r <= R_R7; r++) {
+                fprintf(stderr, " x%04X", reg[r]);
+            }
+            fprintf(stderr, " PC x%04X COND x%04X\n", reg[R_PC], reg[R_COND]);
+            stopReason = STOP_WATCHPOINT;
+            running = 0;
+            stopped = 1;
+        }
+    }
+    return stopped;
+}
+
+/*
+ * Run the guest with the reference handlers, checking every instruction's
+ * accesses against the watchpoints. Executes stop the machine before the
+ * instruction runs, reads and writes right after it.
+ *
+ * return: void
+ */
+void runWatchedEngine()
+{
+    startupMark(STARTUP_ENGINE_READY);
+    while (running) {
+        struct memoryAccess accesses[MAX_ACCESSES];
+        int count = nextAccesses(accesses);
+        uint16_t pc = reg[R_PC];
+        int watched = 0;
+        for (int i = 0; i < count; i++) {
+            watched |= watchedPages[accesses[i].address >> 8] & accesses[i].type;
+        }
+
+        if (!watched) {
+            stepInstruction();
+            continue;
+        }
+        if ((watched & WATCH_EXEC) && checkAccess(&accesses[0], pc)) {
+            break;
+        }
+        stepInstruction();
+        for (int i = 1; i < count; i++) {
+            if (watchedPages[accesses[i].address >> 8] & accesses[i].type) {
+                checkAccess(&accesses[i], pc);
+            }
+        }
+    }
+}
+
+/*
+ * Print how often each watchpoint was hit.
+ *
+ * out: Where to print
+ * return: void
+ */
+void watchpointReport(FILE *out)
+{
+    for (int i = 0; i < watchpointCount; i++) {
+        const struct watchpoint *watch = &watchpoints[i];
+        fprintf(out, "watchpoint %d: x%04X-x%04X %s%s%s", i + 1, watch->first, watch->last,
+                watch->types & WATCH_READ ? "r" : "", watch->types & WATCH_WRITE ? "w" : "",
+                watch->types & WATCH_EXEC ? "x" : "");
+        if (watch->conditional) {
+            fprintf(out, " =x%04X", watch->value);
+        }
+        fprintf(out, ": %llu hits\n", (unsigned long long)watch->hits);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef WATCHPOINTS_H
+#define WATCHPOINTS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "decode.h"
+
+#define MAX_WATCHPOINTS 16
+
+// Accesses a watchpoint can trigger on
+enum {
+    WATCH_READ = ACCESS_READ,
+    WATCH_WRITE = ACCESS_WRITE,
+    WATCH_EXEC = ACCESS_EXEC
+};
+
+extern int watchpointCount;
+
+// Function prototypes
+int addWatchpoint(const char *spec);
+void runWatchedEngine();
+void watchpointReport(FILE *out);
+
+#endif